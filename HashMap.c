@@ -1,92 +1,307 @@
 // File provided by the author of a project.
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "HashMap.h"
+#include "epoch.h"
+#include "err.h"
+#include "hash.h"
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+// Smallest table that is ever allocated. Empty maps have no table at all.
+#define MIN_BUCKETS 8
+
+// The table grows (to twice its size) when there are more entries than buckets
+// and shrinks when fewer than 1/SHRINK_RATIO of the buckets would be used.
+#define SHRINK_RATIO 8
+
+// Number of buckets of the old table moved to the new one on each insert or
+// remove while a resize is in progress, and the maximum number of empty buckets
+// skipped on the way. Rehashing is spread over many operations this way, so no
+// single insert pays for moving the whole table.
+#define REHASH_STEP 4
+#define REHASH_EMPTY_VISITS (10 * REHASH_STEP)
+
+// hmap_get_optimistic gives up after following this many pairs in one table,
+// which only happens when it races with a writer.
+#define OPTIMISTIC_MAX_CHAIN 256
+
+// Links followed by hmap_get_optimistic are written with PUBLISH and read with
+// READ, so that a concurrent optimistic reader sees either the old or the new
+// pointer, and initialized memory behind it.
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
 
 typedef struct Pair Pair;
 
 struct Pair {
-    char *key;
     void *value;
+    uint64_t hash; // Full hash of key, so rehashing never rereads the key.
     Pair *next; // Next item in a single-linked list.
+    char key[]; // Copy of the key, allocated together with the pair.
+};
+
+typedef struct Table Table;
+
+struct Table {
+    size_t mask; // Number of buckets minus one; the number is a power of two.
+    Pair *buckets[]; // Linked lists of key-value pairs.
 };
 
 struct HashMap {
-    Pair *buckets[N_BUCKETS]; // Linked lists of key-value pairs.
+    Table *table; // Table new entries go to; NULL if nothing was ever inserted.
+    Table *old; // Table being drained into `table` during a resize, or NULL.
+    size_t rehash_index; // Buckets of `old` below this index are already moved.
     size_t size; // total number of entries in map.
+    Arena *arena; // Where the memory comes from; NULL for malloc.
 };
 
-static unsigned int get_hash(const char *key);
-
 HashMap *hmap_new() {
-    HashMap *map = malloc(sizeof(HashMap));
+    return hmap_new_in(NULL);
+}
+
+HashMap *hmap_new_in(Arena *arena) {
+    HashMap *map = arena ? arena_alloc(arena, sizeof(HashMap)) : malloc(sizeof(HashMap));
     if (!map)
         return NULL;
     memset(map, 0, sizeof(HashMap));
+    map->arena = arena;
     return map;
 }
 
-void hmap_free(HashMap *map) {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair *p = map->buckets[h]; p;) {
+static void *map_alloc(HashMap *map, size_t size) {
+    void *memory = map->arena ? arena_alloc(map->arena, size) : malloc(size);
+    if (!memory)
+        fatal("malloc failed");
+    return memory;
+}
+
+// Frees memory from map_alloc, directly or (if `retire` is set) once
+// concurrent optimistic lookups cannot be reading it.
+static void map_release(Arena *arena, void *ptr, size_t size, bool retire) {
+    if (arena && retire)
+        arena_retire(arena, ptr, size);
+    else if (arena)
+        arena_release(arena, ptr, size);
+    else if (retire)
+        epoch_retire(ptr, free);
+    else
+        free(ptr);
+}
+
+static size_t table_bytes(size_t n_buckets) {
+    return sizeof(Table) + n_buckets * sizeof(Pair *);
+}
+
+static size_t pair_bytes(const Pair *p) {
+    return sizeof(Pair) + strlen(p->key) + 1;
+}
+
+static Table *table_new(HashMap *map, size_t n_buckets) {
+    Table *table = map_alloc(map, table_bytes(n_buckets));
+    memset(table, 0, table_bytes(n_buckets));
+    table->mask = n_buckets - 1;
+    return table;
+}
+
+// Frees the table and its pairs.
+static void table_free(HashMap *map, Table *table, bool retire) {
+    if (!table)
+        return;
+    for (size_t h = 0; h <= table->mask; ++h) {
+        for (Pair *p = table->buckets[h]; p;) {
             Pair *q = p;
             p = p->next;
-            free(q->key);
-            free(q);
+            map_release(map->arena, q, pair_bytes(q), retire);
         }
     }
-    free(map);
+    map_release(map->arena, table, table_bytes(table->mask + 1), retire);
+}
+
+void hmap_free(HashMap *map) {
+    table_free(map, map->table, false);
+    table_free(map, map->old, false);
+    map_release(map->arena, map, sizeof(HashMap), false);
+}
+
+void hmap_retire(HashMap *map) {
+    table_free(map, map->table, true);
+    table_free(map, map->old, true);
+    map_release(map->arena, map, sizeof(HashMap), true);
+}
+
+// Whether the null-terminated `stored` equals the first `len` bytes of `key`.
+static bool key_equals(const char *stored, const char *key, size_t len) {
+    return strncmp(stored, key, len) == 0 && stored[len] == '\0';
 }
 
-static Pair *hmap_find(HashMap *map, int h, const char *key) {
-    for (Pair *p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
+static Pair *table_find(Table *table, uint64_t hash, const char *key, size_t len) {
+    if (!table)
+        return NULL;
+    for (Pair *p = table->buckets[hash & table->mask]; p; p = p->next) {
+        if (p->hash == hash && key_equals(p->key, key, len))
             return p;
     }
     return NULL;
 }
 
+// Note that lookups never advance a resize: readers of a folder run
+// concurrently and only writers are allowed to modify the map.
+static Pair *hmap_find(HashMap *map, uint64_t hash, const char *key, size_t len) {
+    Pair *p = table_find(map->table, hash, key, len);
+    if (!p && map->old)
+        p = table_find(map->old, hash, key, len);
+    return p;
+}
+
 void *hmap_get(HashMap *map, const char *key) {
-    int h = get_hash(key);
-    Pair *p = hmap_find(map, h, key);
+    size_t len = strlen(key);
+    return hmap_get_hashed(map, key, len, hash_bytes(key, len));
+}
+
+void *hmap_get_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    Pair *p = hmap_find(map, hash, key, len);
     if (p)
         return p->value;
     else
         return NULL;
 }
 
+// Looks `key` up in a table that may be concurrently modified.
+// Returns false if the chain looks too long to be consistent.
+static bool table_find_optimistic(Table *table, uint64_t hash, const char *key,
+                                  size_t len, void **value) {
+    if (!table)
+        return true;
+    Pair *p = READ(table->buckets[hash & table->mask]);
+    for (int steps = 0; p; ++steps) {
+        if (steps == OPTIMISTIC_MAX_CHAIN)
+            return false;
+        if (p->hash == hash && key_equals(p->key, key, len)) {
+            *value = p->value;
+            return true;
+        }
+        p = READ(p->next);
+    }
+    return true;
+}
+
+bool hmap_get_optimistic(HashMap *map, const char *key, void **value) {
+    size_t len = strlen(key);
+    return hmap_get_optimistic_hashed(map, key, len, hash_bytes(key, len), value);
+}
+
+bool hmap_get_optimistic_hashed(HashMap *map, const char *key, size_t len,
+                                uint64_t hash, void **value) {
+    *value = NULL;
+    if (!table_find_optimistic(READ(map->table), hash, key, len, value))
+        return false;
+    if (!*value && !table_find_optimistic(READ(map->old), hash, key, len, value))
+        return false;
+    return true;
+}
+
+// Moves a few buckets of the old table to the new one and drops the old table
+// once it is empty.
+static void rehash_step(HashMap *map) {
+    Table *old = map->old;
+    Table *table = map->table;
+    int moved = 0, visited = 0;
+    while (map->rehash_index <= old->mask && moved < REHASH_STEP &&
+           visited < REHASH_EMPTY_VISITS) {
+        Pair *p = old->buckets[map->rehash_index];
+        PUBLISH(old->buckets[map->rehash_index], NULL);
+        map->rehash_index++;
+        visited++;
+        if (!p)
+            continue;
+        while (p) {
+            Pair *next = p->next;
+            size_t h = p->hash & table->mask;
+            PUBLISH(p->next, table->buckets[h]);
+            PUBLISH(table->buckets[h], p);
+            p = next;
+        }
+        moved++;
+    }
+    if (map->rehash_index > old->mask) {
+        PUBLISH(map->old, NULL);
+        map_release(map->arena, old, table_bytes(old->mask + 1), true);
+        map->rehash_index = 0;
+    }
+}
+
+// Starts moving all entries into a table with `n_buckets` buckets.
+// Only called when no other resize is in progress.
+static void start_resize(HashMap *map, size_t n_buckets) {
+    assert(!map->old);
+    PUBLISH(map->old, map->table);
+    PUBLISH(map->table, table_new(map, n_buckets));
+    map->rehash_index = 0;
+}
+
+static size_t buckets_for(size_t n_entries) {
+    size_t n_buckets = MIN_BUCKETS;
+    while (n_buckets < n_entries)
+        n_buckets <<= 1;
+    return n_buckets;
+}
+
+// Advances a resize in progress, or starts a new one if the load factor
+// after the current operation is out of bounds.
+static void maintain(HashMap *map) {
+    if (map->old) {
+        rehash_step(map);
+        return;
+    }
+    if (!map->table)
+        return;
+    size_t n_buckets = map->table->mask + 1;
+    if (map->size > n_buckets)
+        start_resize(map, n_buckets << 1);
+    else if (n_buckets > MIN_BUCKETS && map->size * SHRINK_RATIO < n_buckets)
+        start_resize(map, buckets_for(map->size * 2));
+}
+
 bool hmap_insert(HashMap *map, const char *key, void *value) {
+    size_t len = strlen(key);
+    return hmap_insert_hashed(map, key, len, hash_bytes(key, len), value);
+}
+
+bool hmap_insert_hashed(HashMap *map, const char *key, size_t len, uint64_t hash,
+                        void *value) {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair *p = hmap_find(map, h, key);
+    Pair *p = hmap_find(map, hash, key, len);
     if (p)
         return false; // Already exists.
-    Pair *new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
+    if (!map->table)
+        PUBLISH(map->table, table_new(map, MIN_BUCKETS));
+    Pair *new_p = map_alloc(map, sizeof(Pair) + len + 1);
+    memcpy(new_p->key, key, len);
+    new_p->key[len] = '\0';
     new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+    new_p->hash = hash;
+    size_t h = hash & map->table->mask;
+    new_p->next = map->table->buckets[h];
+    PUBLISH(map->table->buckets[h], new_p);
     map->size++;
+    maintain(map);
     return true;
 }
 
-bool hmap_remove(HashMap *map, const char *key) {
-    int h = get_hash(key);
-    Pair **pp = &(map->buckets[h]);
+static bool table_remove(HashMap *map, Table *table, uint64_t hash, const char *key,
+                         size_t len) {
+    if (!table)
+        return false;
+    Pair **pp = &(table->buckets[hash & table->mask]);
     while (*pp) {
         Pair *p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
+        if (p->hash == hash && key_equals(p->key, key, len)) {
+            PUBLISH(*pp, p->next);
+            map_release(map->arena, p, pair_bytes(p), true);
             return true;
         }
         pp = &(p->next);
@@ -94,33 +309,54 @@ bool hmap_remove(HashMap *map, const char *key) {
     return false;
 }
 
+bool hmap_remove(HashMap *map, const char *key) {
+    size_t len = strlen(key);
+    return hmap_remove_hashed(map, key, len, hash_bytes(key, len));
+}
+
+bool hmap_remove_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    if (!table_remove(map, map->table, hash, key, len) &&
+        !table_remove(map, map->old, hash, key, len))
+        return false;
+    map->size--;
+    if (map->size == 0 && !map->old) {
+        // Do not keep buckets for a folder that became a leaf again.
+        Table *table = map->table;
+        PUBLISH(map->table, NULL);
+        map_release(map->arena, table, table_bytes(table->mask + 1), true);
+        return true;
+    }
+    maintain(map);
+    return true;
+}
+
 size_t hmap_size(HashMap *map) {
     return map->size;
 }
 
 HashMapIterator hmap_iterator(HashMap *map) {
-    HashMapIterator it = {0, map->buckets[0]};
+    (void) map;
+    HashMapIterator it = {0, 0, NULL};
     return it;
 }
 
+// Iterates over the old table (if a resize is in progress) and then
+// over the current one.
 bool hmap_next(HashMap *map, HashMapIterator *it, const char **key, void **value) {
     Pair *p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
+    while (!p) {
+        Table *table = it->table == 0 ? map->old : map->table;
+        if (table && it->bucket <= table->mask) {
+            p = table->buckets[it->bucket++];
+        } else if (it->table == 0) {
+            it->table = 1;
+            it->bucket = 0;
+        } else {
+            return false;
+        }
     }
-    if (!p)
-        return false;
     *key = p->key;
     *value = p->value;
     it->pair = p->next;
     return true;
 }
-
-static unsigned int get_hash(const char *key) {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
-    }
-    return hash % N_BUCKETS;
-}
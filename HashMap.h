@@ -2,23 +2,54 @@
 
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "arena.h"
+
 // A structure representing a mapping from keys to values.
 // Keys are C-strings (null-terminated char*), all distinct.
 // Values are non-null pointers (void*, which you can cast to any other pointer type).
+// The number of buckets follows the number of entries; a resize is spread over
+// subsequent inserts and removes, so every operation takes expected O(1) time.
+// hmap_get, hmap_size and iteration never modify the map, so they may run
+// concurrently with each other (but not with hmap_insert or hmap_remove).
+//
+// There are three implementations, chosen at build time with HASHMAP_BACKEND:
+// separate chaining (HashMap.c), open addressing (HashMapSwiss.c) and a radix
+// trie for keys of the letters 'a' to 'z' (HashMapTrie.c). The trie iterates
+// in strcmp order of the keys, and code built with it has HASHMAP_SORTED
+// defined.
 typedef struct HashMap HashMap;
 
 // Create a new, empty map.
 HashMap* hmap_new();
 
+// Like hmap_new, but the map and everything it stores are allocated from
+// `arena` (see arena.h). Such a map may also be released with the arena.
+HashMap* hmap_new_in(Arena* arena);
+
 // Clear the map and free its memory. This frees the map and the keys
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Like hmap_free, but the memory is released through epoch_retire (see epoch.h)
+// or arena_retire, so that concurrent hmap_get_optimistic calls never touch
+// freed memory.
+void hmap_retire(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
 void* hmap_get(HashMap* map, const char* key);
 
+// Like hmap_get, but may run concurrently with hmap_insert and hmap_remove.
+// Sets `*value` to the value stored under `key` or NULL, and returns true;
+// returns false if it gave up because of a concurrent modification.
+// If the map was modified during the call, the result may be wrong, so the
+// caller has to detect that on its own (e.g. with a version counter).
+// Memory freed by the map goes through epoch_retire, so the call must be made
+// between epoch_enter and epoch_exit.
+bool hmap_get_optimistic(HashMap* map, const char* key, void** value);
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
@@ -29,6 +60,17 @@ bool hmap_insert(HashMap* map, const char* key, void* value);
 // or do nothing and return false if `key` was not present.
 bool hmap_remove(HashMap* map, const char* key);
 
+// Like hmap_get, hmap_get_optimistic, hmap_insert and hmap_remove, but the key
+// is the first `len` bytes of `key`, which need not be null-terminated, and
+// `hash` must be hash_bytes(key, len) (see hash.h). A caller looking up the
+// same name in several maps hashes it only once.
+void* hmap_get_hashed(HashMap* map, const char* key, size_t len, uint64_t hash);
+bool hmap_get_optimistic_hashed(HashMap* map, const char* key, size_t len,
+                                uint64_t hash, void** value);
+bool hmap_insert_hashed(HashMap* map, const char* key, size_t len, uint64_t hash,
+                        void* value);
+bool hmap_remove_hashed(HashMap* map, const char* key, size_t len, uint64_t hash);
+
 // Return the number of elements in the map.
 size_t hmap_size(HashMap* map);
 
@@ -38,7 +80,8 @@ typedef struct HashMapIterator HashMapIterator;
 HashMapIterator hmap_iterator(HashMap* map);
 
 // Set `*key` and `*value` to the current element pointed by iterator and
-// move the iterator to the next element.
+// move the iterator to the next element. `*key` stays valid until the map
+// is modified.
 // If there are no more elements, leaves `*key` and `*value` unchanged and
 // returns false.
 //
@@ -54,6 +97,7 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
+    int table;
+    size_t bucket;
     void* pair;
 };
@@ -0,0 +1,571 @@
+// Open-addressing implementation of HashMap.h, in the style of Swiss tables.
+//
+// Every slot has a control byte: EMPTY, DELETED or the low 7 bits of the hash
+// of the key stored there. Slots are probed in groups of GROUP_WIDTH control
+// bytes compared at once (SSE2, AVX2 or a portable 64-bit word fallback), so
+// most lookups look at one group and compare a single key. Slots are stored in
+// one array without per-entry allocations and keys shorter than INLINE_KEY
+// characters are stored in the slot itself.
+//
+// Like the chained implementation, the map resizes incrementally: a resize
+// moves a few groups of the old table on each insert or remove.
+//
+// For hmap_get_optimistic, a slot is filled before its control byte is
+// published, and tables and heap keys are freed through epoch_retire (or
+// arena_retire for maps allocated in an arena). An optimistic reader copies
+// control groups with atomic word loads, matches the copy and then rereads the
+// byte of each candidate slot. Inline keys are written and read a word at a
+// time with atomic operations too, so a slot being overwritten concurrently
+// can only produce a mismatch (or a stale hit, caught by the caller's
+// validation).
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HashMap.h"
+#include "epoch.h"
+#include "err.h"
+#include "hash.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+#define CTRL_EMPTY ((uint8_t) 0x80)
+#define CTRL_DELETED ((uint8_t) 0xFE)
+
+// Keys up to this length (excluding the terminating null character) are
+// stored inside the slot; longer ones are copied to the heap.
+#define INLINE_KEY 15
+
+// Number of old groups moved to the new table per insert or remove while a
+// resize is in progress.
+#define REHASH_STEP 2
+
+// The table shrinks when fewer than 1/SHRINK_RATIO of the slots are used.
+#define SHRINK_RATIO 8
+
+typedef struct Slot Slot;
+
+#define KEY_WORDS ((INLINE_KEY + 1) / sizeof(uint64_t))
+
+struct Slot {
+    void *value;
+    char *heap_key; // Copy of a long key, or NULL if the key is in `key`.
+    union {
+        char key[INLINE_KEY + 1]; // Null-terminated short key.
+        uint64_t key_words[KEY_WORDS]; // The same, for atomic access.
+    };
+};
+
+// Fields read by hmap_get_optimistic are written with PUBLISH and read with
+// READ, so that an optimistic reader sees initialized memory behind them.
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+
+typedef struct Table Table;
+
+// A table is a single allocation: this header, `capacity` control bytes,
+// and then `capacity` slots.
+struct Table {
+    size_t capacity; // Power of two, at least GROUP_WIDTH.
+    size_t growth_left; // Number of EMPTY slots that may still be filled.
+    Slot *slots;
+    uint8_t ctrl[];
+};
+
+struct HashMap {
+    Table *table; // Table new entries go to; NULL if nothing was ever inserted.
+    Table *old; // Table being drained into `table` during a resize, or NULL.
+    size_t rehash_group; // Groups of `old` below this index are already moved.
+    size_t size; // total number of entries in map.
+    Arena *arena; // Where the memory comes from; NULL for malloc.
+};
+
+// Bit mask with one bit (or, in the portable version, one byte) per control
+// byte of a group.
+#if GROUP_WIDTH == 8
+typedef uint64_t GroupMask;
+#define MASK_SHIFT 3
+#else
+typedef uint32_t GroupMask;
+#define MASK_SHIFT 0
+#endif
+
+#if defined(__AVX2__)
+
+static inline GroupMask group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m256i group = _mm256_loadu_si256((const __m256i *) ctrl);
+    return (GroupMask) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(group, _mm256_set1_epi8((char) h2)));
+}
+
+static inline GroupMask group_match_empty(const uint8_t *ctrl) {
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline GroupMask group_match_free(const uint8_t *ctrl) {
+    __m256i group = _mm256_loadu_si256((const __m256i *) ctrl);
+    return (GroupMask) _mm256_movemask_epi8(group);
+}
+
+#elif defined(__SSE2__)
+
+static inline GroupMask group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (GroupMask) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(group, _mm_set1_epi8((char) h2)));
+}
+
+static inline GroupMask group_match_empty(const uint8_t *ctrl) {
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline GroupMask group_match_free(const uint8_t *ctrl) {
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (GroupMask) _mm_movemask_epi8(group);
+}
+
+#else
+
+#define LSBS 0x0101010101010101ULL
+#define MSBS 0x8080808080808080ULL
+
+static inline uint64_t group_load(const uint8_t *ctrl) {
+    uint64_t word;
+    memcpy(&word, ctrl, sizeof(word));
+    return word;
+}
+
+// May report false positives, which are filtered out by the key comparison.
+static inline GroupMask group_match(const uint8_t *ctrl, uint8_t h2) {
+    uint64_t x = group_load(ctrl) ^ (LSBS * h2);
+    return (x - LSBS) & ~x & MSBS;
+}
+
+static inline GroupMask group_match_empty(const uint8_t *ctrl) {
+    uint64_t word = group_load(ctrl);
+    return word & ~(word << 6) & MSBS;
+}
+
+static inline GroupMask group_match_free(const uint8_t *ctrl) {
+    return group_load(ctrl) & MSBS;
+}
+
+#endif
+
+// Copies a group that a writer may be changing into `copy`, a word at a time
+// with atomic loads. Groups start at multiples of 8 bytes into a table.
+static inline void group_load_atomic(const uint8_t *ctrl, uint8_t *copy) {
+    for (size_t i = 0; i < GROUP_WIDTH / sizeof(uint64_t); ++i) {
+        uint64_t word = __atomic_load_n((const uint64_t *) ctrl + i, __ATOMIC_RELAXED);
+        memcpy(copy + i * sizeof(uint64_t), &word, sizeof(uint64_t));
+    }
+}
+
+// Returns the index of the lowest set bit of a nonzero mask and clears it.
+static inline size_t mask_next(GroupMask *mask) {
+    size_t index = __builtin_ctzll(*mask) >> MASK_SHIFT;
+    *mask &= *mask - 1;
+    return index;
+}
+
+static inline uint8_t hash_h2(uint64_t hash) {
+    return hash & 0x7F;
+}
+
+static inline size_t hash_h1(uint64_t hash) {
+    return hash >> 7;
+}
+
+static inline const char *slot_key(const Slot *slot) {
+    return slot->heap_key ? slot->heap_key : slot->key;
+}
+
+static void *map_alloc(HashMap *map, size_t size) {
+    void *memory = map->arena ? arena_alloc(map->arena, size) : malloc(size);
+    if (!memory)
+        fatal("malloc failed");
+    return memory;
+}
+
+// Frees memory from map_alloc, directly or (if `retire` is set) once
+// concurrent optimistic lookups cannot be reading it.
+static void map_release(Arena *arena, void *ptr, size_t size, bool retire) {
+    if (arena && retire)
+        arena_retire(arena, ptr, size);
+    else if (arena)
+        arena_release(arena, ptr, size);
+    else if (retire)
+        epoch_retire(ptr, free);
+    else
+        free(ptr);
+}
+
+static void slot_set_key(HashMap *map, Slot *slot, const char *key, size_t len) {
+    if (len <= INLINE_KEY) {
+        memcpy(slot->key, key, len);
+        slot->key[len] = '\0';
+        slot->heap_key = NULL;
+    } else {
+        slot->heap_key = map_alloc(map, len + 1);
+        memcpy(slot->heap_key, key, len);
+        slot->heap_key[len] = '\0';
+    }
+}
+
+// Whether the null-terminated `stored` equals the first `len` bytes of `key`.
+static bool key_equals(const char *stored, const char *key, size_t len) {
+    return strncmp(stored, key, len) == 0 && stored[len] == '\0';
+}
+
+static void slot_free_key(HashMap *map, Slot *slot, bool retire) {
+    if (slot->heap_key)
+        map_release(map->arena, slot->heap_key, strlen(slot->heap_key) + 1, retire);
+}
+
+static size_t max_load(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+static size_t slots_offset(size_t capacity) {
+    return (sizeof(Table) + capacity + sizeof(Slot) - 1) / sizeof(Slot) * sizeof(Slot);
+}
+
+static size_t table_bytes(size_t capacity) {
+    return slots_offset(capacity) + capacity * sizeof(Slot);
+}
+
+static Table *table_new(HashMap *map, size_t capacity) {
+    Table *table = map_alloc(map, table_bytes(capacity));
+    table->capacity = capacity;
+    table->growth_left = max_load(capacity);
+    table->slots = (Slot *) ((char *) table + slots_offset(capacity));
+    memset(table->ctrl, CTRL_EMPTY, capacity);
+    return table;
+}
+
+// Frees the table and its heap keys.
+static void table_free(HashMap *map, Table *table, bool retire) {
+    if (!table)
+        return;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (!(table->ctrl[i] & 0x80))
+            slot_free_key(map, &table->slots[i], retire);
+    }
+    map_release(map->arena, table, table_bytes(table->capacity), retire);
+}
+
+HashMap *hmap_new() {
+    return hmap_new_in(NULL);
+}
+
+HashMap *hmap_new_in(Arena *arena) {
+    HashMap *map = arena ? arena_alloc(arena, sizeof(HashMap)) : malloc(sizeof(HashMap));
+    if (!map)
+        return NULL;
+    memset(map, 0, sizeof(HashMap));
+    map->arena = arena;
+    return map;
+}
+
+void hmap_free(HashMap *map) {
+    table_free(map, map->table, false);
+    table_free(map, map->old, false);
+    map_release(map->arena, map, sizeof(HashMap), false);
+}
+
+void hmap_retire(HashMap *map) {
+    table_free(map, map->table, true);
+    table_free(map, map->old, true);
+    map_release(map->arena, map, sizeof(HashMap), true);
+}
+
+// Returns the index of the slot holding `key`, or -1.
+// Groups are probed in triangular order, which visits every group once.
+static ptrdiff_t table_find(Table *table, uint64_t hash, const char *key, size_t len) {
+    if (!table)
+        return -1;
+    size_t group_mask = table->capacity / GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    uint8_t h2 = hash_h2(hash);
+    for (size_t step = 1; step <= group_mask + 1; ++step) {
+        const uint8_t *ctrl = table->ctrl + group * GROUP_WIDTH;
+        GroupMask match = group_match(ctrl, h2);
+        while (match) {
+            size_t i = group * GROUP_WIDTH + mask_next(&match);
+            if (key_equals(slot_key(&table->slots[i]), key, len))
+                return i;
+        }
+        if (group_match_empty(ctrl))
+            return -1;
+        group = (group + step) & group_mask;
+    }
+    return -1;
+}
+
+// Returns the index of the first EMPTY or DELETED slot on the probe sequence.
+static size_t table_find_free(Table *table, uint64_t hash) {
+    size_t group_mask = table->capacity / GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    for (size_t step = 1;; ++step) {
+        GroupMask free_slots = group_match_free(table->ctrl + group * GROUP_WIDTH);
+        if (free_slots)
+            return group * GROUP_WIDTH + mask_next(&free_slots);
+        group = (group + step) & group_mask;
+    }
+}
+
+// Reads the inline key of a slot that may be overwritten meanwhile into
+// `words`.
+static void slot_load_key(const Slot *slot, uint64_t *words) {
+    for (size_t i = 0; i < KEY_WORDS; ++i)
+        words[i] = __atomic_load_n(&slot->key_words[i], __ATOMIC_RELAXED);
+}
+
+// Copies `slot`, with a key known not to be in the table, into the table.
+// The table must have growth left.
+static void table_put(Table *table, uint64_t hash, const Slot *slot) {
+    assert(table->growth_left > 0);
+    size_t i = table_find_free(table, hash);
+    if (table->ctrl[i] == CTRL_EMPTY)
+        table->growth_left--;
+    // An optimistic reader may still be looking at the previous occupant.
+    for (size_t w = 0; w < KEY_WORDS; ++w)
+        __atomic_store_n(&table->slots[i].key_words[w], slot->key_words[w],
+                         __ATOMIC_RELAXED);
+    PUBLISH(table->slots[i].heap_key, slot->heap_key);
+    PUBLISH(table->slots[i].value, slot->value);
+    PUBLISH(table->ctrl[i], hash_h2(hash));
+}
+
+static void table_erase(Table *table, size_t i) {
+    // A probe stops at the first group with an EMPTY slot, so if this group
+    // has one, no probe sequence continues past it and the slot can become
+    // EMPTY again; otherwise a tombstone keeps later groups reachable.
+    const uint8_t *group = table->ctrl + i / GROUP_WIDTH * GROUP_WIDTH;
+    if (group_match_empty(group)) {
+        PUBLISH(table->ctrl[i], CTRL_EMPTY);
+        table->growth_left++;
+    } else {
+        PUBLISH(table->ctrl[i], CTRL_DELETED);
+    }
+}
+
+static void *find_value(HashMap *map, uint64_t hash, const char *key, size_t len) {
+    ptrdiff_t i = table_find(map->table, hash, key, len);
+    if (i >= 0)
+        return map->table->slots[i].value;
+    i = table_find(map->old, hash, key, len);
+    if (i >= 0)
+        return map->old->slots[i].value;
+    return NULL;
+}
+
+// Note that lookups never advance a resize: readers of a folder run
+// concurrently and only writers are allowed to modify the map.
+void *hmap_get(HashMap *map, const char *key) {
+    size_t len = strlen(key);
+    return find_value(map, hash_bytes(key, len), key, len);
+}
+
+void *hmap_get_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    return find_value(map, hash, key, len);
+}
+
+// Looks `key` up in a table that may be concurrently modified.
+static void table_find_optimistic(Table *table, uint64_t hash, const char *key,
+                                  size_t len, void **value) {
+    if (!table)
+        return;
+    size_t group_mask = table->capacity / GROUP_WIDTH - 1;
+    size_t group = hash_h1(hash) & group_mask;
+    uint8_t h2 = hash_h2(hash);
+    for (size_t step = 1; step <= group_mask + 1; ++step) {
+        _Alignas(GROUP_WIDTH) uint8_t ctrl[GROUP_WIDTH];
+        group_load_atomic(table->ctrl + group * GROUP_WIDTH, ctrl);
+        GroupMask match = group_match(ctrl, h2);
+        while (match) {
+            size_t i = group * GROUP_WIDTH + mask_next(&match);
+            // Pairs with PUBLISH in table_put, which fills the slot first.
+            if (READ(table->ctrl[i]) != h2)
+                continue;
+            Slot *slot = &table->slots[i];
+            char *heap_key = READ(slot->heap_key);
+            bool equal;
+            if (heap_key) {
+                equal = key_equals(heap_key, key, len);
+            } else {
+                uint64_t words[KEY_WORDS];
+                slot_load_key(slot, words);
+                const char *inline_key = (const char *) words;
+                equal = len <= INLINE_KEY && memcmp(key, inline_key, len) == 0 &&
+                        inline_key[len] == '\0';
+            }
+            if (equal) {
+                *value = READ(slot->value);
+                return;
+            }
+        }
+        if (group_match_empty(ctrl))
+            return;
+        group = (group + step) & group_mask;
+    }
+}
+
+bool hmap_get_optimistic(HashMap *map, const char *key, void **value) {
+    size_t len = strlen(key);
+    return hmap_get_optimistic_hashed(map, key, len, hash_bytes(key, len), value);
+}
+
+bool hmap_get_optimistic_hashed(HashMap *map, const char *key, size_t len,
+                                uint64_t hash, void **value) {
+    *value = NULL;
+    table_find_optimistic(READ(map->table), hash, key, len, value);
+    if (!*value)
+        table_find_optimistic(READ(map->old), hash, key, len, value);
+    return true;
+}
+
+// Moves a few groups of the old table to the new one and drops the old table
+// once it is empty. Slots are moved as they are, keys included.
+static void rehash_step(HashMap *map) {
+    Table *old = map->old;
+    size_t n_groups = old->capacity / GROUP_WIDTH;
+    for (int moved = 0; moved < REHASH_STEP && map->rehash_group < n_groups; ++moved) {
+        size_t first = map->rehash_group * GROUP_WIDTH;
+        for (size_t i = first; i < first + GROUP_WIDTH; ++i) {
+            if (old->ctrl[i] & 0x80)
+                continue;
+            Slot *slot = &old->slots[i];
+            table_put(map->table, hash_string(slot_key(slot)), slot);
+            PUBLISH(old->ctrl[i], CTRL_EMPTY);
+        }
+        map->rehash_group++;
+    }
+    if (map->rehash_group == n_groups) {
+        PUBLISH(map->old, NULL);
+        map_release(map->arena, old, table_bytes(old->capacity), true);
+        map->rehash_group = 0;
+    }
+}
+
+static size_t capacity_for(size_t n_entries) {
+    size_t capacity = GROUP_WIDTH;
+    while (max_load(capacity) < n_entries)
+        capacity <<= 1;
+    return capacity;
+}
+
+// Starts moving all entries into a table with the given capacity.
+// Only called when no other resize is in progress.
+static void start_resize(HashMap *map, size_t capacity) {
+    assert(!map->old);
+    PUBLISH(map->old, map->table);
+    PUBLISH(map->table, table_new(map, capacity));
+    map->rehash_group = 0;
+}
+
+bool hmap_insert(HashMap *map, const char *key, void *value) {
+    size_t len = strlen(key);
+    return hmap_insert_hashed(map, key, len, hash_bytes(key, len), value);
+}
+
+bool hmap_insert_hashed(HashMap *map, const char *key, size_t len, uint64_t hash,
+                        void *value) {
+    if (!value)
+        return false;
+    if (find_value(map, hash, key, len))
+        return false; // Already exists.
+    if (!map->table) {
+        PUBLISH(map->table, table_new(map, GROUP_WIDTH));
+    } else if (map->table->growth_left == 0) {
+        // The new table is sized so that this does not happen before the old
+        // one is drained, but finish the resize if it ever does.
+        while (map->old)
+            rehash_step(map);
+        // Twice the entries, so that a resize every few inserts is not needed
+        // when the table is full of tombstones.
+        start_resize(map, capacity_for(2 * (map->size + 1)));
+    }
+    Slot slot;
+    slot.value = value;
+    slot_set_key(map, &slot, key, len);
+    table_put(map->table, hash, &slot);
+    map->size++;
+    if (map->old)
+        rehash_step(map);
+    return true;
+}
+
+bool hmap_remove(HashMap *map, const char *key) {
+    size_t len = strlen(key);
+    return hmap_remove_hashed(map, key, len, hash_bytes(key, len));
+}
+
+bool hmap_remove_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    Table *table = map->table;
+    ptrdiff_t i = table_find(table, hash, key, len);
+    if (i < 0) {
+        table = map->old;
+        i = table_find(table, hash, key, len);
+        if (i < 0)
+            return false;
+    }
+    table_erase(table, i);
+    slot_free_key(map, &table->slots[i], true);
+    map->size--;
+    if (map->old) {
+        rehash_step(map);
+    } else if (map->size == 0) {
+        // Do not keep slots for a folder that became a leaf again.
+        Table *empty = map->table;
+        PUBLISH(map->table, NULL);
+        map_release(map->arena, empty, table_bytes(empty->capacity), true);
+    } else if (map->table->capacity > GROUP_WIDTH &&
+               map->size * SHRINK_RATIO < map->table->capacity) {
+        start_resize(map, capacity_for(2 * map->size));
+        rehash_step(map);
+    }
+    return true;
+}
+
+size_t hmap_size(HashMap *map) {
+    return map->size;
+}
+
+HashMapIterator hmap_iterator(HashMap *map) {
+    (void) map;
+    HashMapIterator it = {0, 0, NULL};
+    return it;
+}
+
+// Iterates over the old table (if a resize is in progress) and then
+// over the current one; `bucket` is the index of the next slot.
+bool hmap_next(HashMap *map, HashMapIterator *it, const char **key, void **value) {
+    for (;;) {
+        Table *table = it->table == 0 ? map->old : map->table;
+        if (table) {
+            while (it->bucket < table->capacity) {
+                size_t i = it->bucket++;
+                if (!(table->ctrl[i] & 0x80)) {
+                    *key = slot_key(&table->slots[i]);
+                    *value = table->slots[i].value;
+                    return true;
+                }
+            }
+        }
+        if (it->table == 1)
+            return false;
+        it->table = 1;
+        it->bucket = 0;
+    }
+}
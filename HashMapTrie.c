@@ -0,0 +1,525 @@
+// Radix trie implementation of HashMap.h for keys made of the letters 'a' to
+// 'z', like folder names (see is_path_valid).
+//
+// Inner nodes branch on one character and hold the characters all keys below
+// them share next (the prefix), so siblings like "shardaaaa" and "shardaaab"
+// store their common part once. A node has room for SMALL, MEDIUM or SYMBOLS
+// children; the first two keep the symbols of the children sorted, a full
+// node indexes its children by symbol. Symbol 0 stands for the end of a key,
+// so a key may be a prefix of another. Every key has a leaf with a copy of
+// it, which is where lookups compare the key: on the way down they only skip
+// over prefixes. Lookups never hash, and iteration returns keys in strcmp
+// order, so HASHMAP_SORTED is defined for users of this implementation.
+//
+// For hmap_get_optimistic, a node is never changed once published other than
+// by storing a child pointer; everything else is done on a copy that replaces
+// it, and the old node is freed through epoch_retire (or arena_retire).
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HashMap.h"
+#include "epoch.h"
+#include "err.h"
+
+// End of a key, then 'a' to 'z'.
+#define SYMBOLS 27
+
+// Capacities of the nodes that do not index children by symbol.
+#define SMALL 4
+#define MEDIUM 12
+
+// A node shrinks once it has this many children left, fewer than where it
+// grew, so that a node around the limit does not change kind on every change.
+#define SHRINK_FULL 8
+#define SHRINK_MEDIUM 3
+
+// Child pointers are written with PUBLISH and read with READ, so that a
+// concurrent optimistic reader sees either the old or the new child, and
+// initialized memory behind it.
+#define PUBLISH(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define READ(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+
+// A reference to a child: a Node, or a Leaf with the lowest bit set. 0 if
+// there is none.
+typedef uintptr_t Ref;
+
+typedef struct Leaf Leaf;
+
+struct Leaf {
+    void *value;
+    size_t length;
+    char key[]; // Null-terminated copy of the key.
+};
+
+typedef struct Node Node;
+
+// A node is a single allocation: this header, `capacity` children, then (but
+// for full nodes) `capacity` symbols of the children in increasing order, and
+// the prefix.
+struct Node {
+    uint32_t prefix_length;
+    uint8_t capacity;
+    uint8_t count; // Number of children.
+    Ref children[];
+};
+
+struct HashMap {
+    Ref root;
+    size_t size; // total number of entries in map.
+    Arena *arena; // Where the memory comes from; NULL for malloc.
+};
+
+HashMap *hmap_new() {
+    return hmap_new_in(NULL);
+}
+
+HashMap *hmap_new_in(Arena *arena) {
+    HashMap *map = arena ? arena_alloc(arena, sizeof(HashMap)) : malloc(sizeof(HashMap));
+    if (!map)
+        return NULL;
+    memset(map, 0, sizeof(HashMap));
+    map->arena = arena;
+    return map;
+}
+
+static void *map_alloc(HashMap *map, size_t size) {
+    void *memory = map->arena ? arena_alloc(map->arena, size) : malloc(size);
+    if (!memory)
+        fatal("malloc failed");
+    return memory;
+}
+
+// Frees memory from map_alloc, directly or (if `retire` is set) once
+// concurrent optimistic lookups cannot be reading it.
+static void map_release(Arena *arena, void *ptr, size_t size, bool retire) {
+    if (arena && retire)
+        arena_retire(arena, ptr, size);
+    else if (arena)
+        arena_release(arena, ptr, size);
+    else if (retire)
+        epoch_retire(ptr, free);
+    else
+        free(ptr);
+}
+
+static bool is_leaf(Ref ref) {
+    return ref & 1;
+}
+
+static Leaf *as_leaf(Ref ref) {
+    return (Leaf *) (ref - 1);
+}
+
+static Node *as_node(Ref ref) {
+    return (Node *) ref;
+}
+
+// Symbol of the character of a key at `depth`, or of its end; outside
+// [0, SYMBOLS) for other characters.
+static int symbol_at(const char *key, size_t len, size_t depth) {
+    return depth < len ? (unsigned char) key[depth] - 'a' + 1 : 0;
+}
+
+static Ref leaf_new(HashMap *map, const char *key, size_t len, void *value) {
+    Leaf *leaf = map_alloc(map, sizeof(Leaf) + len + 1);
+    leaf->value = value;
+    leaf->length = len;
+    memcpy(leaf->key, key, len);
+    leaf->key[len] = '\0';
+    return (Ref) leaf | 1;
+}
+
+static void leaf_release(HashMap *map, Leaf *leaf, bool retire) {
+    map_release(map->arena, leaf, sizeof(Leaf) + leaf->length + 1, retire);
+}
+
+static uint8_t *symbols_of(Node *node) {
+    return (uint8_t *) (node->children + node->capacity);
+}
+
+static char *prefix_of(Node *node) {
+    return (char *) symbols_of(node) + (node->capacity < SYMBOLS ? node->capacity : 0);
+}
+
+static size_t node_bytes(size_t capacity, size_t prefix_length) {
+    return sizeof(Node) + capacity * sizeof(Ref) + (capacity < SYMBOLS ? capacity : 0) +
+           prefix_length;
+}
+
+// Returns a node without children; the caller fills in the prefix.
+static Node *node_new(HashMap *map, size_t capacity, size_t prefix_length) {
+    Node *node = map_alloc(map, node_bytes(capacity, prefix_length));
+    node->prefix_length = prefix_length;
+    node->capacity = capacity;
+    node->count = 0;
+    if (capacity == SYMBOLS)
+        memset(node->children, 0, SYMBOLS * sizeof(Ref));
+    return node;
+}
+
+static void node_release(HashMap *map, Node *node, bool retire) {
+    map_release(map->arena, node, node_bytes(node->capacity, node->prefix_length), retire);
+}
+
+// Returns the child slot of `symbol`, or NULL if the node has no child there
+// (a full node returns its empty slot).
+static Ref *find_slot(Node *node, int symbol) {
+    if (node->capacity == SYMBOLS)
+        return symbol >= 0 && symbol < SYMBOLS ? &node->children[symbol] : NULL;
+    const uint8_t *symbols = symbols_of(node);
+    for (int i = 0; i < node->count && symbols[i] <= symbol; ++i) {
+        if (symbols[i] == symbol)
+            return &node->children[i];
+    }
+    return NULL;
+}
+
+// Sets `*child` to the child with the smallest symbol greater than `after`
+// and returns the symbol, or returns -1 if there is no such child.
+static int next_child(Node *node, int after, Ref *child) {
+    if (node->capacity == SYMBOLS) {
+        for (int symbol = after + 1; symbol < SYMBOLS; ++symbol) {
+            if (node->children[symbol]) {
+                *child = node->children[symbol];
+                return symbol;
+            }
+        }
+        return -1;
+    }
+    const uint8_t *symbols = symbols_of(node);
+    for (int i = 0; i < node->count; ++i) {
+        if (symbols[i] > after) {
+            *child = node->children[i];
+            return symbols[i];
+        }
+    }
+    return -1;
+}
+
+// Adds a child to a node that is not published yet and has room for it.
+static void node_add(Node *node, int symbol, Ref child) {
+    assert(symbol >= 0 && symbol < SYMBOLS && node->count < node->capacity);
+    if (node->capacity == SYMBOLS) {
+        node->children[symbol] = child;
+        node->count++;
+        return;
+    }
+    uint8_t *symbols = symbols_of(node);
+    int i = node->count;
+    for (; i > 0 && symbols[i - 1] > symbol; --i) {
+        symbols[i] = symbols[i - 1];
+        node->children[i] = node->children[i - 1];
+    }
+    symbols[i] = symbol;
+    node->children[i] = child;
+    node->count++;
+}
+
+// Returns a copy of node with room for `capacity` children, without the child
+// of symbol `skip` (-1 for none), and with a prefix of `prefix_length`, which
+// the caller fills in.
+static Node *node_copy(HashMap *map, Node *node, size_t capacity, int skip,
+                       size_t prefix_length) {
+    Node *copy = node_new(map, capacity, prefix_length);
+    Ref child;
+    for (int symbol = next_child(node, -1, &child); symbol >= 0;
+         symbol = next_child(node, symbol, &child)) {
+        if (symbol != skip)
+            node_add(copy, symbol, child);
+    }
+    return copy;
+}
+
+static Node *node_copy_prefix(HashMap *map, Node *node, size_t capacity, int skip) {
+    Node *copy = node_copy(map, node, capacity, skip, node->prefix_length);
+    memcpy(prefix_of(copy), prefix_of(node), node->prefix_length);
+    return copy;
+}
+
+static void free_ref(HashMap *map, Ref ref, bool retire) {
+    if (!ref)
+        return;
+    if (is_leaf(ref)) {
+        leaf_release(map, as_leaf(ref), retire);
+        return;
+    }
+    Node *node = as_node(ref);
+    Ref child;
+    for (int symbol = next_child(node, -1, &child); symbol >= 0;
+         symbol = next_child(node, symbol, &child))
+        free_ref(map, child, retire);
+    node_release(map, node, retire);
+}
+
+void hmap_free(HashMap *map) {
+    free_ref(map, map->root, false);
+    map_release(map->arena, map, sizeof(HashMap), false);
+}
+
+void hmap_retire(HashMap *map) {
+    free_ref(map, map->root, true);
+    map_release(map->arena, map, sizeof(HashMap), true);
+}
+
+// Prefixes are skipped rather than compared on the way down; the leaf tells
+// whether the key is there. Safe to run concurrently with changes.
+static Leaf *find_leaf(HashMap *map, const char *key, size_t len) {
+    Ref ref = READ(map->root);
+    size_t depth = 0;
+    while (ref && !is_leaf(ref)) {
+        Node *node = as_node(ref);
+        if (node->prefix_length > len - depth)
+            return NULL;
+        depth += node->prefix_length;
+        int symbol = symbol_at(key, len, depth);
+        Ref *slot = find_slot(node, symbol);
+        if (!slot)
+            return NULL;
+        ref = READ(*slot);
+        depth += symbol != 0;
+    }
+    if (!ref)
+        return NULL;
+    Leaf *leaf = as_leaf(ref);
+    if (leaf->length != len || memcmp(leaf->key, key, len) != 0)
+        return NULL;
+    return leaf;
+}
+
+void *hmap_get(HashMap *map, const char *key) {
+    return hmap_get_hashed(map, key, strlen(key), 0);
+}
+
+void *hmap_get_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    (void) hash;
+    Leaf *leaf = find_leaf(map, key, len);
+    if (leaf)
+        return leaf->value;
+    else
+        return NULL;
+}
+
+bool hmap_get_optimistic(HashMap *map, const char *key, void **value) {
+    return hmap_get_optimistic_hashed(map, key, strlen(key), 0, value);
+}
+
+bool hmap_get_optimistic_hashed(HashMap *map, const char *key, size_t len,
+                                uint64_t hash, void **value) {
+    *value = hmap_get_hashed(map, key, len, hash);
+    return true;
+}
+
+// Adds `leaf` as a child of node, which is in `slot` and has no child of
+// `symbol` yet, replacing the node with a copy unless it is full.
+static void add_child(HashMap *map, Ref *slot, Node *node, int symbol, Ref leaf) {
+    if (node->capacity == SYMBOLS) {
+        PUBLISH(node->children[symbol], leaf);
+        node->count++;
+        return;
+    }
+    size_t capacity = node->capacity;
+    if (node->count == capacity)
+        capacity = capacity == SMALL ? MEDIUM : SYMBOLS;
+    Node *copy = node_copy_prefix(map, node, capacity, -1);
+    node_add(copy, symbol, leaf);
+    PUBLISH(*slot, (Ref) copy);
+    node_release(map, node, true);
+}
+
+bool hmap_insert(HashMap *map, const char *key, void *value) {
+    return hmap_insert_hashed(map, key, strlen(key), 0, value);
+}
+
+bool hmap_insert_hashed(HashMap *map, const char *key, size_t len, uint64_t hash,
+                        void *value) {
+    (void) hash;
+    if (!value)
+        return false;
+    if (find_leaf(map, key, len))
+        return false; // Already exists.
+    for (size_t i = 0; i < len; ++i)
+        assert(key[i] >= 'a' && key[i] <= 'z');
+    Ref leaf = leaf_new(map, key, len, value);
+    Ref *slot = &map->root;
+    size_t depth = 0;
+    while (*slot) {
+        if (is_leaf(*slot)) {
+            // Both keys go below a new node with the part they share.
+            Leaf *other = as_leaf(*slot);
+            size_t common = depth;
+            while (common < len && common < other->length && key[common] == other->key[common])
+                common++;
+            Node *node = node_new(map, SMALL, common - depth);
+            memcpy(prefix_of(node), key + depth, common - depth);
+            node_add(node, symbol_at(other->key, other->length, common), *slot);
+            node_add(node, symbol_at(key, len, common), leaf);
+            PUBLISH(*slot, (Ref) node);
+            break;
+        }
+        Node *node = as_node(*slot);
+        const char *prefix = prefix_of(node);
+        size_t matched = 0;
+        while (matched < node->prefix_length && depth + matched < len &&
+               prefix[matched] == key[depth + matched])
+            matched++;
+        if (matched < node->prefix_length) {
+            // The key leaves the prefix: the node goes below a new one with
+            // the part they share.
+            Node *top = node_new(map, SMALL, matched);
+            memcpy(prefix_of(top), prefix, matched);
+            size_t rest_length = node->prefix_length - matched - 1;
+            Node *rest = node_copy(map, node, node->capacity, -1, rest_length);
+            memcpy(prefix_of(rest), prefix + matched + 1, rest_length);
+            node_add(top, symbol_at(prefix, node->prefix_length, matched), (Ref) rest);
+            node_add(top, symbol_at(key, len, depth + matched), leaf);
+            PUBLISH(*slot, (Ref) top);
+            node_release(map, node, true);
+            break;
+        }
+        depth += node->prefix_length;
+        int symbol = symbol_at(key, len, depth);
+        Ref *child = find_slot(node, symbol);
+        if (!child || !*child) {
+            add_child(map, slot, node, symbol, leaf);
+            break;
+        }
+        slot = child;
+        depth += symbol != 0;
+    }
+    if (!*slot)
+        PUBLISH(*slot, leaf);
+    map->size++;
+    return true;
+}
+
+// Removes the child of `symbol` from node, which is in `slot`. A node left
+// with one child is replaced by the child.
+static void remove_child(HashMap *map, Ref *slot, Node *node, int symbol) {
+    size_t left = node->count - 1;
+    if (left == 1) {
+        Ref child = 0;
+        int other = next_child(node, -1, &child);
+        if (other == symbol)
+            other = next_child(node, other, &child);
+        if (is_leaf(child)) {
+            PUBLISH(*slot, child);
+        } else {
+            // The prefix of the node, the symbol and the prefix of the child.
+            Node *below = as_node(child);
+            Node *merged = node_copy(map, below, below->capacity, -1,
+                                     node->prefix_length + 1 + below->prefix_length);
+            char *prefix = prefix_of(merged);
+            memcpy(prefix, prefix_of(node), node->prefix_length);
+            prefix[node->prefix_length] = 'a' + other - 1;
+            memcpy(prefix + node->prefix_length + 1, prefix_of(below), below->prefix_length);
+            PUBLISH(*slot, (Ref) merged);
+            node_release(map, below, true);
+        }
+        node_release(map, node, true);
+        return;
+    }
+    if (node->capacity == SYMBOLS && left > SHRINK_FULL) {
+        PUBLISH(node->children[symbol], 0);
+        node->count--;
+        return;
+    }
+    size_t capacity = node->capacity;
+    if (capacity == SYMBOLS)
+        capacity = MEDIUM;
+    else if (capacity == MEDIUM && left <= SHRINK_MEDIUM)
+        capacity = SMALL;
+    PUBLISH(*slot, (Ref) node_copy_prefix(map, node, capacity, symbol));
+    node_release(map, node, true);
+}
+
+bool hmap_remove(HashMap *map, const char *key) {
+    return hmap_remove_hashed(map, key, strlen(key), 0);
+}
+
+bool hmap_remove_hashed(HashMap *map, const char *key, size_t len, uint64_t hash) {
+    (void) hash;
+    Ref *slot = &map->root, *parent_slot = NULL;
+    Node *parent = NULL;
+    int symbol = 0;
+    size_t depth = 0;
+    while (*slot && !is_leaf(*slot)) {
+        Node *node = as_node(*slot);
+        if (node->prefix_length > len - depth)
+            return false;
+        depth += node->prefix_length;
+        symbol = symbol_at(key, len, depth);
+        Ref *child = find_slot(node, symbol);
+        if (!child || !*child)
+            return false;
+        parent_slot = slot;
+        parent = node;
+        slot = child;
+        depth += symbol != 0;
+    }
+    if (!*slot)
+        return false;
+    Leaf *leaf = as_leaf(*slot);
+    if (leaf->length != len || memcmp(leaf->key, key, len) != 0)
+        return false;
+    if (parent)
+        remove_child(map, parent_slot, parent, symbol);
+    else
+        PUBLISH(map->root, 0);
+    leaf_release(map, leaf, true);
+    map->size--;
+    return true;
+}
+
+size_t hmap_size(HashMap *map) {
+    return map->size;
+}
+
+HashMapIterator hmap_iterator(HashMap *map) {
+    (void) map;
+    HashMapIterator it = {0, 0, NULL};
+    return it;
+}
+
+static Leaf *leftmost(Ref ref) {
+    while (ref && !is_leaf(ref))
+        next_child(as_node(ref), -1, &ref);
+    return ref ? as_leaf(ref) : NULL;
+}
+
+// Returns the leaf of the key following that of `leaf`, or NULL: the first
+// leaf below the deepest branch to the right of the path to `leaf`.
+static Leaf *successor(HashMap *map, const Leaf *leaf) {
+    Ref ref = map->root, next = 0;
+    size_t depth = 0;
+    while (!is_leaf(ref)) {
+        Node *node = as_node(ref);
+        depth += node->prefix_length;
+        int symbol = symbol_at(leaf->key, leaf->length, depth);
+        Ref sibling;
+        if (next_child(node, symbol, &sibling) >= 0)
+            next = sibling;
+        ref = *find_slot(node, symbol);
+        depth += symbol != 0;
+    }
+    return leftmost(next);
+}
+
+// `it->pair` is the leaf returned last and `it->table` is set once the
+// iteration started, so keys come in order without any other state.
+bool hmap_next(HashMap *map, HashMapIterator *it, const char **key, void **value) {
+    Leaf *leaf;
+    if (it->pair)
+        leaf = successor(map, it->pair);
+    else
+        leaf = it->table ? NULL : leftmost(map->root);
+    it->table = 1;
+    it->pair = leaf;
+    if (!leaf)
+        return false;
+    *key = leaf->key;
+    *value = leaf->value;
+    return true;
+}
@@ -1,443 +1,2542 @@
 #include <stdlib.h>
 #include <errno.h>
-#include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Tree.h"
+#include "arena.h"
+#include "children.h"
+#include "epoch.h"
+#include "hash.h"
+#include "journal.h"
+#include "listing.h"
+#include "node_lock.h"
+#include "path_cache.h"
+#include "pool.h"
+#include "read_indicator.h"
+#include "trace.h"
+
+// Operations first try to reach the folder they work on without locking the
+// folders on the way (see lock_folder_optimistic) and lock folders hand over
+// hand only if that keeps failing.
+
+// Number of folders an optimistic walk can pass; deeper folders are always
+// reached with locks.
+#define OPTIMISTIC_MAX_DEPTH 64
+
+// Number of optimistic walks tried before falling back to locks.
+#define OPTIMISTIC_RETRIES 3
+
+// Folders at fewer names than this are not kept in the path cache, which is
+// looked up for this many of the deepest ancestors of a path at most.
+#define PATH_CACHE_MIN_DEPTH 4
+#define PATH_CACHE_PROBES 4
+
+// Number of threads freeing folders removed by tree_remove_recursive.
+#define TEARDOWN_THREADS 2
+
+// A teardown task hands folders to other tasks once it has this many to free.
+#define TEARDOWN_SPLIT 256
+
+// tree_load_threads hands about this many subtrees to each thread.
+#define LOAD_SPLITS_PER_THREAD 8
+
+// Folders at fewer names than this may be read through the read indicator
+// from the start; deeper ones once they are found read by several threads.
+#define READ_BIAS_DEPTH 3
+
+// After revoking the reader bias of a folder, readers take its lock for this
+// many times as long as revoking took.
+#define READ_BIAS_INHIBIT 9
+
+#ifdef TREE_STATS
+// Lock statistics of a folder or an operation type, see TreeLockStats.
+typedef struct LockStats {
+    atomic_uint_least64_t acquisitions;
+    atomic_uint_least64_t contended;
+    atomic_uint_least64_t wait_ns;
+    atomic_uint_least64_t max_wait_ns;
+} LockStats;
+#endif
+
+typedef struct History History;
+
+// Subfolders a folder had before a change, kept while a snapshot may need them.
+struct History {
+    History *older; // Of the same folder.
+    History *next; // In the list of the root.
+    // Snapshots taken at times in [since, until) see these subfolders.
+    uint64_t since;
+    uint64_t until;
+    Listing *listing;
+    Tree *folders[]; // In the order of names in listing.
+};
+
+typedef struct Grave Grave;
+
+// A removed folder, kept with its subtree while a snapshot may reach it.
+struct Grave {
+    Grave *next;
+    Tree *node;
+    uint64_t removed; // Time of removal.
+};
+
+struct TreeSnapshot {
+    TreeSnapshot *prev;
+    TreeSnapshot *next;
+    Tree *tree;
+    Tree *folder;
+    uint64_t time;
+    // Taken by tree_walk, which only needs removed folders to be kept, not
+    // what subfolders were.
+    bool walk;
+};
+
+// The lock, the version and the subfolders come first, so that a walk through
+// a folder with few subfolders reads one cache line of it.
+struct Tree {
+    NodeLock lock;
+    // Odd while a writer modifies subfolders, incremented again afterwards.
+    atomic_uint version;
+    Children subfolders;
+    // Cached result of tree_list, or NULL; dropped whenever subfolders change.
+    _Atomic(Listing *) listing;
+    // Set once the folder may have been put into the path cache.
+    atomic_bool cached;
+    // Reader bias of the lock (see enter_biased) and the time (see
+    // bias_clock) before which it stays off once a writer revoked it.
+    atomic_uchar bias;
+    atomic_uint bias_inhibit;
+    // Time (see tree_snapshot) of the last change of subfolders, and what
+    // they were before, newest first. Guarded by the lock.
+    uint64_t modified;
+    History *history;
+#ifdef TREE_STATS
+    LockStats stats;
+#endif
+};
+
+// The root folder, which also owns the memory of all folders below it.
+typedef struct Root {
+    Tree tree;
+    Arena *arena; // Folders, their hash maps and keys.
+    _Atomic(Pool *) teardown; // Started by the first tree_remove_recursive.
+    PathCache *cache; // NULL unless made by tree_new_cached.
+    // Number of snapshots taken so far. A change made while it is t is seen
+    // by snapshots taken at times t and later.
+    _Atomic uint64_t clock;
+    atomic_uint live_snapshots;
+    atomic_uint live_walks; // Snapshots of tree_walk, not in live_snapshots.
+    pthread_mutex_t snapshots_lock; // Guards the lists below.
+    TreeSnapshot *snapshots; // Not released yet.
+    History *histories;
+    Grave *graves;
+    Journal *journal; // NULL unless tree_journal_start was called.
+#ifdef TREE_STATS
+    LockStats operations[TREE_OPERATIONS];
+#endif
+} Root;
+
+// `tree` must be the root passed to a tree_* function.
+static Arena *arena_of(Tree *tree) {
+
+    return ((Root *) tree)->arena;
+
+}
+
+#ifdef TREE_STATS
+
+// Statistics of the operation type the calling thread performs.
+static _Thread_local LockStats *operation_stats;
+
+#define COUNT_OPERATION(tree, operation) \
+    (operation_stats = &((Root *) (tree))->operations[operation])
+
+static void init_stats(LockStats *stats) {
+
+    atomic_init(&stats->acquisitions, 0);
+    atomic_init(&stats->contended, 0);
+    atomic_init(&stats->wait_ns, 0);
+    atomic_init(&stats->max_wait_ns, 0);
+
+}
+
+static void read_stats(LockStats *stats, TreeLockStats *result) {
+
+    result->acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+    result->contended = atomic_load_explicit(&stats->contended, memory_order_relaxed);
+    result->wait_ns = atomic_load_explicit(&stats->wait_ns, memory_order_relaxed);
+    result->max_wait_ns = atomic_load_explicit(&stats->max_wait_ns, memory_order_relaxed);
+
+}
+
+static void add_stats(LockStats *stats, bool contended, uint64_t wait) {
+
+    atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (!contended)
+        return;
+    atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->wait_ns, wait, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&stats->max_wait_ns, memory_order_relaxed);
+    while (wait > max && !atomic_compare_exchange_weak_explicit(
+            &stats->max_wait_ns, &max, wait, memory_order_relaxed, memory_order_relaxed));
+
+}
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+#else
+
+#define COUNT_OPERATION(tree, operation) ((void) 0)
+
+#endif
+
+#ifdef TREE_TRACE
+
+static void end_trace(const uint8_t *operation) {
+
+    trace_end(*operation);
+
+}
+
+// The end of the operation is recorded when the calling function returns.
+#define TRACE_OPERATION(operation, path, target) \
+    __attribute__((cleanup(end_trace))) uint8_t traced_operation = (operation); \
+    trace_begin(traced_operation, path, target)
+
+#else
+
+#define TRACE_OPERATION(operation, path, target) ((void) 0)
+
+#endif
+
+// Called by a tree_* function once its arguments are checked.
+#define START_OPERATION(tree, operation, path, target) \
+    COUNT_OPERATION(tree, operation); \
+    TRACE_OPERATION(operation, path, target)
+
+typedef struct JournalOperation {
+    Root *root;
+    uint64_t started; // Era the operation started in, see journal_begin.
+    uint64_t era; // Era in which it found the folders it changes.
+    uint64_t position; // After the record of its change, or 0.
+    int error; // Of logging the change.
+    bool committed;
+} JournalOperation;
+
+static int start_journaled(JournalOperation *operation) {
+
+    Journal *journal = operation->root->journal;
+    if (journal == NULL)
+        return 0;
+    int code = journal_begin(journal, &operation->started);
+    operation->era = operation->started;
+    return code;
+
+}
+
+static void end_journaled(JournalOperation *operation) {
+
+    Journal *journal = operation->root->journal;
+    if (journal == NULL)
+        return;
+    if (operation->position && !operation->committed)
+        journal_commit(journal, operation->position);
+    journal_end(journal, operation->started);
+
+}
+
+// Called by a tree_* function that changes folders, after START_OPERATION.
+// Returns the error of the journal, if it failed, without changing anything.
+#define JOURNAL_OPERATION(tree) \
+    __attribute__((cleanup(end_journaled))) JournalOperation journal_operation = \
+            {(Root *) (tree), 0, 0, 0, 0, false}; \
+    int journal_error = start_journaled(&journal_operation); \
+    if (journal_error != 0) return journal_error
+
+// Called with the folders the operation changes locked, before it changes
+// them. Returns true if a move or recursive remove was logged while they were
+// looked up; the operation then unlocks them and looks them up again, since
+// the path it was given may have led to them only before or only after it.
+// Changes logged later are followed by journal_append.
+static bool moved_meanwhile(JournalOperation *operation) {
+
+    Journal *journal = operation->root->journal;
+    return journal && journal_moved(journal, &operation->era);
+
+}
+
+// Logs a change. Called before end_modification of the folders it changed,
+// so that no change that depends on it can be logged before it.
+static void log_change(JournalOperation *operation, JournalType type, const char *path,
+                       const char *target) {
+
+    Journal *journal = operation->root->journal;
+    if (journal)
+        operation->error = journal_append(journal, operation->era, type, path, target,
+                                          &operation->position);
+
+}
+
+// Returns 0 once the change logged by log_change is committed, or the errno
+// value of the journal if it could not be.
+static int commit_journaled(JournalOperation *operation) {
+
+    Journal *journal = operation->root->journal;
+    if (journal == NULL || operation->error != 0)
+        return journal ? operation->error : 0;
+    operation->committed = true;
+    return journal_commit(journal, operation->position);
+
+}
+
+#ifdef TREE_READ_BIAS
+
+#define BIAS_ALLOWED 1 // The bias may be turned on.
+#define BIAS_ON 2 // Readers announce themselves in the read indicator.
+
+// Nanoseconds, wrapping around.
+static uint32_t bias_clock(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+
+}
+
+// Takes the lock of folder as a reader without writing to it, by announcing
+// the thread in the read indicator, if the reader bias of the folder is on.
+// Readers of a folder near the root then do not all write to one cache line.
+static bool enter_biased(Tree *tree) {
+
+    if (!(atomic_load_explicit(&tree->bias, memory_order_relaxed) & BIAS_ON))
+        return false;
+    // Pairs with revoke_bias: either the writer finds the thread in the
+    // indicator, or the thread finds the bias off.
+    if (!read_indicator_arrive(tree))
+        return false;
+    if (atomic_load(&tree->bias) & BIAS_ON)
+        return true;
+    read_indicator_depart(tree);
+    return false;
+
+}
+
+// Called by a reader that took the lock of folder itself. Turns the bias on
+// unless a writer revoked it recently; a folder deeper than READ_BIAS_DEPTH
+// needs another reader holding the lock at the same time first.
+static void grant_bias(Tree *tree) {
+
+    unsigned char bias = atomic_load_explicit(&tree->bias, memory_order_relaxed);
+    if (bias & BIAS_ON)
+        return;
+    if (!(bias & BIAS_ALLOWED) && !node_lock_shared(&tree->lock))
+        return;
+    uint32_t inhibit = atomic_load_explicit(&tree->bias_inhibit, memory_order_relaxed);
+    if ((int32_t) (bias_clock() - inhibit) < 0)
+        return;
+    // The release pairs with enter_biased, for the writer the lock was
+    // taken after.
+    atomic_fetch_or_explicit(&tree->bias, BIAS_ALLOWED | BIAS_ON, memory_order_release);
+
+}
+
+// Turns the bias of folder off and waits for the readers that got in through
+// the read indicator. Called by a writer holding the lock, or once no new
+// operation can get into the folder.
+static void revoke_bias(Tree *tree) {
+
+    if (!(atomic_load_explicit(&tree->bias, memory_order_relaxed) & BIAS_ON))
+        return;
+    uint32_t start = bias_clock();
+    atomic_fetch_and(&tree->bias, ~BIAS_ON);
+    read_indicator_drain(tree);
+    // Folders changed often spend little of their time revoking.
+    uint32_t now = bias_clock();
+    atomic_store_explicit(&tree->bias_inhibit, now + (now - start) * READ_BIAS_INHIBIT,
+                          memory_order_relaxed);
+
+}
+
+// Called when folder is linked at name i of a path.
+static void allow_bias(Tree *tree, size_t i) {
+
+    if (i + 1 < READ_BIAS_DEPTH)
+        atomic_fetch_or_explicit(&tree->bias, BIAS_ALLOWED, memory_order_relaxed);
+
+}
+
+#else
+
+#define allow_bias(tree, i) ((void) 0)
+
+#endif
+
+#if defined(TREE_STATS) || defined(TREE_TRACE)
+
+// Takes the lock of folder with `lock`, counting and tracing the wait if
+// `try_lock` fails.
+static void lock_instrumented(Tree *tree, TraceLock mode, bool (*try_lock)(NodeLock *),
+                              void (*lock)(NodeLock *)) {
+
+    bool contended = !try_lock(&tree->lock);
+#ifdef TREE_STATS
+    uint64_t start = contended ? now_ns() : 0;
+#endif
+#ifdef TREE_TRACE
+    if (contended)
+        trace_lock(TRACE_WAIT, mode, tree);
+#endif
+    if (contended)
+        lock(&tree->lock);
+#ifdef TREE_STATS
+    uint64_t wait = contended ? now_ns() - start : 0;
+    add_stats(&tree->stats, contended, wait);
+    if (operation_stats)
+        add_stats(operation_stats, contended, wait);
+#endif
+#ifdef TREE_TRACE
+    trace_lock(TRACE_ACQUIRE, mode, tree);
+#else
+    (void) mode;
+#endif
+
+}
+
+#define INSTRUMENTED_LOCKS
+
+#endif
+
+static void entry_protocole_reader(Tree *tree) {
+
+#ifdef TREE_READ_BIAS
+    if (enter_biased(tree)) {
+#ifdef TREE_STATS
+        add_stats(&tree->stats, false, 0);
+        if (operation_stats)
+            add_stats(operation_stats, false, 0);
+#endif
+#ifdef TREE_TRACE
+        trace_lock(TRACE_ACQUIRE, TRACE_READ, tree);
+#endif
+        return;
+    }
+#endif
+#ifdef INSTRUMENTED_LOCKS
+    lock_instrumented(tree, TRACE_READ, node_try_lock_read, node_lock_read);
+#else
+    node_lock_read(&tree->lock);
+#endif
+#ifdef TREE_READ_BIAS
+    grant_bias(tree);
+#endif
+
+}
+
+static void exit_protocole_reader(Tree *tree) {
+
+#ifdef TREE_TRACE
+    trace_lock(TRACE_RELEASE, TRACE_READ, tree);
+#endif
+#ifdef TREE_READ_BIAS
+    if (read_indicator_depart(tree))
+        return;
+#endif
+    node_unlock_read(&tree->lock);
+
+}
+
+static void entry_protocole_writer(Tree *tree) {
+
+#ifdef INSTRUMENTED_LOCKS
+    lock_instrumented(tree, TRACE_WRITE, node_try_lock_write, node_lock_write);
+#else
+    node_lock_write(&tree->lock);
+#endif
+#ifdef TREE_READ_BIAS
+    revoke_bias(tree);
+#endif
+
+}
+
+static void exit_protocole_writer(Tree *tree) {
+
+#ifdef TREE_TRACE
+    trace_lock(TRACE_RELEASE, TRACE_WRITE, tree);
+#endif
+    node_unlock_write(&tree->lock);
+
+}
+
+// Waits until all operations in node are done.
+static void wait_for_operations_in_node(Tree *tree) {
+
+#ifdef TREE_READ_BIAS
+    revoke_bias(tree);
+#endif
+#ifdef INSTRUMENTED_LOCKS
+    lock_instrumented(tree, TRACE_IDLE, node_lock_idle, node_lock_wait_idle);
+#else
+    node_lock_wait_idle(&tree->lock);
+#endif
+
+}
+
+static void init(Tree *tree) {
+
+    node_lock_init(&tree->lock);
+    atomic_init(&tree->version, 0);
+    children_init(&tree->subfolders);
+    atomic_init(&tree->listing, NULL);
+    atomic_init(&tree->cached, false);
+    atomic_init(&tree->bias, 0);
+    atomic_init(&tree->bias_inhibit, 0);
+    tree->modified = 0;
+    tree->history = NULL;
+#ifdef TREE_STATS
+    init_stats(&tree->stats);
+#endif
+
+}
+
+// Called by a writer holding the folder's lock before it changes subfolders
+// or waits for operations in one of them.
+static void begin_modification(Tree *tree) {
+
+    atomic_fetch_add_explicit(&tree->version, 1, memory_order_relaxed);
+    // Pairs with the fence in lock_folder_optimistic: either the writer sees
+    // the reader holding a lock below, or the reader sees the new version.
+    atomic_thread_fence(memory_order_seq_cst);
+
+}
+
+static void end_modification(Tree *tree) {
+
+    atomic_fetch_add_explicit(&tree->version, 1, memory_order_release);
+
+}
+
+// Returns a new empty folder allocated in the arena of `tree`. It must be
+// allocated before the change that links it reads the time, so that it does
+// not appear to have changed after that (see history_at).
+static Tree *new_node(Tree *tree) {
+
+    Tree *node = arena_alloc(arena_of(tree), sizeof(Tree));
+    init(node);
+    node->modified = atomic_load(&((Root *) tree)->clock);
+    return node;
+
+}
+
+// Returns the subfolder of folder with name i of path, or NULL.
+static Tree *get_child(Tree *folder, const ParsedPath *path, size_t i) {
+
+    return children_get(&folder->subfolders, path_name(path, i),
+                        path_name_length(path, i), path->hashes[i]);
+
+}
+
+// Returns the listing of folder, building it if it is not cached, with a
+// reference for the caller. The folder must be locked.
+static Listing *acquire_listing(Tree *tree, Tree *folder) {
+
+    Listing *listing = atomic_load_explicit(&folder->listing, memory_order_acquire);
+    if (listing == NULL) {
+        Listing *built = listing_new(arena_of(tree), &folder->subfolders);
+        // Other readers of the folder may be building it too; the first wins.
+        if (atomic_compare_exchange_strong_explicit(&folder->listing, &listing, built,
+                                                    memory_order_acq_rel,
+                                                    memory_order_acquire))
+            listing = built;
+        else
+            listing_release(arena_of(tree), built);
+    }
+    listing_acquire(listing);
+    return listing;
+
+}
+
+// Drops the cached listing of folder, whose subfolders changed. The folder
+// must be locked as a writer.
+static void drop_listing(Tree *tree, Tree *folder) {
+
+    Listing *listing = atomic_exchange_explicit(&folder->listing, NULL,
+                                                memory_order_relaxed);
+    if (listing)
+        listing_release(arena_of(tree), listing);
+
+}
+
+static void lock_snapshots(Root *root) {
+
+    if (pthread_mutex_lock(&root->snapshots_lock) != 0)
+        syserr("lock failed");
+
+}
+
+static void unlock_snapshots(Root *root) {
+
+    if (pthread_mutex_unlock(&root->snapshots_lock) != 0)
+        syserr("unlock failed");
+
+}
+
+// Returns the time to stamp changes with. A writer reads it once it holds the
+// locks of all folders it is going to change, and only once, so that a
+// snapshot sees either all or none of its changes.
+static uint64_t change_time(Tree *tree) {
+
+    return atomic_load(&((Root *) tree)->clock);
+
+}
+
+// Returns whether a snapshot not released yet was taken at a time in
+// [since, until); those of tree_walk count only if `walks` is set. Must be
+// called with the snapshots locked.
+static bool snapshot_between(Root *root, uint64_t since, uint64_t until, bool walks) {
+
+    for (TreeSnapshot *snapshot = root->snapshots; snapshot; snapshot = snapshot->next) {
+        if ((walks || !snapshot->walk) && snapshot->time >= since && snapshot->time < until)
+            return true;
+    }
+    return false;
+
+}
+
+// Called by a writer holding the folder's lock before it changes subfolders
+// at time `now`. Keeps the subfolders as they are if a snapshot may need them.
+static void preserve_subfolders(Tree *tree, Tree *folder, uint64_t now) {
+
+    if (folder->modified == now)
+        return; // No snapshot was taken since the last change.
+    Root *root = (Root *) tree;
+    // A snapshot taken before `now` was counted before the clock was read.
+    if (atomic_load(&root->live_snapshots) > 0) {
+        Listing *listing = acquire_listing(tree, folder);
+        History *history = malloc(sizeof(History) + listing->count * sizeof(Tree *));
+        if (history == NULL) fatal("malloc failed");
+        history->since = folder->modified;
+        history->until = now;
+        history->listing = listing;
+        for (size_t i = 0; i < listing->count; ++i) {
+            const char *name = listing->text + listing->starts[i];
+            size_t length = listing_name_length(listing, i);
+            history->folders[i] = children_get(&folder->subfolders, name, length,
+                                               hash_bytes(name, length));
+        }
+
+        lock_snapshots(root);
+        bool needed = snapshot_between(root, history->since, history->until, false);
+        if (needed) {
+            history->older = folder->history;
+            folder->history = history;
+            history->next = root->histories;
+            root->histories = history;
+        }
+        unlock_snapshots(root);
+        if (!needed) {
+            listing_release(arena_of(tree), listing);
+            free(history);
+        }
+    }
+    folder->modified = now;
+
+}
+
+// Returns the subfolders folder had at `time` if they changed since, or NULL.
+// The folder must be locked.
+static History *history_at(Tree *folder, uint64_t time) {
+
+    if (folder->modified <= time)
+        return NULL;
+    // A history is freed only once no snapshot taken before its `until` is
+    // left, so every one looked at here is still there.
+    History *history = folder->history;
+    while (history->since > time)
+        history = history->older;
+    return history;
+
+}
+
+// Called instead of freeing node, just unlinked at time `now`, with the
+// folders below it. Returns true if a snapshot may still reach it, in which
+// case it is kept until the snapshot is released.
+static bool bury(Tree *tree, Tree *node, uint64_t now) {
+
+    Root *root = (Root *) tree;
+    if (atomic_load(&root->live_snapshots) == 0 && atomic_load(&root->live_walks) == 0)
+        return false;
+    lock_snapshots(root);
+    bool needed = snapshot_between(root, 0, now, true);
+    if (needed) {
+        Grave *grave = malloc(sizeof(Grave));
+        if (grave == NULL) fatal("malloc failed");
+        grave->node = node;
+        grave->removed = now;
+        grave->next = root->graves;
+        root->graves = grave;
+    }
+    unlock_snapshots(root);
+    return needed;
+
+}
+
+// Puts snapshot, whose tree, folder and walk are set, in the list at the
+// current time. The folder must be locked, so that it cannot be removed before.
+static void add_snapshot(TreeSnapshot *snapshot) {
+
+    Root *root = (Root *) snapshot->tree;
+    // Counted before the clock moves, see preserve_subfolders.
+    atomic_fetch_add(snapshot->walk ? &root->live_walks : &root->live_snapshots, 1);
+    lock_snapshots(root);
+    snapshot->time = atomic_fetch_add(&root->clock, 1);
+    snapshot->prev = NULL;
+    snapshot->next = root->snapshots;
+    if (root->snapshots)
+        root->snapshots->prev = snapshot;
+    root->snapshots = snapshot;
+    unlock_snapshots(root);
+
+}
+
+static void submit_teardown(Tree *tree, Tree *node);
+
+// Takes snapshot, whose tree, folder and walk are set, out of the list and
+// frees what only it kept.
+static void remove_snapshot(TreeSnapshot *snapshot) {
+
+    Tree *tree = snapshot->tree;
+    Root *root = (Root *) tree;
+    Grave *freed = NULL;
+
+    lock_snapshots(root);
+    if (snapshot->prev)
+        snapshot->prev->next = snapshot->next;
+    else
+        root->snapshots = snapshot->next;
+    if (snapshot->next)
+        snapshot->next->prev = snapshot->prev;
+
+    // Folders may still point to the histories freed here, but only ones
+    // that no remaining snapshot looks at (see history_at).
+    for (History **link = &root->histories; *link && !snapshot->walk;) {
+        History *history = *link;
+        if (snapshot_between(root, 0, history->until, false)) {
+            link = &history->next;
+            continue;
+        }
+        *link = history->next;
+        listing_release(arena_of(tree), history->listing);
+        free(history);
+    }
+    for (Grave **link = &root->graves; *link;) {
+        Grave *grave = *link;
+        if (snapshot_between(root, 0, grave->removed, true)) {
+            link = &grave->next;
+            continue;
+        }
+        *link = grave->next;
+        grave->next = freed;
+        freed = grave;
+    }
+    unlock_snapshots(root);
+    atomic_fetch_sub(snapshot->walk ? &root->live_walks : &root->live_snapshots, 1);
+
+    while (freed) {
+        Grave *grave = freed;
+        freed = grave->next;
+        submit_teardown(tree, grave->node);
+        free(grave);
+    }
+
+}
+
+Tree* tree_new() {
+
+    Root *root = malloc(sizeof(Root));
+    if (root == NULL) fatal("malloc failed");
+
+    root->arena = arena_new();
+    atomic_init(&root->teardown, NULL);
+    root->cache = NULL;
+    atomic_init(&root->clock, 0);
+    atomic_init(&root->live_snapshots, 0);
+    atomic_init(&root->live_walks, 0);
+    if (pthread_mutex_init(&root->snapshots_lock, 0) != 0)
+        syserr("mutex init failed");
+    root->snapshots = NULL;
+    root->histories = NULL;
+    root->graves = NULL;
+    root->journal = NULL;
+    init(&root->tree);
+    allow_bias(&root->tree, 0);
+#ifdef TREE_STATS
+    for (int i = 0; i < TREE_OPERATIONS; ++i)
+        init_stats(&root->operations[i]);
+#endif
+
+    return &root->tree;
+
+}
+
+static void destroy(Tree *tree) {
+
+    node_lock_destroy(&tree->lock);
+
+}
+
+void tree_free(Tree *tree) {
+
+    tree_free_threads(tree, 1);
+
+}
+
+void tree_free_threads(Tree *tree, int threads) {
+
+    tree_journal_stop(tree);
+    Pool *teardown = atomic_load(&((Root *) tree)->teardown);
+    if (teardown)
+        pool_free(teardown);
+    // Everything below the root is released with the arena at once, without
+    // visiting folders, so the depth of the tree does not matter. Locks of
+    // folders are not destroyed one by one, as on Linux they hold no resources.
+    arena_free_parallel(arena_of(tree), threads);
+    if (((Root *) tree)->cache)
+        path_cache_free(((Root *) tree)->cache);
+    // Listings of histories and buried folders went with the arena.
+    Root *root = (Root *) tree;
+    while (root->histories) {
+        History *history = root->histories;
+        root->histories = history->next;
+        free(history);
+    }
+    while (root->graves) {
+        Grave *grave = root->graves;
+        root->graves = grave->next;
+        free(grave);
+    }
+    if (pthread_mutex_destroy(&root->snapshots_lock) != 0)
+        syserr("mutex destroy failed");
+    destroy(tree);
+    free(tree);
+
+}
+
+Tree *tree_new_cached(size_t entries) {
+
+    Tree *tree = tree_new();
+    ((Root *) tree)->cache = path_cache_new(entries);
+    return tree;
+
+}
+
+void tree_cache_stats(Tree *tree, uint64_t *hits, uint64_t *misses,
+                      uint64_t *invalidations) {
+
+    PathCacheStats stats = {0, 0, 0};
+    if (((Root *) tree)->cache)
+        path_cache_stats(((Root *) tree)->cache, &stats);
+    *hits = stats.hits;
+    *misses = stats.misses;
+    *invalidations = stats.invalidations;
+
+}
+
+size_t tree_memory(Tree *tree) {
+
+    Pool *teardown = atomic_load(&((Root *) tree)->teardown);
+    if (teardown)
+        pool_wait(teardown);
+    return arena_in_use(arena_of(tree));
+
+}
+
+// Makes the path cache forget where folders are. Called by a writer before it
+// unlinks a folder that may be in the cache, or moves one that may have
+// cached folders below it, and before it waits for operations there.
+static void invalidate_paths(Tree *tree) {
+
+    if (((Root *) tree)->cache)
+        path_cache_invalidate(((Root *) tree)->cache);
+
+}
+
+// Hash of the first `depth` names of path, its key in the path cache.
+static uint64_t prefix_hash(const ParsedPath *path, size_t depth) {
+
+    uint64_t hash = HASH_SEED;
+    for (size_t i = 0; i < depth; ++i)
+        hash = hash_mix(hash ^ path->hashes[i], HASH_P1);
+    return hash;
+
+}
+
+// Sets keys[i] to the path cache key of the first *first + i names, for the
+// deepest ancestors of the folder at `depth` names of path (itself included)
+// worth looking up, and returns their number.
+static size_t cache_keys(const ParsedPath *path, size_t depth,
+                         uint64_t keys[PATH_CACHE_PROBES], size_t *first) {
+
+    *first = depth + 1;
+    if (depth < PATH_CACHE_MIN_DEPTH)
+        return 0;
+    size_t n = depth + 1 - PATH_CACHE_MIN_DEPTH;
+    if (n > PATH_CACHE_PROBES)
+        n = PATH_CACHE_PROBES;
+    *first = depth + 1 - n;
+    keys[0] = prefix_hash(path, *first);
+    for (size_t i = 1; i < n; ++i)
+        keys[i] = hash_mix(keys[i - 1] ^ path->hashes[*first + i - 1], HASH_P1);
+    return n;
+
+}
+
+// Iterates to the folder at the first `depth` names of path; *next_component
+// is the root at first, and in the end it points to a tree representing this
+// folder. If the path cache has an ancestor of the folder, the iteration
+// starts there. In each node we are considered as a reader. In the end, the
+// last node is still a reader.
+// Returns ENOENT if no such subpath exists and 0 if it does.
+static int iterate_to_folder(const ParsedPath *path, size_t depth,
+                             Tree **next_component) {
+
+    PathCache *cache = ((Root *) *next_component)->cache;
+    uint64_t keys[PATH_CACHE_PROBES];
+    size_t first_probe = 0;
+    size_t n_probes = cache ? cache_keys(path, depth, keys, &first_probe) : 0;
+    uint64_t generation = cache ? path_cache_generation(cache) : 0;
+
+    size_t from = 0;
+    Tree *start = NULL;
+    if (n_probes > 0) {
+        epoch_enter();
+        size_t index;
+        start = path_cache_find(cache, keys, n_probes, generation, &index);
+        if (start) {
+            entry_protocole_reader(start);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (path_cache_generation(cache) == generation) {
+                *next_component = start;
+                from = first_probe + index;
+            } else {
+                // Unlocked inside the section, see lock_folder_optimistic.
+                exit_protocole_reader(start);
+                start = NULL;
+            }
+        }
+        epoch_exit();
+    }
+    if (start == NULL)
+        entry_protocole_reader(*next_component);
+
+    Tree *wait_next_component;
+    for (size_t i = from; i < depth; ++i) {
+        wait_next_component = get_child(*next_component, path, i);
+        if (wait_next_component == NULL) {
+            exit_protocole_reader(*next_component);
+            return ENOENT;
+        }
+        entry_protocole_reader(wait_next_component);
+        if (i + 1 == depth && n_probes > 0) {
+            // The parent is still locked, so the folder cannot be removed
+            // before tree_remove sees the flag.
+            atomic_store_explicit(&wait_next_component->cached, true,
+                                  memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (path_cache_generation(cache) == generation)
+                path_cache_put(cache, keys[n_probes - 1], wait_next_component, generation);
+        }
+        exit_protocole_reader(*next_component);
+        *next_component = wait_next_component;
+    }
+    return 0;
+
+}
+
+// Walks to the folder at the first `depth` names of path without locking
+// folders on the way and locks it (as a writer if `writer` is set). The walk
+// starts from the deepest ancestor found in the path cache, if the tree has
+// one, or from the root. The versions of all folders passed (and the cache
+// generation) are checked once the lock is held, so the folder is known to
+// have been at the path at that moment. Returns 0 and sets *folder, ENOENT if
+// there is no such folder, or EAGAIN if the walk kept racing with writers or
+// the path is too deep, in which case the caller has to use locks instead.
+// If `reached` is not NULL, a missing folder is not an error: the walk locks
+// and returns the deepest folder on the path that exists, and sets *reached
+// to the number of names leading to it.
+static int lock_folder_optimistic(Tree *tree, const ParsedPath *path, size_t depth,
+                                  bool writer, Tree **folder, size_t *reached) {
+
+    PathCache *cache = ((Root *) tree)->cache;
+    uint64_t keys[PATH_CACHE_PROBES];
+    size_t first_probe = 0;
+    size_t n_probes = cache ? cache_keys(path, depth, keys, &first_probe) : 0;
+
+    Tree *seen[OPTIMISTIC_MAX_DEPTH];
+    unsigned int versions[OPTIMISTIC_MAX_DEPTH];
+
+    for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; ++attempt) {
+        epoch_enter();
+        Tree *node = tree;
+        size_t from = 0;
+        uint64_t generation = 0;
+        if (cache) {
+            generation = path_cache_generation(cache);
+            size_t index;
+            Tree *start = n_probes > 0
+                          ? path_cache_find(cache, keys, n_probes, generation, &index)
+                          : NULL;
+            if (start) {
+                node = start;
+                from = first_probe + index;
+            }
+        }
+        if (depth - from > OPTIMISTIC_MAX_DEPTH) {
+            epoch_exit();
+            return EAGAIN;
+        }
+
+        size_t walked = from;
+        bool consistent = true;
+        bool complete = true;
+        for (; walked < depth; ++walked) {
+            unsigned int version =
+                    atomic_load_explicit(&node->version, memory_order_acquire);
+            void *child = NULL;
+            if ((version & 1) ||
+                !children_get_optimistic(&node->subfolders, path_name(path, walked),
+                                         path_name_length(path, walked),
+                                         path->hashes[walked], &child)) {
+                consistent = false;
+                break;
+            }
+            seen[walked - from] = node;
+            versions[walked - from] = version;
+            if (child == NULL) {
+                complete = false;
+                break;
+            }
+            node = child;
+        }
+        if (!consistent) {
+            epoch_exit();
+            continue;
+        }
+        // The folder at `walked` names was looked up in, but not entered.
+        size_t checked = (complete ? walked : walked + 1) - from;
+
+        bool lock = complete || reached != NULL;
+        if (lock) {
+            if (writer)
+                entry_protocole_writer(node);
+            else
+                entry_protocole_reader(node);
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        for (size_t i = 0; i < checked && consistent; ++i) {
+            consistent = atomic_load_explicit(&seen[i]->version,
+                                              memory_order_relaxed) == versions[i];
+        }
+        if (cache)
+            consistent = consistent && path_cache_generation(cache) == generation;
+
+        if (consistent && lock && cache && walked > from &&
+            walked >= PATH_CACHE_MIN_DEPTH) {
+            // Pairs with tree_remove, which either sees the flag and
+            // invalidates the cache, or changes the parent's version first.
+            atomic_store_explicit(&node->cached, true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            Tree *parent = seen[walked - 1 - from];
+            if (atomic_load_explicit(&parent->version, memory_order_relaxed) ==
+                versions[walked - 1 - from]) {
+                uint64_t key = walked >= first_probe ? keys[walked - first_probe]
+                                                     : prefix_hash(path, walked);
+                path_cache_put(cache, key, node, generation);
+            }
+        }
+
+        // The folder may have been removed, so it is unlocked before leaving
+        // the section, while its memory cannot be reused yet.
+        if (!consistent && lock) {
+            if (writer)
+                exit_protocole_writer(node);
+            else
+                exit_protocole_reader(node);
+        }
+        epoch_exit();
+
+        if (consistent) {
+            if (!lock)
+                return ENOENT;
+            *folder = node;
+            if (reached != NULL)
+                *reached = walked;
+            return 0;
+        }
+    }
+    return EAGAIN;
+
+}
+
+char* tree_list(Tree *tree, const char* path) {
+
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return NULL;
+    START_OPERATION(tree, TREE_LIST, path, NULL);
+
+    Tree *next_component = tree;
+    int code = lock_folder_optimistic(tree, &parsed, parsed.depth, false,
+                                      &next_component, NULL);
+    if (code == EAGAIN)
+        code = iterate_to_folder(&parsed, parsed.depth, &next_component);
+    if (code == ENOENT) return NULL;
+
+    // Only the reference is taken under the lock; the copy is made outside.
+    Listing *listing = acquire_listing(tree, next_component);
+    exit_protocole_reader(next_component);
+    char *result = listing_to_string(listing);
+    listing_release(arena_of(tree), listing);
+    return result;
+
+}
+
+// Locks the folder at the first `depth` names of path as a writer and sets
+// *parent to it. Returns ENOENT if there is no such folder and 0 if there is.
+static int lock_parent_writer(Tree *tree, const ParsedPath *path, size_t depth,
+                              Tree **parent) {
+
+    int code = lock_folder_optimistic(tree, path, depth, true, parent, NULL);
+    if (code != EAGAIN)
+        return code;
+
+    *parent = tree;
+    if (depth == 0) {
+        entry_protocole_writer(*parent);
+    } else {
+        // We iterate to grandparent of a node to create because as we enter
+        // a parent node we are considered a writer.
+        Tree *next_component = tree;
+        code = iterate_to_folder(path, depth - 1, &next_component);
+        if (code == ENOENT) return ENOENT;
+
+        *parent = get_child(next_component, path, depth - 1);
+        if (*parent == NULL) {
+            exit_protocole_reader(next_component);
+            return ENOENT;
+        }
+        entry_protocole_writer(*parent);
+        exit_protocole_reader(next_component);
+    }
+    return 0;
+
+}
+
+int tree_list_page(Tree *tree, const char *path, const char *after,
+                   size_t max_names, char *buffer, size_t size, size_t *count) {
+
+    *count = 0;
+    PARSED_PATH(parsed);
+    if (size == 0 || !parse_path(path, &parsed)) return EINVAL;
+    START_OPERATION(tree, TREE_LIST, path, NULL);
+
+    // `after` may point into buffer, which is overwritten below.
+    char last[MAX_FOLDER_NAME_LENGTH_UTILS + 2] = "";
+    if (after != NULL) {
+        strncpy(last, after, sizeof(last) - 1);
+        last[sizeof(last) - 1] = '\0';
+    }
+
+    Tree *next_component = tree;
+    int code = lock_folder_optimistic(tree, &parsed, parsed.depth, false,
+                                      &next_component, NULL);
+    if (code == EAGAIN)
+        code = iterate_to_folder(&parsed, parsed.depth, &next_component);
+    if (code == ENOENT) return ENOENT;
+
+    Listing *listing = acquire_listing(tree, next_component);
+    exit_protocole_reader(next_component);
+
+    char *position = buffer;
+    size_t i = listing_find_after(listing, last);
+    for (; i < listing->count && (max_names == 0 || *count < max_names); ++i) {
+        size_t length = listing_name_length(listing, i);
+        size_t needed = length + (*count > 0); // With a comma before it.
+        if (needed >= size - (position - buffer))
+            break;
+        if (*count > 0)
+            *position++ = ',';
+        memcpy(position, listing->text + listing->starts[i], length);
+        position += length;
+        (*count)++;
+    }
+    *position = '\0';
+    // Not even the first name fits.
+    bool too_small = *count == 0 && i < listing->count;
+    listing_release(arena_of(tree), listing);
+
+    return too_small ? ERANGE : 0;
+
+}
+
+// A subfolder still to be visited by tree_walk.
+typedef struct WalkEntry {
+    Tree *node;
+    size_t name; // Offset of the name in the names of its worker or task.
+    size_t length;
+} WalkEntry;
+
+typedef struct WalkTask WalkTask;
+
+// Subfolders of one folder handed by a worker of tree_walk to the others. The
+// entries are followed by the path of the folder and the names.
+struct WalkTask {
+    WalkTask *next;
+    size_t path_length;
+    size_t count;
+    size_t names_length;
+    WalkEntry entries[];
+};
+
+// Subfolders of a folder on the path of a worker from its task down to the
+// folder it visits; entries [next, end) of the worker are still to be visited.
+typedef struct WalkFrame {
+    size_t first;
+    size_t next;
+    size_t end;
+    size_t path_length; // Of the folder.
+    size_t names_length; // Of the worker before the names of the entries.
+} WalkFrame;
+
+typedef struct Walk Walk;
+
+typedef struct WalkWorker {
+    Walk *walk;
+    pthread_t thread;
+    pthread_mutex_t lock; // Guards the tasks.
+    WalkTask *first_task; // Taken first, by any worker.
+    WalkTask *last_task;
+    char *path; // Of the folder visited.
+    size_t path_capacity;
+    char *names;
+    size_t names_length, names_capacity;
+    WalkEntry *entries;
+    size_t entries_length, entries_capacity;
+    WalkFrame *frames;
+    size_t frames_length, frames_capacity;
+} WalkWorker;
+
+struct Walk {
+    Tree *tree;
+    TreeWalkCallback callback;
+    void *context;
+    atomic_bool stopped; // By the callback.
+    atomic_size_t pending; // Tasks not finished, the first one included.
+    atomic_int hungry; // Workers looking for a task.
+    pthread_mutex_t idle_lock; // Guards events.
+    pthread_cond_t idle; // Hungry workers wait here for the events to change.
+    unsigned events; // Tasks added, and the end of the walk.
+    int n_workers;
+    WalkWorker workers[];
+};
+
+// Makes *array, of *capacity elements of `size` bytes, hold at least `needed`.
+static void reserve(void *array, size_t *capacity, size_t needed, size_t size) {
+
+    if (needed <= *capacity)
+        return;
+    size_t grown = *capacity < 16 ? 16 : *capacity;
+    while (grown < needed)
+        grown *= 2;
+    void *resized = realloc(*(void **) array, grown * size);
+    if (resized == NULL) fatal("realloc failed");
+    *(void **) array = resized;
+    *capacity = grown;
+
+}
+
+// Appends an entry for `node` named by `length` bytes of `name`.
+static void add_entry(WalkWorker *worker, Tree *node, const char *name, size_t length) {
+
+    reserve(&worker->entries, &worker->entries_capacity, worker->entries_length + 1,
+            sizeof(WalkEntry));
+    reserve(&worker->names, &worker->names_capacity, worker->names_length + length,
+            sizeof(char));
+    worker->entries[worker->entries_length++] =
+            (WalkEntry) {node, worker->names_length, length};
+    memcpy(worker->names + worker->names_length, name, length);
+    worker->names_length += length;
+
+}
+
+static void push_frame(WalkWorker *worker, size_t first, size_t path_length,
+                       size_t names_length) {
+
+    reserve(&worker->frames, &worker->frames_capacity, worker->frames_length + 1,
+            sizeof(WalkFrame));
+    worker->frames[worker->frames_length++] =
+            (WalkFrame) {first, first, worker->entries_length, path_length, names_length};
+
+}
+
+// Reads the subfolders of node, whose path of `path_length` is in the path of
+// the worker, to visit them next. Only node is locked, and only meanwhile.
+static void expand(WalkWorker *worker, Tree *node, size_t path_length) {
+
+    size_t first = worker->entries_length, names_length = worker->names_length;
+    entry_protocole_reader(node);
+    const char *name;
+    size_t length;
+    void *child;
+    ChildrenIterator it = children_iterator(&node->subfolders);
+    while (children_next(&node->subfolders, &it, &name, &length, &child))
+        add_entry(worker, child, name, length);
+    exit_protocole_reader(node);
+    if (worker->entries_length > first)
+        push_frame(worker, first, path_length, names_length);
+
+}
+
+static void add_task(WalkWorker *worker, WalkTask *task) {
+
+    task->next = NULL;
+    if (pthread_mutex_lock(&worker->lock) != 0) syserr("lock failed");
+    if (worker->last_task)
+        worker->last_task->next = task;
+    else
+        worker->first_task = task;
+    worker->last_task = task;
+    if (pthread_mutex_unlock(&worker->lock) != 0) syserr("unlock failed");
+
+}
+
+static WalkTask *take_task(WalkWorker *worker) {
+
+    if (pthread_mutex_lock(&worker->lock) != 0) syserr("lock failed");
+    WalkTask *task = worker->first_task;
+    if (task) {
+        worker->first_task = task->next;
+        if (worker->first_task == NULL)
+            worker->last_task = NULL;
+    }
+    if (pthread_mutex_unlock(&worker->lock) != 0) syserr("unlock failed");
+    return task;
+
+}
+
+// Tells workers waiting in find_task to look again: one of them, or all of
+// them at the end of the walk.
+static void walk_signal(Walk *walk, bool all) {
+
+    if (pthread_mutex_lock(&walk->idle_lock) != 0) syserr("lock failed");
+    walk->events++;
+    if (all) {
+        if (pthread_cond_broadcast(&walk->idle) != 0)
+            syserr("cond broadcast failed");
+    } else if (pthread_cond_signal(&walk->idle) != 0) {
+        syserr("cond signal failed");
+    }
+    if (pthread_mutex_unlock(&walk->idle_lock) != 0) syserr("unlock failed");
+
+}
+
+static void finish_task(Walk *walk) {
+
+    if (atomic_fetch_sub(&walk->pending, 1) == 1)
+        walk_signal(walk, true);
+
+}
+
+// Called when other workers wait for work: hands them the subfolders left in
+// the lowest frame (the largest part of the subtree, if it is deep), or half
+// of them if the worker is visiting that frame's entries.
+static void donate(WalkWorker *worker) {
+
+    size_t i = 0;
+    while (i < worker->frames_length && worker->frames[i].next == worker->frames[i].end)
+        i++;
+    if (i == worker->frames_length)
+        return;
+    WalkFrame *frame = &worker->frames[i];
+    size_t left = frame->end - frame->next;
+    size_t count = i + 1 < worker->frames_length ? left : left / 2;
+    if (count == 0)
+        return;
+
+    size_t first = frame->end - count, names_length = 0;
+    for (size_t j = first; j < frame->end; ++j)
+        names_length += worker->entries[j].length;
+    WalkTask *task = malloc(sizeof(WalkTask) + count * sizeof(WalkEntry) +
+                            frame->path_length + names_length);
+    if (task == NULL) fatal("malloc failed");
+    task->path_length = frame->path_length;
+    task->count = count;
+    task->names_length = names_length;
+    char *text = (char *) (task->entries + count);
+    memcpy(text, worker->path, frame->path_length);
+    char *names = text + frame->path_length;
+    size_t offset = 0;
+    for (size_t j = 0; j < count; ++j) {
+        const WalkEntry *entry = &worker->entries[first + j];
+        task->entries[j] = (WalkEntry) {entry->node, offset, entry->length};
+        memcpy(names + offset, worker->names + entry->name, entry->length);
+        offset += entry->length;
+    }
+    frame->end = first;
+
+    atomic_fetch_add(&worker->walk->pending, 1);
+    add_task(worker, task);
+    walk_signal(worker->walk, false);
+
+}
+
+// Visits the entries of the frames of the worker, depth first.
+static void walk_frames(WalkWorker *worker) {
+
+    Walk *walk = worker->walk;
+    while (worker->frames_length > 0) {
+        WalkFrame *frame = &worker->frames[worker->frames_length - 1];
+        if (frame->next == frame->end ||
+            atomic_load_explicit(&walk->stopped, memory_order_relaxed)) {
+            worker->entries_length = frame->first;
+            worker->names_length = frame->names_length;
+            worker->frames_length--;
+            continue;
+        }
+
+        WalkEntry entry = worker->entries[frame->next++];
+        size_t path_length = frame->path_length + entry.length + 1;
+        reserve(&worker->path, &worker->path_capacity, path_length + 1, sizeof(char));
+        memcpy(worker->path + frame->path_length, worker->names + entry.name, entry.length);
+        worker->path[path_length - 1] = '/';
+        worker->path[path_length] = '\0';
+        if (walk->callback(worker->path, walk->context) != 0) {
+            atomic_store(&walk->stopped, true);
+            walk_signal(walk, true);
+            continue;
+        }
+
+        expand(worker, entry.node, path_length);
+        if (atomic_load_explicit(&walk->hungry, memory_order_relaxed) > 0)
+            donate(worker);
+    }
+
+}
+
+static void run_task(WalkWorker *worker, WalkTask *task) {
+
+    const char *text = (const char *) (task->entries + task->count);
+    reserve(&worker->path, &worker->path_capacity, task->path_length + 1, sizeof(char));
+    memcpy(worker->path, text, task->path_length);
+    for (size_t i = 0; i < task->count; ++i) {
+        const WalkEntry *entry = &task->entries[i];
+        add_entry(worker, entry->node, text + task->path_length + entry->name,
+                  entry->length);
+    }
+    push_frame(worker, 0, task->path_length, 0);
+    free(task);
+    walk_frames(worker);
+
+}
+
+// Takes a task, preferably of the worker itself, waiting until there is one.
+// Returns NULL once the walk is over.
+static WalkTask *find_task(WalkWorker *worker) {
+
+    Walk *walk = worker->walk;
+    int self = worker - walk->workers;
+    bool hungry = false;
+    WalkTask *task = NULL;
+    while (true) {
+        // Read before looking, so that a task added or the walk ending after
+        // that changes them and keeps the worker from waiting.
+        if (pthread_mutex_lock(&walk->idle_lock) != 0) syserr("lock failed");
+        unsigned seen = walk->events;
+        if (pthread_mutex_unlock(&walk->idle_lock) != 0) syserr("unlock failed");
+        if (atomic_load(&walk->pending) == 0 || atomic_load(&walk->stopped))
+            break;
+        for (int i = 0; i < walk->n_workers && task == NULL; ++i)
+            task = take_task(&walk->workers[(self + i) % walk->n_workers]);
+        if (task)
+            break;
+        if (!hungry) {
+            // Look once more after asking the others to donate.
+            atomic_fetch_add(&walk->hungry, 1);
+            hungry = true;
+            continue;
+        }
+        if (pthread_mutex_lock(&walk->idle_lock) != 0) syserr("lock failed");
+        while (walk->events == seen) {
+            if (pthread_cond_wait(&walk->idle, &walk->idle_lock) != 0)
+                syserr("cond wait failed");
+        }
+        if (pthread_mutex_unlock(&walk->idle_lock) != 0) syserr("unlock failed");
+    }
+    if (hungry)
+        atomic_fetch_sub(&walk->hungry, 1);
+    return task;
+
+}
+
+static void work(WalkWorker *worker) {
+
+    for (WalkTask *task; (task = find_task(worker)) != NULL;) {
+        run_task(worker, task);
+        finish_task(worker->walk);
+    }
+
+}
+
+static void *walk_worker(void *arg) {
+
+    WalkWorker *worker = arg;
+    START_OPERATION(worker->walk->tree, TREE_LIST, NULL, NULL);
+    work(worker);
+    return NULL;
+
+}
+
+int tree_walk(Tree *tree, const char *path, TreeWalkCallback callback, void *context,
+              int threads) {
+
+    PARSED_PATH(parsed);
+    if (threads < 1 || !parse_path(path, &parsed)) return EINVAL;
+    START_OPERATION(tree, TREE_LIST, path, NULL);
+
+    Tree *folder = tree;
+    int code = lock_folder_optimistic(tree, &parsed, parsed.depth, false, &folder, NULL);
+    if (code == EAGAIN)
+        code = iterate_to_folder(&parsed, parsed.depth, &folder);
+    if (code == ENOENT) return ENOENT;
+    // Folders are unlocked once their subfolders are read, and ones removed
+    // meanwhile are kept, like for a snapshot, until the walk is over.
+    // Subfolders are only read under locks, so nothing else of the walk has
+    // to wait for epoch sections.
+    TreeSnapshot hold = {.tree = tree, .folder = folder, .walk = true};
+    add_snapshot(&hold);
+    exit_protocole_reader(folder);
+
+    if (callback(path, context) != 0) {
+        remove_snapshot(&hold);
+        return ECANCELED;
+    }
+
+    Walk *walk = malloc(sizeof(Walk) + threads * sizeof(WalkWorker));
+    if (walk == NULL) fatal("malloc failed");
+    walk->tree = tree;
+    walk->callback = callback;
+    walk->context = context;
+    atomic_init(&walk->stopped, false);
+    atomic_init(&walk->pending, 1);
+    atomic_init(&walk->hungry, 0);
+    if (pthread_mutex_init(&walk->idle_lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&walk->idle, 0) != 0)
+        syserr("cond init failed");
+    walk->events = 0;
+    walk->n_workers = threads;
+    for (int i = 0; i < threads; ++i) {
+        WalkWorker *worker = &walk->workers[i];
+        memset(worker, 0, sizeof(WalkWorker));
+        worker->walk = walk;
+        if (pthread_mutex_init(&worker->lock, 0) != 0)
+            syserr("mutex init failed");
+    }
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_create(&walk->workers[i].thread, NULL, walk_worker,
+                           &walk->workers[i]) != 0)
+            syserr("pthread_create failed");
+    }
+
+    // The calling thread starts the walk as the first worker.
+    WalkWorker *first = &walk->workers[0];
+    size_t path_length = strlen(path);
+    reserve(&first->path, &first->path_capacity, path_length + 1, sizeof(char));
+    memcpy(first->path, path, path_length);
+    expand(first, folder, path_length);
+    walk_frames(first);
+    finish_task(walk);
+    work(first);
+
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_join(walk->workers[i].thread, NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    remove_snapshot(&hold);
+
+    code = atomic_load(&walk->stopped) ? ECANCELED : 0;
+    for (int i = 0; i < threads; ++i) {
+        WalkWorker *worker = &walk->workers[i];
+        for (WalkTask *task; (task = take_task(worker)) != NULL;)
+            free(task); // Left when the walk was stopped.
+        if (pthread_mutex_destroy(&worker->lock) != 0)
+            syserr("mutex destroy failed");
+        free(worker->path);
+        free(worker->names);
+        free(worker->entries);
+        free(worker->frames);
+    }
+    if (pthread_cond_destroy(&walk->idle) != 0)
+        syserr("cond destroy failed");
+    if (pthread_mutex_destroy(&walk->idle_lock) != 0)
+        syserr("mutex destroy failed");
+    free(walk);
+    return code;
 
-#include "Tree.h"
+}
 
-struct Tree {
-    HashMap *subfolders;
-    
-    pthread_mutex_t lock;
-    pthread_cond_t readers;
-    pthread_cond_t writers;
-    // Condtion on which a node is going to wait until all operations working
-    // or waiting in node are executed.
-    pthread_cond_t wait_for_node;
-    int rcount, wcount, rwait, wwait;
-    // Helps with recognising if a reader/writer should go to critical section,
-    // especially after being awaken.
-    int change;
-};
+// Inserts `child` into folder under name i of path.
+static void insert_child(Tree *tree, Tree *folder, const ParsedPath *path, size_t i,
+                         Tree *child) {
 
-static void entry_protocole_reader(Tree *tree) {
+    children_insert(&folder->subfolders, arena_of(tree), path_name(path, i),
+                    path_name_length(path, i), path->hashes[i], child);
+    allow_bias(child, i);
 
-    if (pthread_mutex_lock(&tree->lock) != 0)
-        syserr("lock failed");
+}
 
-    while (tree->change <= 0 && (tree->wcount > 0 || tree->wwait > 0)) {
-        tree->rwait++;
-        if (pthread_cond_wait(&tree->readers, &tree->lock) != 0)
-            syserr("cond wait failed");
-        tree->rwait--;
-    }
+int tree_create(Tree *tree, const char* path) {
 
-    tree->rcount++;
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return EINVAL;
+    if (parsed.depth == 0) return EEXIST;
+    START_OPERATION(tree, TREE_CREATE, path, NULL);
+    JOURNAL_OPERATION(tree);
 
-    if (tree->change > 0)
-        tree->change--;
+    // The new folder has the last name of the path.
+    size_t new_subfolder = parsed.depth - 1;
 
-    if (tree->change > 0) {
-        if (pthread_cond_signal(&tree->readers) != 0)
-            syserr("cond signal failed");
+    Tree *parent;
+    while (true) {
+        int code = lock_parent_writer(tree, &parsed, new_subfolder, &parent);
+        if (code == ENOENT) return ENOENT;
+        if (!moved_meanwhile(&journal_operation))
+            break;
+        exit_protocole_writer(parent);
     }
 
-    if (pthread_mutex_unlock(&tree->lock) != 0)
-        syserr("unlock failed");
+    if (get_child(parent, &parsed, new_subfolder) != NULL) {
+        exit_protocole_writer(parent);
+        return EEXIST;
+    }
 
-}
+    Tree *child = new_node(tree);
+    begin_modification(parent);
+    preserve_subfolders(tree, parent, change_time(tree));
+    insert_child(tree, parent, &parsed, new_subfolder, child);
+    drop_listing(tree, parent);
+    log_change(&journal_operation, JOURNAL_CREATE, path, NULL);
+    end_modification(parent);
 
-static void exit_protocole_reader(Tree *tree) {
+    exit_protocole_writer(parent);
 
-    if (pthread_mutex_lock(&tree->lock) != 0)
-        syserr("lock failed");
+    return commit_journaled(&journal_operation);
 
-    tree->rcount--;
+}
 
-    if (tree->rcount == 0 && tree->wwait > 0) {
-        tree->change = -1;
-        if (pthread_cond_signal(&tree->writers) != 0)
-            syserr("cond signal failed");
-    } else if (tree->rcount == 0) {
-        if (pthread_cond_signal(&tree->wait_for_node) != 0)
-            syserr("cond signal failed");
-    }
+static void exit_protocole(Tree *tree, bool writer) {
 
-    if (pthread_mutex_unlock(&tree->lock) != 0)
-        syserr("unlock failed");
+    if (writer)
+        exit_protocole_writer(tree);
+    else
+        exit_protocole_reader(tree);
 
 }
 
-static void entry_protocole_writer(Tree *tree) {
+// Locks as a writer the deepest folder on path that exists, and sets *reached
+// like lock_folder_optimistic. The folders above it are locked as readers,
+// hand over hand like in lock_parent_writer, and each one is unlocked only
+// once the next one is locked, so that a folder relocked as a writer cannot be
+// removed meanwhile. If the missing subfolder was created by then, the walk
+// goes on below it.
+static void lock_deepest_writer(Tree *tree, const ParsedPath *path, Tree **folder,
+                                size_t *reached) {
+
+    Tree *parent = NULL;
+    bool parent_writer = false;
+    Tree *node = tree;
+    bool node_writer = path->depth == 0;
+    if (node_writer)
+        entry_protocole_writer(node);
+    else
+        entry_protocole_reader(node);
+    size_t depth = 0;
+    while (depth < path->depth) {
+        Tree *child = get_child(node, path, depth);
+        if (child == NULL) {
+            if (node_writer)
+                break;
+            // The parent, still locked, keeps the folder where it is. The
+            // root has none, but it cannot be removed or moved.
+            exit_protocole_reader(node);
+            entry_protocole_writer(node);
+            node_writer = true;
+            continue;
+        }
+        bool last = depth + 1 == path->depth;
+        if (last)
+            entry_protocole_writer(child);
+        else
+            entry_protocole_reader(child);
+        if (parent)
+            exit_protocole(parent, parent_writer);
+        parent = node;
+        parent_writer = node_writer;
+        node = child;
+        node_writer = last;
+        ++depth;
+    }
+    if (parent)
+        exit_protocole(parent, parent_writer);
+    *folder = node;
+    *reached = depth;
 
-    if (pthread_mutex_lock(&tree->lock) != 0)
-        syserr("lock failed");
+}
 
-    while (tree->change != -1 && (tree->wcount > 0 || tree->rcount > 0)) {
-        tree->wwait++;
-        if (pthread_cond_wait(&tree->writers, &tree->lock) != 0)
-            syserr("cond wait failed");
-        tree->wwait--;
+int tree_create_recursive(Tree *tree, const char *path, size_t *created) {
+
+    *created = 0;
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return EINVAL;
+    START_OPERATION(tree, TREE_CREATE, path, NULL);
+    JOURNAL_OPERATION(tree);
+
+    // Only the deepest existing folder is locked as a writer.
+    Tree *parent;
+    size_t reached;
+    while (true) {
+        if (lock_folder_optimistic(tree, &parsed, parsed.depth, true, &parent,
+                                   &reached) == EAGAIN)
+            lock_deepest_writer(tree, &parsed, &parent, &reached);
+        if (!moved_meanwhile(&journal_operation))
+            break;
+        exit_protocole_writer(parent);
     }
 
-    tree->wcount++;
-    tree->change = 0;
+    if (reached == parsed.depth) {
+        // The whole path exists.
+        exit_protocole_writer(parent);
+        return 0;
+    }
 
-    if (pthread_mutex_unlock(&tree->lock) != 0)
-        syserr("unlock failed");
+    // The missing folders are linked together before the first one is
+    // inserted, so the whole suffix appears at once.
+    Tree *top = new_node(tree);
+    Tree *bottom = top;
+    for (size_t i = reached + 1; i < parsed.depth; ++i) {
+        Tree *child = new_node(tree);
+        insert_child(tree, bottom, &parsed, i, child);
+        bottom = child;
+    }
 
-}
+    begin_modification(parent);
+    preserve_subfolders(tree, parent, change_time(tree));
+    insert_child(tree, parent, &parsed, reached, top);
+    drop_listing(tree, parent);
+    log_change(&journal_operation, JOURNAL_CREATE_RECURSIVE, path, NULL);
+    end_modification(parent);
 
-static void exit_protocole_writer(Tree *tree) {
+    exit_protocole_writer(parent);
 
-    if (pthread_mutex_lock(&tree->lock) != 0)
-        syserr("lock failed");
+    *created = parsed.depth - reached;
+    return commit_journaled(&journal_operation);
 
-    tree->wcount--;
+}
 
-    if (tree->rwait > 0) {
-        tree->change = tree->rwait;
-        if (pthread_cond_signal(&tree->readers) != 0)
-            syserr("cond signal failed");
-    } else if (tree->wwait > 0) {
-        tree->change = -1;
-        if (pthread_cond_signal(&tree->writers) != 0)
-            syserr("cond signal failed");
-    } else if (pthread_cond_signal(&tree->wait_for_node) != 0) {
-            syserr("cond signal failed");
+// Removes node, which has no subfolders, at time `now` and frees it unless a
+// snapshot may reach it. The memory is reused only once optimistic walks
+// cannot be looking at it.
+static void remove_node(Tree *tree, Tree *node, Tree *next_component,
+                        const ParsedPath *path, size_t folder, uint64_t now) {
+
+    children_remove(&next_component->subfolders, path_name(path, folder),
+                    path_name_length(path, folder), path->hashes[folder]);
+    if (!bury(tree, node, now)) {
+        children_retire(&node->subfolders);
+        arena_retire(arena_of(tree), node, sizeof(Tree));
     }
 
-    if (pthread_mutex_unlock(&tree->lock) != 0)
-        syserr("unlock failed");
-
 }
 
-// Waits until all operations in node are done.
-static void wait_for_operations_in_node(Tree *tree) {
+int tree_remove(Tree *tree, const char *path) {
+
+    if (strcmp(path, "/") == 0) return EBUSY;
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return EINVAL;
+    START_OPERATION(tree, TREE_REMOVE, path, NULL);
+    JOURNAL_OPERATION(tree);
 
-    if (pthread_mutex_lock(&tree->lock) != 0)
-        syserr ("lock failed");
+    size_t folder_to_remove = parsed.depth - 1;
 
-    while (tree->rcount > 0 || tree->rwait > 0 || tree->wcount > 0 ||
-           tree->wwait > 0) {
-        if (pthread_cond_wait(&tree->wait_for_node, &tree->lock) != 0)
-            syserr ("cond wait failed");
+    Tree *parent;
+    while (true) {
+        int code = lock_parent_writer(tree, &parsed, folder_to_remove, &parent);
+        if (code == ENOENT) return ENOENT;
+        if (!moved_meanwhile(&journal_operation))
+            break;
+        exit_protocole_writer(parent);
     }
 
-    if (pthread_mutex_unlock(&tree->lock) != 0)
-        syserr ("unlock failed");
+    Tree *node_to_remove = get_child(parent, &parsed, folder_to_remove);
 
-}
+    if (node_to_remove == NULL) {
+        exit_protocole_writer(parent);
+        return ENOENT;
+    }
 
-static void init(Tree *tree) {
+    begin_modification(parent);
+    if (atomic_load_explicit(&node_to_remove->cached, memory_order_relaxed))
+        invalidate_paths(tree);
+    wait_for_operations_in_node(node_to_remove);
 
-    if (pthread_mutex_init(&tree->lock, 0) != 0)
-        syserr("mutex init failed");
-    if (pthread_cond_init(&tree->readers, 0) != 0)
-        syserr("cond init 1 failed");
-    if (pthread_cond_init(&tree->writers, 0) != 0)
-        syserr("cond init 2 failed");
-    if (pthread_cond_init(&tree->wait_for_node, 0) != 0)
-        syserr("cond init 3 failed");
+    if (children_size(&node_to_remove->subfolders) != 0) {
+        end_modification(parent);
+        exit_protocole_writer(parent);
+        return ENOTEMPTY;
+    }
 
-    tree->rcount = 0;
-    tree->wcount = 0;
-    tree->rwait = 0;
-    tree->wwait = 0;
-    tree->change = 0;
+    uint64_t now = change_time(tree);
+    preserve_subfolders(tree, parent, now);
+    drop_listing(tree, node_to_remove);
+    remove_node(tree, node_to_remove, parent, &parsed, folder_to_remove, now);
+    drop_listing(tree, parent);
+    log_change(&journal_operation, JOURNAL_REMOVE, path, NULL);
+    end_modification(parent);
 
-}
+    exit_protocole_writer(parent);
 
-Tree* tree_new() {
+    return commit_journaled(&journal_operation);
 
-    Tree *new_tree = malloc(sizeof(Tree));
-    if (new_tree == NULL) fatal("malloc failed");
+}
 
-    new_tree->subfolders = hmap_new();
-    init(new_tree);
+typedef struct Teardown {
+    Tree *tree;
+    Tree *node;
+} Teardown;
+
+// Frees node and all folders below it, which are no longer reachable from the
+// root. Threads that got into the subtree before it was detached may still be
+// working there, so each folder is freed only once nobody is using it; it is
+// then impossible to get into its subfolders other than through optimistic
+// walks, which fail to validate and never touch reused memory.
+static void tear_down(void *arg) {
+
+    Teardown *teardown = arg;
+    Tree *tree = teardown->tree;
+    START_OPERATION(tree, TREE_REMOVE, NULL, NULL);
+    size_t size = 1, capacity = 16;
+    Tree **stack = malloc(capacity * sizeof(Tree *));
+    if (stack == NULL) fatal("malloc failed");
+    stack[0] = teardown->node;
+    free(teardown);
+
+    while (size > 0) {
+        Tree *node = stack[--size];
+        wait_for_operations_in_node(node);
+
+        const char *name;
+        size_t length;
+        void *child;
+        ChildrenIterator it = children_iterator(&node->subfolders);
+        while (children_next(&node->subfolders, &it, &name, &length, &child)) {
+            // Wide subtrees are shared with the other threads of the pool.
+            if (size >= TEARDOWN_SPLIT) {
+                submit_teardown(tree, child);
+                continue;
+            }
+            if (size == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(Tree *));
+                if (stack == NULL) fatal("realloc failed");
+            }
+            stack[size++] = child;
+        }
 
-    return new_tree;
+        drop_listing(tree, node);
+        children_retire(&node->subfolders);
+        arena_retire(arena_of(tree), node, sizeof(Tree));
+    }
+    free(stack);
 
 }
 
-static void destroy(Tree *tree) {
+static Pool *teardown_pool(Tree *tree) {
 
-    if (pthread_cond_destroy(&tree->readers) != 0)
-        syserr("cond destroy 1 failed");
-    if (pthread_cond_destroy(&tree->writers) != 0)
-        syserr("cond destroy 2 failed");
-    if (pthread_cond_destroy(&tree->wait_for_node) != 0)
-        syserr("cond destroy 3 failed");
-    if (pthread_mutex_destroy(&tree->lock) != 0)
-        syserr("mutex destroy failed");
+    Root *root = (Root *) tree;
+    Pool *pool = atomic_load(&root->teardown);
+    if (pool == NULL) {
+        Pool *started = pool_new(TEARDOWN_THREADS);
+        if (atomic_compare_exchange_strong(&root->teardown, &pool, started))
+            pool = started;
+        else
+            pool_free(started);
+    }
+    return pool;
 
 }
 
-void tree_free(Tree *tree) {
-
-    const char* key;
-    void* value;
-    HashMapIterator it = hmap_iterator(tree->subfolders);
-    while (hmap_next(tree->subfolders, &it, &key, &value))
-        tree_free(value);
+static void submit_teardown(Tree *tree, Tree *node) {
 
-    hmap_free(tree->subfolders);
-    destroy(tree);
-    free(tree);
+    Teardown *teardown = malloc(sizeof(Teardown));
+    if (teardown == NULL) fatal("malloc failed");
+    teardown->tree = tree;
+    teardown->node = node;
+    pool_submit(teardown_pool(tree), tear_down, teardown);
 
 }
 
-// Iterates to a folder having the same directory as subpath; in the end
-// *next_component points to a tree representing this folder. In each node
-// we are considered as a reader. In the end, the last node is still a reader.
-// Returns ENOENT if no such subpath exists and 0 if it does.
-static int iterate_to_folder(const char *path_to_parent, Tree **next_component) {
+int tree_remove_recursive(Tree *tree, const char *path) {
 
-    Tree *wait_next_component;
-    char component[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    const char *subpath = path_to_parent;
-    entry_protocole_reader(*next_component);
-    while ((subpath = split_path(subpath, component))) {
-        wait_next_component = hmap_get((*next_component)->subfolders, component);
-        if (wait_next_component == NULL) {
-            exit_protocole_reader(*next_component);
-            return ENOENT;
-        }
-        entry_protocole_reader(wait_next_component);
-        exit_protocole_reader(*next_component);
-        *next_component = wait_next_component;
+    if (strcmp(path, "/") == 0) return EBUSY;
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return EINVAL;
+    START_OPERATION(tree, TREE_REMOVE, path, NULL);
+    JOURNAL_OPERATION(tree);
+
+    size_t folder_to_remove = parsed.depth - 1;
+
+    Tree *parent;
+    while (true) {
+        int code = lock_parent_writer(tree, &parsed, folder_to_remove, &parent);
+        if (code == ENOENT) return ENOENT;
+        if (!moved_meanwhile(&journal_operation))
+            break;
+        exit_protocole_writer(parent);
     }
-    return 0;
+
+    Tree *node_to_remove = get_child(parent, &parsed, folder_to_remove);
+    if (node_to_remove == NULL) {
+        exit_protocole_writer(parent);
+        return ENOENT;
+    }
+
+    // Unlike tree_remove, this does not wait for operations in the subtree;
+    // they are waited for folder by folder in the background.
+    begin_modification(parent);
+    invalidate_paths(tree);
+    uint64_t now = change_time(tree);
+    preserve_subfolders(tree, parent, now);
+    children_remove(&parent->subfolders, path_name(&parsed, folder_to_remove),
+                    path_name_length(&parsed, folder_to_remove),
+                    parsed.hashes[folder_to_remove]);
+    drop_listing(tree, parent);
+    log_change(&journal_operation, JOURNAL_REMOVE_RECURSIVE, path, NULL);
+    end_modification(parent);
+
+    exit_protocole_writer(parent);
+
+    if (!bury(tree, node_to_remove, now))
+        submit_teardown(tree, node_to_remove);
+    return commit_journaled(&journal_operation);
 
 }
 
-char* tree_list(Tree *tree, const char* path) {
+TreeSnapshot *tree_snapshot(Tree *tree, const char *path) {
 
-    if (!is_path_valid(path)) return NULL;
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return NULL;
 
-    Tree *next_component = tree;
-    if (iterate_to_folder(path, &next_component) == ENOENT) return NULL;
+    Tree *folder = tree;
+    int code = lock_folder_optimistic(tree, &parsed, parsed.depth, false, &folder, NULL);
+    if (code == EAGAIN)
+        code = iterate_to_folder(&parsed, parsed.depth, &folder);
+    if (code == ENOENT) return NULL;
 
-    char *result = make_map_contents_string(next_component->subfolders);
-    exit_protocole_reader(next_component);
-    return result;
+    TreeSnapshot *snapshot = malloc(sizeof(TreeSnapshot));
+    if (snapshot == NULL) fatal("malloc failed");
+    snapshot->tree = tree;
+    snapshot->folder = folder;
+    snapshot->walk = false;
+    add_snapshot(snapshot);
+    exit_protocole_reader(folder);
+    return snapshot;
 
 }
 
-int tree_create(Tree *tree, const char* path) {
-
-    if (!is_path_valid(path)) return EINVAL;
-    if (strcmp(path, "/") == 0) return EEXIST;
+// Returns the subfolder with name i of path that folder had when the snapshot
+// was taken, or NULL. The folder must be locked.
+static Tree *snapshot_child(TreeSnapshot *snapshot, Tree *folder, const ParsedPath *path,
+                            size_t i) {
 
-    char new_subfolder[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char new_subfolder_parent[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char *path_to_parent = make_path_to_parent(path, new_subfolder);
-    char *path_to_grandparent =
-            make_path_to_parent(path_to_parent, new_subfolder_parent);
-    free(path_to_parent);
+    History *history = history_at(folder, snapshot->time);
+    if (history == NULL)
+        return get_child(folder, path, i);
+    size_t index = listing_find(history->listing, path_name(path, i),
+                                path_name_length(path, i));
+    return index < history->listing->count ? history->folders[index] : NULL;
 
-    Tree *parent = tree;
-    // If path_to_granparent is NULL then path_to_parent is "/".
-    if (path_to_grandparent == NULL) {
-        entry_protocole_writer(parent);
-    } else {
-        // We iterate to grandparent of a node to create because as we enter
-        // a parent node we are considered a writer.
-        Tree *next_component = tree;
-        int code = iterate_to_folder(path_to_grandparent, &next_component);
-        free(path_to_grandparent);
-        if (code == ENOENT) return ENOENT;
+}
 
-        parent = hmap_get(next_component->subfolders, new_subfolder_parent);
-        if (parent == NULL) {
-            exit_protocole_reader(next_component);
-            return ENOENT;
-        }
-        entry_protocole_writer(parent);
-        exit_protocole_reader(next_component);
+char *tree_snapshot_list(TreeSnapshot *snapshot, const char *path) {
+
+    PARSED_PATH(parsed);
+    if (!parse_path(path, &parsed)) return NULL;
+
+    // Folders the snapshot reaches are not freed while it exists, so they
+    // are locked one at a time, only to read their subfolders.
+    Tree *tree = snapshot->tree;
+    Tree *folder = snapshot->folder;
+    for (size_t i = 0; i < parsed.depth; ++i) {
+        entry_protocole_reader(folder);
+        Tree *child = snapshot_child(snapshot, folder, &parsed, i);
+        exit_protocole_reader(folder);
+        if (child == NULL) return NULL;
+        folder = child;
     }
 
-    if (hmap_get(parent->subfolders, new_subfolder) != NULL) {
-        exit_protocole_writer(parent);
-        return EEXIST;
+    entry_protocole_reader(folder);
+    History *history = history_at(folder, snapshot->time);
+    Listing *listing;
+    if (history) {
+        listing = history->listing;
+        listing_acquire(listing);
+    } else {
+        listing = acquire_listing(tree, folder);
     }
+    exit_protocole_reader(folder);
 
-    Tree *new_node = malloc(sizeof(Tree));
-    if (new_node == NULL) {
-        exit_protocole_writer(parent);
-        fatal("malloc failed");
-    }
+    char *result = listing_to_string(listing);
+    listing_release(arena_of(tree), listing);
+    return result;
 
-    new_node->subfolders = hmap_new();
-    init(new_node);
-    hmap_insert(parent->subfolders, new_subfolder, new_node);
+}
 
-    exit_protocole_writer(parent);
+void tree_snapshot_release(TreeSnapshot *snapshot) {
 
-    return 0;
+    remove_snapshot(snapshot);
+    free(snapshot);
 
 }
 
-// Removes and frees node without freeing its subfolders.
-static void remove_node(Tree *node, Tree *next_component, char folder[]) {
+void tree_snapshot_stats(Tree *tree, size_t *histories, size_t *graves) {
 
-    destroy(node);
-    free(node);
-    hmap_remove(next_component->subfolders, folder);
+    Root *root = (Root *) tree;
+    *histories = *graves = 0;
+    lock_snapshots(root);
+    for (History *history = root->histories; history; history = history->next)
+        ++*histories;
+    for (Grave *grave = root->graves; grave; grave = grave->next)
+        ++*graves;
+    unlock_snapshots(root);
 
 }
 
-int tree_remove(Tree *tree, const char *path) {
-
-    if (strcmp(path, "/") == 0) return EBUSY;
-    if (!is_path_valid(path)) return EINVAL;
+// Files of tree_save are a SaveHeader, then a SavedFolder for every folder in
+// preorder, the root first, and then the names of all folders one after
+// another, without separators, all in native byte order.
+#define SAVE_MAGIC "TREEDMP1"
+
+typedef struct SaveHeader {
+    char magic[8];
+    uint32_t folder_size; // sizeof(SavedFolder).
+    uint32_t reserved;
+    uint64_t folders;
+    uint64_t names_length;
+} SaveHeader;
+
+typedef struct SavedFolder {
+    uint64_t name; // Offset of the name among the names; the root has none.
+    uint32_t length;
+    uint32_t children; // Their records follow, each after the subtree of the one before.
+    uint64_t end; // Index of the first record after the subtree of the folder.
+} SavedFolder;
+
+// A subfolder still to be saved.
+typedef struct SaveEntry {
+    Tree *folder;
+    uint64_t name; // Offset among the names.
+    uint32_t length;
+} SaveEntry;
+
+typedef struct SaveState {
+    SavedFolder *records;
+    size_t count, records_capacity;
+    char *names;
+    size_t names_length, names_capacity;
+    SaveEntry *entries;
+    size_t entries_length, entries_capacity;
+} SaveState;
+
+static void add_save_entry(SaveState *state, Tree *folder, const char *name, size_t length) {
+
+    reserve(&state->entries, &state->entries_capacity, state->entries_length + 1,
+            sizeof(SaveEntry));
+    reserve(&state->names, &state->names_capacity, state->names_length + length,
+            sizeof(char));
+    state->entries[state->entries_length++] =
+            (SaveEntry) {folder, state->names_length, length};
+    memcpy(state->names + state->names_length, name, length);
+    state->names_length += length;
 
-    char folder_to_remove[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char folder_to_remove_parent[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char *path_to_parent = make_path_to_parent(path, folder_to_remove);
-    char *path_to_grandparent =
-            make_path_to_parent(path_to_parent, folder_to_remove_parent);
-    free(path_to_parent);
+}
 
-    Tree *parent = tree;
+// Appends the subfolders folder has in the snapshot to the entries.
+static void read_saved_folder(TreeSnapshot *snapshot, Tree *folder, SaveState *state) {
 
-    // If path_to_granparent is NULL then path_to_parent is "/".
-    if (path_to_grandparent == NULL) {
-        entry_protocole_writer(parent);
+    entry_protocole_reader(folder);
+    History *history = history_at(folder, snapshot->time);
+    if (history) {
+        const Listing *listing = history->listing;
+        for (size_t i = 0; i < listing->count; ++i)
+            add_save_entry(state, history->folders[i], listing->text + listing->starts[i],
+                           listing_name_length(listing, i));
     } else {
-        // We iterate to grandparent of a node to create because as we enter
-        // a parent node we are considered a writer.
-        Tree *next_component = tree;
-        int code = iterate_to_folder(path_to_grandparent, &next_component);
-        free(path_to_grandparent);
-        if (code == ENOENT) return ENOENT;
+        const char *name;
+        size_t length;
+        void *child;
+        ChildrenIterator it = children_iterator(&folder->subfolders);
+        while (children_next(&folder->subfolders, &it, &name, &length, &child))
+            add_save_entry(state, child, name, length);
+    }
+    exit_protocole_reader(folder);
 
-        parent = hmap_get(next_component->subfolders, folder_to_remove_parent);
-        if (parent == NULL) {
-            exit_protocole_reader(next_component);
-            return ENOENT;
+}
+
+// Writes all of buffer to fd. Returns 0 or an errno value.
+static int write_all(int fd, const void *buffer, size_t size) {
+
+    const char *position = buffer;
+    while (size > 0) {
+        ssize_t written = write(fd, position, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
         }
-        entry_protocole_writer(parent);
-        exit_protocole_reader(next_component);
+        position += written;
+        size -= written;
     }
+    return 0;
 
-    Tree *node_to_remove =
-            hmap_get(parent->subfolders, folder_to_remove);
+}
 
-    if (node_to_remove == NULL) {
-        exit_protocole_writer(parent);
-        return ENOENT;
+int tree_save(Tree *tree, int fd) {
+
+    // Writers go on meanwhile; the file holds the tree as of this moment.
+    TreeSnapshot *snapshot = tree_snapshot(tree, "/");
+    SaveState state = {0};
+    // Entries [next, end) of a frame are subfolders of folder `record` whose
+    // subtrees are not saved yet.
+    typedef struct SaveFrame {
+        size_t record;
+        size_t next;
+        size_t end;
+    } SaveFrame;
+    SaveFrame *frames = NULL;
+    size_t depth = 0, frames_capacity = 0;
+
+    reserve(&state.records, &state.records_capacity, 1, sizeof(SavedFolder));
+    state.records[state.count++] = (SavedFolder) {0, 0, 0, 0};
+    read_saved_folder(snapshot, tree, &state);
+    state.records[0].children = state.entries_length;
+    reserve(&frames, &frames_capacity, 1, sizeof(SaveFrame));
+    frames[depth++] = (SaveFrame) {0, 0, state.entries_length};
+    while (depth > 0) {
+        SaveFrame *frame = &frames[depth - 1];
+        if (frame->next == frame->end) {
+            SavedFolder *record = &state.records[frame->record];
+            record->end = state.count;
+            state.entries_length -= record->children;
+            depth--;
+            continue;
+        }
+
+        SaveEntry entry = state.entries[frame->next++];
+        size_t record = state.count++;
+        reserve(&state.records, &state.records_capacity, state.count, sizeof(SavedFolder));
+        size_t first = state.entries_length;
+        read_saved_folder(snapshot, entry.folder, &state);
+        size_t children = state.entries_length - first;
+        state.records[record] = (SavedFolder) {entry.name, entry.length, children, 0};
+        reserve(&frames, &frames_capacity, depth + 1, sizeof(SaveFrame));
+        frames[depth++] = (SaveFrame) {record, first, state.entries_length};
     }
+    tree_snapshot_release(snapshot);
+
+    SaveHeader header = {SAVE_MAGIC, sizeof(SavedFolder), 0, state.count,
+                         state.names_length};
+    int code = write_all(fd, &header, sizeof(header));
+    if (code == 0)
+        code = write_all(fd, state.records, state.count * sizeof(SavedFolder));
+    if (code == 0)
+        code = write_all(fd, state.names, state.names_length);
+    free(state.records);
+    free(state.names);
+    free(state.entries);
+    free(frames);
+    return code;
 
-    wait_for_operations_in_node(node_to_remove);
+}
 
-    if (hmap_size(node_to_remove->subfolders) != 0) {
-        exit_protocole_writer(parent);
-        return ENOTEMPTY;
+// A folder being loaded whose subfolders are not all created yet.
+typedef struct LoadFrame {
+    Tree *folder;
+    uint64_t left; // Subfolders not created yet.
+    uint64_t end;
+    size_t path_length;
+} LoadFrame;
+
+// The subfolders of a folder already created, and everything below them.
+typedef struct LoadJob {
+    Tree *tree;
+    const SavedFolder *records;
+    const char *names;
+    size_t names_length;
+    size_t record; // Of the folder.
+    Tree *folder;
+    size_t path_length;
+    // Subtrees of at most this many folders are handed to the pool, if any.
+    size_t split;
+    Pool *pool;
+    atomic_bool *invalid; // Set if the records are not those of a valid tree.
+} LoadJob;
+
+static bool is_saved_name_valid(const char *name, size_t length) {
+
+    if (length == 0 || length > MAX_FOLDER_NAME_LENGTH_UTILS)
+        return false;
+    for (size_t i = 0; i < length; ++i) {
+        if (name[i] < 'a' || name[i] > 'z')
+            return false;
     }
+    return true;
 
-    hmap_free(node_to_remove->subfolders);
-    remove_node(node_to_remove, parent, folder_to_remove);
+}
 
-    exit_protocole_writer(parent);
+static void load_job(void *arg);
 
-    return 0;
+// Submits a job for the subfolders of folder, which has the given record.
+static void submit_load(const LoadJob *parent, size_t record, Tree *folder,
+                        size_t path_length) {
+
+    LoadJob *job = malloc(sizeof(LoadJob));
+    if (job == NULL) fatal("malloc failed");
+    *job = *parent;
+    job->record = record;
+    job->folder = folder;
+    job->path_length = path_length;
+    pool_submit(job->pool, load_job, job);
 
 }
 
-// Returns a new string with a path to lowest common ancestor in source and target.
-static char *find_lowest_common_ancestor(const char *source, const char *target) {
+// Creates the folders below that of the job. Nothing else can see the tree
+// yet, so no locks are needed. Returns false if the records are not those of
+// a valid tree.
+static bool load_folders(const LoadJob *job) {
+
+    const SavedFolder *records = job->records;
+    // Paths are at most MAX_PATH_LENGTH_UTILS long, so this is enough frames.
+    LoadFrame *frames = malloc((MAX_PATH_DEPTH_UTILS + 1) * sizeof(LoadFrame));
+    if (frames == NULL) fatal("malloc failed");
+    size_t depth = 0;
+    const SavedFolder *top = &records[job->record];
+    frames[depth++] = (LoadFrame) {job->folder, top->children, top->end, job->path_length};
+
+    bool valid = true;
+    for (size_t i = job->record + 1; valid; ++i) {
+        // Folders whose subtrees end here.
+        while (depth > 0 && frames[depth - 1].left == 0 && frames[depth - 1].end == i)
+            depth--;
+        if (depth == 0)
+            break;
+        LoadFrame *parent = &frames[depth - 1];
+        if (parent->left == 0 || i == parent->end) {
+            valid = false;
+            break;
+        }
+        const SavedFolder *record = &records[i];
+        size_t path_length = parent->path_length + record->length + 1;
+        if (record->end <= i || record->end > parent->end ||
+            record->name > job->names_length ||
+            record->length > job->names_length - record->name ||
+            path_length > MAX_PATH_LENGTH_UTILS) {
+            valid = false;
+            break;
+        }
+        const char *name = job->names + record->name;
+        if (!is_saved_name_valid(name, record->length)) {
+            valid = false;
+            break;
+        }
 
-    unsigned long min_len;
-    unsigned long source_len = strlen(source);
-    unsigned long target_len = strlen(target);
-    if (source_len < target_len)
-        min_len = source_len;
-    else
-        min_len = target_len;
+        Tree *folder = new_node(job->tree);
+        if (!children_insert(&parent->folder->subfolders, arena_of(job->tree), name,
+                             record->length, hash_bytes(name, record->length), folder)) {
+            valid = false; // The name is there twice.
+            break;
+        }
+        parent->left--;
+        // Only the job of the root knows how deep its folders are.
+        if (job->folder == job->tree)
+            allow_bias(folder, depth - 1);
+        if (record->children == 0) {
+            valid = record->end == i + 1;
+        } else if (job->pool && record->end - i <= job->split) {
+            submit_load(job, i, folder, path_length);
+            i = record->end - 1;
+        } else {
+            frames[depth++] = (LoadFrame) {folder, record->children, record->end, path_length};
+        }
+    }
+    free(frames);
+    return valid;
 
-    char *common_ancestor_path = malloc(min_len);
+}
 
-    unsigned long i = 0;
-    while (i < min_len && source[i] == target[i]) {
-        common_ancestor_path[i] = source[i];
-        i++;
-    }
+static void load_job(void *arg) {
 
-    while(source[i - 1] != '/')
-        i--;
+    LoadJob *job = arg;
+    if (!load_folders(job))
+        atomic_store(job->invalid, true);
+    free(job);
 
-    common_ancestor_path = realloc(common_ancestor_path, (i + 1));
-    common_ancestor_path[i] = '\0';
+}
+
+Tree *tree_load(int fd) {
 
-    return common_ancestor_path;
+    return tree_load_threads(fd, 1);
 
 }
 
-// Iterates analogically to a function iterate_to_folder additionally
-// changing path_source and path_target as we iterate.
-static int iterate_with_paths(const char *lowest_ancestor, char **path_source,
-                              char **path_target, Tree **next_component) {
+Tree *tree_load_threads(int fd, int threads) {
 
-    Tree *wait_next_component;
-    char component[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    entry_protocole_reader(*next_component);
-    const char *subpath = lowest_ancestor;
-    while ((subpath = split_path(subpath, component))) {
-        *path_source = *path_source + strlen(component) + 1;
-        *path_target = *path_target + strlen(component) + 1;
-        wait_next_component = hmap_get((*next_component)->subfolders, component);
-        if (wait_next_component == NULL) {
-            exit_protocole_reader(*next_component);
-            return ENOENT;
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+        return NULL;
+    size_t size = status.st_size;
+    if (size < sizeof(SaveHeader) || threads < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *mapping = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const SaveHeader *header = mapping;
+    const SavedFolder *records = (const SavedFolder *) (header + 1);
+    size_t space = size - sizeof(SaveHeader);
+    bool valid = memcmp(header->magic, SAVE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->folder_size == sizeof(SavedFolder) && header->folders > 0 &&
+                 header->folders <= space / sizeof(SavedFolder) &&
+                 header->names_length == space - header->folders * sizeof(SavedFolder) &&
+                 records[0].length == 0 && records[0].end == header->folders;
+
+    Tree *tree = NULL;
+    if (valid) {
+        tree = tree_new();
+        atomic_bool invalid;
+        atomic_init(&invalid, false);
+        LoadJob job = {tree, records, (const char *) (records + header->folders),
+                       header->names_length, 0, tree, 1, 0, NULL, &invalid};
+        // The calling thread loads the top of the tree and hands each
+        // subtree small enough to the pool, so that there are a few per
+        // thread.
+        if (threads > 1) {
+            job.pool = pool_new(threads);
+            job.split = header->folders / threads / LOAD_SPLITS_PER_THREAD;
+        }
+        if (!load_folders(&job))
+            atomic_store(&invalid, true);
+        if (job.pool)
+            pool_free(job.pool);
+        valid = !atomic_load(&invalid);
+        if (!valid) {
+            tree_free(tree);
+            tree = NULL;
         }
-        entry_protocole_reader(wait_next_component);
-        exit_protocole_reader(*next_component);
-        *next_component = wait_next_component;
     }
-    return 0;
+    if (munmap(mapping, size) != 0)
+        syserr("munmap failed");
+    if (!valid)
+        errno = EINVAL;
+    return tree;
 
 }
 
-// Waits until all nodes in a tree have no operations done or waiting.
-static void wait_for_all_nodes_in_subtree(Tree *tree) {
-
-    wait_for_operations_in_node(tree);
-    const char *key;
-    void *value;
-    HashMapIterator it = hmap_iterator(tree->subfolders);
-    while (hmap_next(tree->subfolders, &it, &key, &value))
-        wait_for_all_nodes_in_subtree(value);
+// Locks the lowest common ancestor of a move, at the first `depth` names of
+// path: as a writer if it is one of the parents the move changes.
+static int lock_ancestor(Tree *tree, const ParsedPath *path, size_t depth, bool writer,
+                         Tree **ancestor) {
+
+    if (writer)
+        return lock_parent_writer(tree, path, depth, ancestor);
+    *ancestor = tree;
+    int code = lock_folder_optimistic(tree, path, depth, false, ancestor, NULL);
+    if (code == EAGAIN) {
+        *ancestor = tree;
+        code = iterate_to_folder(path, depth, ancestor);
+    }
+    return code;
 
 }
 
-// Iterates analogically to a function iterate_to_folder but all nodes
-// are considered as writers.
-static int iterate_to_folder_writer(const char *path_to_parent, Tree **next_component) {
+// Unlocks the folders lock_branch locked below `folder`, the last one of
+// which, at the first `to` names of path, is a writer if `writer` is set.
+static void unlock_branch(const ParsedPath *path, size_t from, size_t to, Tree *folder,
+                          bool writer) {
+
+    Tree *node = folder;
+    for (size_t i = from; i < to; ++i) {
+        // The node is still locked, so its subfolders cannot change.
+        Tree *child = get_child(node, path, i);
+        if (node != folder)
+            exit_protocole_reader(node);
+        node = child;
+    }
+    if (node != folder) {
+        if (writer)
+            exit_protocole_writer(node);
+        else
+            exit_protocole_reader(node);
+    }
+
+}
 
-    Tree *wait_next_component;
-    char component[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    const char *subpath = path_to_parent;
-    entry_protocole_writer(*next_component);
-    while ((subpath = split_path(subpath, component))) {
-        wait_next_component = hmap_get((*next_component)->subfolders, component);
-        if (wait_next_component == NULL) {
-            exit_protocole_writer(*next_component);
+// Locks the folders at names from..to-1 of path below `folder`, which the
+// caller holds, one after another without unlocking any: as readers, but the
+// last one, which *parent is set to, as a writer. Returns ENOENT, with none
+// of them locked, if one is missing.
+static int lock_branch(const ParsedPath *path, size_t from, size_t to, Tree *folder,
+                       Tree **parent) {
+
+    Tree *node = folder;
+    for (size_t i = from; i < to; ++i) {
+        Tree *child = get_child(node, path, i);
+        if (child == NULL) {
+            unlock_branch(path, from, i, folder, false);
             return ENOENT;
         }
-        entry_protocole_writer(wait_next_component);
-        exit_protocole_writer(*next_component);
-        *next_component = wait_next_component;
+        if (i + 1 == to)
+            entry_protocole_writer(child);
+        else
+            entry_protocole_reader(child);
+        node = child;
     }
+    *parent = node;
     return 0;
 
 }
 
+// Whether name i of a comes before name i of b in strcmp order.
+static bool name_before(const ParsedPath *a, const ParsedPath *b, size_t i) {
+
+    size_t a_length = path_name_length(a, i), b_length = path_name_length(b, i);
+    int result = memcmp(path_name(a, i), path_name(b, i),
+                        a_length < b_length ? a_length : b_length);
+    return result < 0 || (result == 0 && a_length < b_length);
+
+}
+
+// Moves the folder at source to target. The lowest common ancestor of both
+// parents is at the first `lowest_ancestor` names of both paths.
+//
+// Only the two parents are locked as writers. The ancestor and the folders
+// between it and the parents are locked as readers, so that moves and lists
+// of other folders below the ancestor go on meanwhile, and all of them stay
+// locked until the folder is relinked: otherwise a concurrent move could put
+// an ancestor of the target into the moved folder and make a cycle. Folders
+// are locked top down, the branch with the smaller name below the ancestor
+// first, so all operations lock folders in one order (that of a depth-first
+// walk visiting subfolders by name) and two moves cannot deadlock.
+// Returns EAGAIN, having changed nothing, if moved_meanwhile says so.
+static int move_folder(Tree *tree, const ParsedPath *source, const ParsedPath *target,
+                       size_t lowest_ancestor, JournalOperation *journal_operation) {
+
+    size_t folder_to_move = source->depth - 1;
+    size_t folder_to_move_to = target->depth - 1;
+    bool source_below = folder_to_move > lowest_ancestor;
+    bool target_below = folder_to_move_to > lowest_ancestor;
+    bool ancestor_writer = !source_below || !target_below;
+
+    Tree *ancestor;
+    int code = lock_ancestor(tree, source, lowest_ancestor, ancestor_writer, &ancestor);
+    if (code == ENOENT) return ENOENT;
+
+    Tree *parent_source = ancestor, *parent_target = ancestor;
+    int source_code, target_code;
+    if (!target_below || (source_below && name_before(source, target, lowest_ancestor))) {
+        source_code = lock_branch(source, lowest_ancestor, folder_to_move, ancestor,
+                                  &parent_source);
+        target_code = lock_branch(target, lowest_ancestor, folder_to_move_to, ancestor,
+                                  &parent_target);
+    } else {
+        target_code = lock_branch(target, lowest_ancestor, folder_to_move_to, ancestor,
+                                  &parent_target);
+        source_code = lock_branch(source, lowest_ancestor, folder_to_move, ancestor,
+                                  &parent_source);
+    }
+
+    Tree *node_to_move = NULL;
+    if (target_code == 0 && get_child(parent_target, target, folder_to_move_to) != NULL)
+        code = EEXIST;
+    else if (target_code != 0 || source_code != 0 ||
+             (node_to_move = get_child(parent_source, source, folder_to_move)) == NULL)
+        code = ENOENT;
+    else if (moved_meanwhile(journal_operation))
+        code = EAGAIN;
+
+    if (code == 0) {
+        // The folder is relinked as it is, so there is no need to wait for
+        // operations inside it: having locked a folder in the subtree, they
+        // only depend on its contents, which the move does not change, and
+        // took effect before the move. New walks cannot enter the subtree
+        // through parent_source, which is locked, and optimistic walks that
+        // got past it fail to validate its version.
+        begin_modification(parent_source);
+        if (parent_target != parent_source)
+            begin_modification(parent_target);
+        invalidate_paths(tree);
+        uint64_t now = change_time(tree);
+        preserve_subfolders(tree, parent_source, now);
+        preserve_subfolders(tree, parent_target, now);
+        children_remove(&parent_source->subfolders, path_name(source, folder_to_move),
+                        path_name_length(source, folder_to_move),
+                        source->hashes[folder_to_move]);
+        insert_child(tree, parent_target, target, folder_to_move_to, node_to_move);
+        drop_listing(tree, parent_source);
+        drop_listing(tree, parent_target);
+        log_change(journal_operation, JOURNAL_MOVE, source->path, target->path);
+        end_modification(parent_source);
+        if (parent_target != parent_source)
+            end_modification(parent_target);
+    }
+
+    if (source_code == 0)
+        unlock_branch(source, lowest_ancestor, folder_to_move, ancestor, true);
+    if (target_code == 0)
+        unlock_branch(target, lowest_ancestor, folder_to_move_to, ancestor, true);
+    if (ancestor_writer)
+        exit_protocole_writer(ancestor);
+    else
+        exit_protocole_reader(ancestor);
+    return code;
+
+}
+
 int tree_move(Tree *tree, const char *source, const char *target) {
 
     if (strcmp(source, "/") == 0) return EBUSY;
     if (strcmp(target, "/") == 0) return EEXIST;
-    if (!is_path_valid(source) || !is_path_valid(target)) return EINVAL;
+    PARSED_PATH(parsed_source);
+    PARSED_PATH(parsed_target);
+    if (!parse_path(source, &parsed_source) || !parse_path(target, &parsed_target))
+        return EINVAL;
+    START_OPERATION(tree, TREE_MOVE, source, target);
+    JOURNAL_OPERATION(tree);
     // If target is a subfolder of a source, function tree_move returns -1.
     if (strlen(target) > strlen(source) &&
         strncmp(source, target, strlen(source)) == 0) return -1;
@@ -445,134 +2544,277 @@ int tree_move(Tree *tree, const char *source, const char *target) {
     // no move is needed.
     if (strcmp(source, target) == 0) return 0;
 
-    // We will want to block lowest common ancestor first, so we don't
-    // have a deadlock with two tree_move.
-    char *lowest_ancestor = find_lowest_common_ancestor(source, target);
+    // The lowest common ancestor of both parents is locked first, see
+    // move_folder.
+    size_t parent_depth = parsed_source.depth < parsed_target.depth
+                          ? parsed_source.depth - 1 : parsed_target.depth - 1;
+    size_t lowest_ancestor = path_common_depth(&parsed_source, &parsed_target,
+                                               parent_depth);
+    int code;
 
-    Tree *lowest_ancestor_tree = tree;
-    char folder_lowest_ancestor[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char *path_to_parent_lowest_ancestor =
-            make_path_to_parent(lowest_ancestor, folder_lowest_ancestor);
+    do {
+        code = move_folder(tree, &parsed_source, &parsed_target, lowest_ancestor,
+                           &journal_operation);
+    } while (code == EAGAIN);
+    return code == 0 ? commit_journaled(&journal_operation) : code;
 
-    char folder_to_move_to[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char *path_target = make_path_to_parent(target, folder_to_move_to);
-    char folder_to_move[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    char *path_source = make_path_to_parent(source, folder_to_move);
+}
 
-    if (path_to_parent_lowest_ancestor == NULL) {
-        entry_protocole_writer(lowest_ancestor_tree);
-    } else {
-        Tree *next_component = tree;
-        int code = iterate_with_paths(path_to_parent_lowest_ancestor, &path_source,
-                         &path_target, &next_component);
-        free(path_to_parent_lowest_ancestor);
-        if (code == ENOENT) return ENOENT;
-        path_source = path_source + strlen(folder_lowest_ancestor) + 1;
-        path_target = path_target + strlen(folder_lowest_ancestor) + 1;
-        lowest_ancestor_tree = hmap_get(next_component->subfolders,
-                                        folder_lowest_ancestor);
-        if (lowest_ancestor_tree == NULL) {
-            exit_protocole_reader(next_component);
-            return ENOENT;
-        }
+int tree_journal_start(Tree *tree, int fd, TreeJournalSync sync) {
 
-        entry_protocole_writer(lowest_ancestor_tree);
-        exit_protocole_reader(next_component);
+    Root *root = (Root *) tree;
+    if (root->journal)
+        return EBUSY;
+    root->journal = journal_new(fd, sync);
+    return root->journal ? 0 : errno;
+
+}
+
+void tree_journal_stop(Tree *tree) {
+
+    Root *root = (Root *) tree;
+    if (root->journal) {
+        journal_free(root->journal);
+        root->journal = NULL;
     }
 
-    free(lowest_ancestor);
+}
 
-    bool target_parent_as_lowest_ancestor = false;
-    bool source_parent_as_lowest_ancestor = false;
+// Returns the folder at the first `depth` names of path, or NULL.
+static Tree *replay_folder(Tree *tree, const ParsedPath *path, size_t depth) {
 
-    Tree *parent_target = lowest_ancestor_tree;
-    char component_target[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    const char *subpath_target = split_path(path_target, component_target);
+    Tree *folder = tree;
+    for (size_t i = 0; folder && i < depth; ++i)
+        folder = get_child(folder, path, i);
+    return folder;
 
-    if (subpath_target == NULL) {
-        target_parent_as_lowest_ancestor = true;
-    } else {
-        parent_target =
-                hmap_get(lowest_ancestor_tree->subfolders, component_target);
-        if (parent_target == NULL) {
-            exit_protocole_writer(lowest_ancestor_tree);
-            return ENOENT;
-        }
+}
 
-        int code = iterate_to_folder_writer(subpath_target, &parent_target);
-        if (code == ENOENT) {
-            exit_protocole_writer(lowest_ancestor_tree);
-            return code;
+// Applies a journal record to the tree, as in the function that logged it,
+// but without locks, history or path cache, which tree_replay deals with.
+static bool replay_entry(const JournalEntry *entry, void *context) {
+
+    Tree *tree = context;
+    PARSED_PATH(path);
+    if (!parse_path(entry->path, &path) || path.depth == 0)
+        return false;
+    size_t last = path.depth - 1;
+    Tree *parent = replay_folder(tree, &path, last);
+    Tree *node = parent ? get_child(parent, &path, last) : NULL;
+
+    switch (entry->type) {
+        case JOURNAL_CREATE:
+            if (parent == NULL || node != NULL)
+                return false;
+            insert_child(tree, parent, &path, last, new_node(tree));
+            drop_listing(tree, parent);
+            return true;
+        case JOURNAL_CREATE_RECURSIVE: {
+            Tree *folder = tree;
+            for (size_t i = 0; i < path.depth; ++i) {
+                Tree *child = get_child(folder, &path, i);
+                if (child == NULL) {
+                    child = new_node(tree);
+                    insert_child(tree, folder, &path, i, child);
+                    drop_listing(tree, folder);
+                }
+                folder = child;
+            }
+            return true;
+        }
+        case JOURNAL_REMOVE:
+            if (node == NULL || children_size(&node->subfolders) != 0)
+                return false;
+            drop_listing(tree, node);
+            remove_node(tree, node, parent, &path, last, 0);
+            drop_listing(tree, parent);
+            return true;
+        case JOURNAL_REMOVE_RECURSIVE:
+            if (node == NULL)
+                return false;
+            children_remove(&parent->subfolders, path_name(&path, last),
+                            path_name_length(&path, last), path.hashes[last]);
+            drop_listing(tree, parent);
+            submit_teardown(tree, node);
+            return true;
+        case JOURNAL_MOVE: {
+            PARSED_PATH(target);
+            if (node == NULL || !parse_path(entry->target, &target) || target.depth == 0 ||
+                path_common_depth(&path, &target, path.depth) == path.depth)
+                return false;
+            Tree *parent_target = replay_folder(tree, &target, target.depth - 1);
+            if (parent_target == NULL || get_child(parent_target, &target, target.depth - 1))
+                return false;
+            children_remove(&parent->subfolders, path_name(&path, last),
+                            path_name_length(&path, last), path.hashes[last]);
+            insert_child(tree, parent_target, &target, target.depth - 1, node);
+            drop_listing(tree, parent);
+            drop_listing(tree, parent_target);
+            return true;
         }
     }
+    return false;
 
-    if (hmap_get(parent_target->subfolders, folder_to_move_to) != NULL) {
-        exit_protocole_writer(lowest_ancestor_tree);
-        if (!target_parent_as_lowest_ancestor)
-            exit_protocole_writer(parent_target);
-        return EEXIST;
-    }
+}
 
-    Tree *parent_source = lowest_ancestor_tree;
-    char component_source[MAX_FOLDER_NAME_LENGTH_UTILS + 1];
-    const char *subpath_source = split_path(path_source, component_source);
+int tree_replay(Tree *tree, int fd, size_t *replayed) {
 
-    if (subpath_source == NULL) {
-        source_parent_as_lowest_ancestor = true;
-    } else {
-        parent_source =
-                hmap_get(lowest_ancestor_tree->subfolders, component_source);
-        if (parent_source == NULL) {
-            exit_protocole_writer(lowest_ancestor_tree);
-            if (!target_parent_as_lowest_ancestor)
-                exit_protocole_writer(parent_target);
-            return ENOENT;
-        }
+    // Folders are about to be removed and moved with no regard for the cache.
+    invalidate_paths(tree);
+    return journal_replay(fd, replay_entry, tree, replayed);
+
+}
 
-        int code = iterate_to_folder_writer(subpath_source, &parent_source);
-        if (code == ENOENT) {
-            exit_protocole_writer(lowest_ancestor_tree);
-            if (!target_parent_as_lowest_ancestor)
-                exit_protocole_writer(parent_target);
-            return code;
+#ifdef TREE_STATS
+
+typedef struct Hottest {
+    TreeHotPath *paths; // Sorted, hottest first.
+    size_t n;
+    size_t count;
+} Hottest;
+
+static bool hotter(const TreeLockStats *a, const TreeLockStats *b) {
+
+    if (a->wait_ns != b->wait_ns)
+        return a->wait_ns > b->wait_ns;
+    return a->acquisitions > b->acquisitions;
+
+}
+
+// Adds node, at path of `length` characters, to hottest if it is hot enough.
+static void add_hottest(Tree *node, const char *path, size_t length, Hottest *hottest) {
+
+    TreeLockStats stats;
+    read_stats(&node->stats, &stats);
+    size_t i = hottest->count;
+    while (i > 0 && hotter(&stats, &hottest->paths[i - 1].locks))
+        i--;
+    if (stats.acquisitions > 0 && i < hottest->n) {
+        if (hottest->count == hottest->n)
+            free(hottest->paths[--hottest->count].path);
+        memmove(hottest->paths + i + 1, hottest->paths + i,
+                (hottest->count - i) * sizeof(TreeHotPath));
+        hottest->paths[i].path = strndup(path, length);
+        if (hottest->paths[i].path == NULL) fatal("strndup failed");
+        hottest->paths[i].locks = stats;
+        hottest->count++;
+    }
+
+}
+
+// A folder still to be looked at by find_hottest.
+typedef struct HotEntry {
+    Tree *node;
+    size_t path_length; // Of its parent.
+    size_t name; // Offset of the name among the names.
+    size_t length;
+} HotEntry;
+
+// Adds the folders of the tree to hottest, depth first. Each folder is locked
+// only while its statistics and subfolders are read; folders removed
+// meanwhile are kept, as for tree_walk, until the search is over.
+static void find_hottest(Tree *tree, Hottest *hottest) {
+
+    TreeSnapshot hold = {.tree = tree, .folder = tree, .walk = true};
+    add_snapshot(&hold);
+    char path[MAX_PATH_LENGTH_UTILS + 1] = "/";
+    HotEntry *entries = NULL;
+    char *names = NULL;
+    size_t entries_length = 0, entries_capacity = 0, names_length = 0, names_capacity = 0;
+    reserve(&entries, &entries_capacity, 1, sizeof(HotEntry));
+    entries[entries_length++] = (HotEntry) {tree, 0, 0, 1};
+    reserve(&names, &names_capacity, 1, sizeof(char));
+    names[names_length++] = '/';
+
+    while (entries_length > 0) {
+        // Entries of the same parent lie above the entry, so the path of the
+        // parent is still in place.
+        HotEntry entry = entries[--entries_length];
+        memcpy(path + entry.path_length, names + entry.name, entry.length);
+        size_t length = entry.path_length + entry.length;
+        if (entry.node != tree)
+            path[length++] = '/';
+        names_length = entry.name;
+
+        // Taken directly, so as not to count the search itself.
+        node_lock_read(&entry.node->lock);
+        add_hottest(entry.node, path, length, hottest);
+        const char *key;
+        size_t key_length;
+        void *child;
+        ChildrenIterator it = children_iterator(&entry.node->subfolders);
+        while (children_next(&entry.node->subfolders, &it, &key, &key_length, &child)) {
+            // Moves can put folders deeper than any path reaches.
+            if (length + key_length + 1 > MAX_PATH_LENGTH_UTILS)
+                continue;
+            reserve(&entries, &entries_capacity, entries_length + 1, sizeof(HotEntry));
+            reserve(&names, &names_capacity, names_length + key_length, sizeof(char));
+            entries[entries_length++] = (HotEntry) {child, length, names_length, key_length};
+            memcpy(names + names_length, key, key_length);
+            names_length += key_length;
         }
+        node_unlock_read(&entry.node->lock);
     }
+    free(entries);
+    free(names);
+    remove_snapshot(&hold);
 
-    Tree *node_to_move = hmap_get(parent_source->subfolders, folder_to_move);
-    if (node_to_move == NULL) {
-        exit_protocole_writer(lowest_ancestor_tree);
-        if (!target_parent_as_lowest_ancestor)
-            exit_protocole_writer(parent_target);
-        if (!source_parent_as_lowest_ancestor)
-            exit_protocole_writer(parent_source);
-        return ENOENT;
+}
+
+int tree_stats(Tree *tree, TreeStats *stats) {
+
+    memset(stats, 0, sizeof(TreeStats));
+    for (int i = 0; i < TREE_OPERATIONS; ++i) {
+        TreeLockStats *operation = &stats->operations[i];
+        read_stats(&((Root *) tree)->operations[i], operation);
+        stats->total.acquisitions += operation->acquisitions;
+        stats->total.contended += operation->contended;
+        stats->total.wait_ns += operation->wait_ns;
+        if (operation->max_wait_ns > stats->total.max_wait_ns)
+            stats->total.max_wait_ns = operation->max_wait_ns;
     }
+    return 0;
 
-    // If lowest_ancestor_tree is different from parent_source and parent_target
-    // then we can unlock access to it, because we are already locked in
-    // parent_source and parent_target.
-    if (!target_parent_as_lowest_ancestor && !source_parent_as_lowest_ancestor)
-        exit_protocole_writer(lowest_ancestor_tree);
+}
 
-    wait_for_all_nodes_in_subtree(node_to_move);
+int tree_hottest_paths(Tree *tree, size_t n, TreeHotPath *hottest, size_t *count) {
 
-    Tree *new_node = malloc(sizeof(Tree));
-    if (new_node == NULL) fatal("malloc failed");
+    Hottest found = {hottest, n, 0};
+    find_hottest(tree, &found);
+    *count = found.count;
+    return 0;
 
-    new_node->subfolders = node_to_move->subfolders;
-    init(new_node);
-    hmap_insert(parent_target->subfolders, folder_to_move_to, new_node);
-    remove_node(node_to_move, parent_source, folder_to_move);
+}
 
-    // If parent_target and parent_source are the same node as
-    // lowest_ancestor_tree, then exit protocol is called only once.
-    if (!target_parent_as_lowest_ancestor || !source_parent_as_lowest_ancestor) {
-        exit_protocole_writer(parent_source);
-        exit_protocole_writer(parent_target);
-    } else {
-        exit_protocole_writer(lowest_ancestor_tree);
-    }
+#else
 
-    return 0;
+int tree_stats(Tree *tree, TreeStats *stats) {
+
+    (void) tree;
+    memset(stats, 0, sizeof(TreeStats));
+    return ENOTSUP;
+
+}
+
+int tree_hottest_paths(Tree *tree, size_t n, TreeHotPath *hottest, size_t *count) {
+
+    (void) tree;
+    (void) n;
+    (void) hottest;
+    *count = 0;
+    return ENOTSUP;
+
+}
+
+#endif
+
+int tree_trace_dump(const char *path) {
+
+#ifdef TREE_TRACE
+    return trace_dump(path);
+#else
+    (void) path;
+    return ENOTSUP;
+#endif
 
 }
@@ -8,12 +8,199 @@ typedef struct Tree Tree;
 
 Tree* tree_new();
 
+// Like tree_new, but operations look up where folders on deep paths are in a
+// cache of at most `entries` paths, and start walking from the deepest cached
+// ancestor instead of the root. Moving folders or removing cached ones empties
+// the cache.
+Tree* tree_new_cached(size_t entries);
+
+// Sets the numbers of path cache lookups that found an ancestor and that did
+// not, and of times the cache was emptied; zeros without a cache.
+void tree_cache_stats(Tree* tree, uint64_t* hits, uint64_t* misses,
+                      uint64_t* invalidations);
+
+// Waits until the folders removed by tree_remove_recursive are freed, except
+// those a snapshot keeps, then returns the number of bytes the tree uses for
+// its folders, their names and their listings.
+size_t tree_memory(Tree* tree);
+
 void tree_free(Tree*);
 
+// Like tree_free, but the memory is released by `threads` threads.
+void tree_free_threads(Tree* tree, int threads);
+
 char* tree_list(Tree* tree, const char* path);
 
+// Lists the folder at `path` a page at a time. Writes to `buffer` (of `size`
+// bytes) the sorted, comma-separated names of subfolders that come after
+// `after` (from the first one if `after` is NULL or empty), as many as fit and
+// at most `max_names` (0 for no limit), and sets *count to their number.
+// The last name written is the `after` of the next page; a page with *count
+// equal to 0 is the end. A buffer of MAX_FOLDER_NAME_LENGTH_UTILS + 1 bytes
+// always fits a name. Pages see the folder as it is when each one is taken.
+// Returns 0, EINVAL for an invalid path, ENOENT if the folder does not exist
+// or ERANGE if the next name does not fit.
+int tree_list_page(Tree* tree, const char* path, const char* after,
+                   size_t max_names, char* buffer, size_t size, size_t* count);
+
 int tree_create(Tree* tree, const char* path);
 
+// Creates the folder at `path` together with all missing folders above it,
+// like mkdir -p, and sets *created to the number of folders created (0 if
+// the folder already existed). The missing folders appear all at once.
+// Returns 0, EINVAL for an invalid path (with *created set to 0), or, while a
+// journal is on, an errno value of the journal (see tree_journal_start): if
+// it failed before the call, nothing is created and *created is 0; otherwise
+// the folders were created, *created is their number, and the change may not
+// have been logged.
+int tree_create_recursive(Tree* tree, const char* path, size_t* created);
+
 int tree_remove(Tree* tree, const char* path);
 
+// Removes the folder at `path` with everything below it, like rm -rf. The
+// folder disappears at once; its subtree is freed in the background, so the
+// call takes the same time whatever the size of the subtree.
+// Returns 0, EINVAL for an invalid path, EBUSY for "/", ENOENT, or an errno
+// value of the journal (see tree_journal_start).
+int tree_remove_recursive(Tree* tree, const char* path);
+
 int tree_move(Tree* tree, const char* source, const char* target);
+
+// Called by tree_walk with the path of a folder, like "/a/b/", which is valid
+// until it returns. Returns 0 to go on; any other value stops the walk.
+typedef int (*TreeWalkCallback)(const char* path, void* context);
+
+// Calls `callback` for the folder at `path` and every folder below it, each
+// once, from `threads` threads at the same time (the calling one included),
+// which share the subtree between them as they go. Returns 0, EINVAL, ENOENT
+// or ECANCELED if the callback stopped the walk.
+//
+// The walk locks one folder at a time, only to read its subfolders, so it is
+// not a snapshot (see tree_snapshot for one). A folder is reported with the
+// path it had when its parent was read. Folders that stay where they are
+// during the walk, and whose ancestors up to `path` do too, are reported
+// exactly once. A folder created or moved in during the walk may be missed,
+// one removed may still be reported, and one moved within the subtree may be
+// missed or reported twice, at its old and new path. Folders removed during
+// the walk are freed only after it.
+int tree_walk(Tree* tree, const char* path, TreeWalkCallback callback, void* context,
+              int threads);
+
+typedef struct TreeSnapshot TreeSnapshot;
+
+// Takes a snapshot of the folder at `path` and everything below it, as they
+// are at the moment of the call, or returns NULL for an invalid path or a
+// folder that does not exist. The snapshot can be listed with
+// tree_snapshot_list for as long as needed while the tree keeps changing.
+// Taking it costs the same whatever the size of the subtree; afterwards, the
+// first change of each folder copies the names of its subfolders for the
+// snapshot, and removed folders are kept until it is released.
+// All snapshots must be released before tree_free.
+TreeSnapshot* tree_snapshot(Tree* tree, const char* path);
+
+// Like tree_list, but for the folder at `path` in the snapshot, where "/" is
+// the folder the snapshot was taken of.
+char* tree_snapshot_list(TreeSnapshot* snapshot, const char* path);
+
+// Releases the snapshot and whatever the tree kept only for it.
+void tree_snapshot_release(TreeSnapshot* snapshot);
+
+// Sets *histories to the number of copies of the subfolders of a folder, and
+// *graves to the number of removed folders, that the tree keeps for
+// snapshots (and for tree_walk). Both are 0 when nothing needs them.
+void tree_snapshot_stats(Tree* tree, size_t* histories, size_t* graves);
+
+// Writes the folders of the tree, as they are at the moment of the call, to
+// the file descriptor `fd`, while other threads may keep changing the tree.
+// Returns 0 or an errno value.
+int tree_save(Tree* tree, int fd);
+
+// Returns a new tree with the folders saved by tree_save to the file `fd`
+// refers to, or NULL with errno set (EINVAL if the file is not a saved tree).
+// The file is mapped into memory and read from the start.
+Tree* tree_load(int fd);
+
+// Like tree_load, but the folders are created by `threads` threads.
+Tree* tree_load_threads(int fd, int threads);
+
+// When a change logged by tree_journal_start is on disk before the function
+// that made it returns.
+typedef enum TreeJournalSync {
+    TREE_SYNC_NONE, // Left to the system; a crash may lose the latest changes.
+    TREE_SYNC_BATCHED, // On disk; changes made at the same time share a sync.
+    TREE_SYNC_EACH, // On disk, with a sync of its own.
+} TreeJournalSync;
+
+// Starts logging every change made by tree_create, tree_create_recursive,
+// tree_remove, tree_remove_recursive and tree_move to the journal file `fd`,
+// after the records already in it. Must be called before other threads use
+// the tree. Records are in an order in which they can be replayed. If writing
+// or syncing the journal fails, the change whose record it was returns the
+// errno value, having been made in the tree but maybe not logged, and every
+// later change returns it without being made until tree_journal_stop. So
+// does ENAMETOOLONG, returned by a change whose folders a concurrent move
+// took deeper than a path can reach.
+// Returns 0, EBUSY if a journal is on already, or an errno value (EINVAL if
+// the file is not a journal).
+int tree_journal_start(Tree* tree, int fd, TreeJournalSync sync);
+
+// Writes out the records not written yet and stops logging. Must be called
+// when no other thread uses the tree; tree_free calls it too.
+void tree_journal_stop(Tree* tree);
+
+// Applies the changes logged in the journal file `fd` to the tree, which no
+// other thread may use meanwhile and which must have no snapshots. The
+// folders are changed directly, without locks. A record cut short by a crash
+// at the end of the file is cut off it, so that logging can go on after the
+// last complete one. Sets *replayed to the number of changes applied and
+// returns 0, an errno value, or EINVAL if the file is not a journal or a
+// change could not be applied to the tree.
+int tree_replay(Tree* tree, int fd, size_t* replayed);
+
+// Operation types whose lock statistics are kept apart.
+typedef enum TreeOperation {
+    TREE_LIST, // tree_list, tree_list_page and tree_walk.
+    TREE_CREATE, // tree_create and tree_create_recursive.
+    TREE_REMOVE, // tree_remove and tree_remove_recursive, with freeing the subtree.
+    TREE_MOVE,
+    TREE_OPERATIONS
+} TreeOperation;
+
+// Lock statistics of folders. Waiting until nobody uses a folder that is
+// being removed counts as an acquisition too.
+typedef struct TreeLockStats {
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that had to wait.
+    uint64_t wait_ns; // Total time spent waiting.
+    uint64_t max_wait_ns;
+} TreeLockStats;
+
+typedef struct TreeStats {
+    TreeLockStats operations[TREE_OPERATIONS];
+    TreeLockStats total;
+} TreeStats;
+
+typedef struct TreeHotPath {
+    char* path; // Freed by the caller.
+    TreeLockStats locks;
+} TreeHotPath;
+
+// Lock statistics are gathered only in builds with TREE_STATS defined
+// (cmake -DTREE_STATS=ON); otherwise locking does no extra work and the two
+// functions below return ENOTSUP.
+
+// Sets *stats to the lock statistics of all operations on the tree so far.
+// Returns 0 or ENOTSUP.
+int tree_stats(Tree* tree, TreeStats* stats);
+
+// Fills `hottest` with at most `n` existing folders whose locks were waited
+// for longest, hottest first, and sets *count to their number. The search
+// locks one folder at a time, only to read it. Returns 0 or ENOTSUP.
+int tree_hottest_paths(Tree* tree, size_t n, TreeHotPath* hottest, size_t* count);
+
+// Writes the latest operations and lock events of every thread to the file at
+// `path`, in the format of trace.h; tools/trace_to_json converts it for
+// chrome://tracing and Perfetto. Events are recorded only in builds with
+// TREE_TRACE defined (cmake -DTREE_TRACE=ON). Returns 0, an errno value if
+// the file cannot be written, or ENOTSUP.
+int tree_trace_dump(const char* path);
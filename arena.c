@@ -0,0 +1,339 @@
+#include "arena.h"
+#include "epoch.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_SHARDS 16
+
+// Small objects are rounded up to a multiple of GRANULE bytes.
+#define GRANULE 16
+#define MAX_SMALL 512
+#define N_CLASSES (MAX_SMALL / GRANULE)
+
+#define CHUNK_SIZE (64 * 1024)
+
+// A shard looks for retired objects that can be reused each time this many
+// were retired since the last look.
+#define LIMBO_BATCH 64
+
+#define CACHE_LINE 64
+
+// arena_free_parallel does not start a thread for fewer blocks than this.
+#define MIN_BLOCKS_PER_THREAD 256
+
+typedef struct FreeObject FreeObject;
+
+struct FreeObject {
+    FreeObject *next;
+};
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+    Chunk *next;
+    _Alignas(GRANULE) char memory[];
+};
+
+// Header of an object above MAX_SMALL; these are kept on a doubly-linked list.
+typedef struct Large Large;
+
+struct Large {
+    Large *prev;
+    Large *next;
+    _Alignas(GRANULE) char memory[];
+};
+
+typedef struct Deferred {
+    void *ptr;
+    size_t size;
+    uint64_t stamp;
+} Deferred;
+
+typedef struct Shard {
+    _Alignas(CACHE_LINE) pthread_mutex_t lock;
+    FreeObject *free[N_CLASSES];
+    char *bump; // Unused rest of the chunk allocated last.
+    size_t bump_left;
+    Deferred *limbo; // Retired objects in the order of retirement.
+    size_t limbo_size;
+    size_t limbo_capacity;
+    size_t retired_since_reclaim;
+    // Bytes allocated by the threads of the shard less those they released or
+    // retired, which may have been allocated by others.
+    ptrdiff_t in_use;
+} Shard;
+
+struct Arena {
+    Shard shards[ARENA_SHARDS];
+    pthread_mutex_t lock; // Guards chunks and large.
+    Chunk *chunks;
+    Large *large;
+};
+
+static atomic_uint next_shard;
+static _Thread_local int shard_index = -1;
+
+static Shard *my_shard(Arena *arena) {
+
+    if (shard_index < 0)
+        shard_index = atomic_fetch_add(&next_shard, 1) % ARENA_SHARDS;
+    return &arena->shards[shard_index];
+
+}
+
+static void lock(pthread_mutex_t *mutex) {
+
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+
+}
+
+static size_t size_class(size_t size) {
+
+    return size == 0 ? 0 : (size - 1) / GRANULE;
+
+}
+
+Arena *arena_new(void) {
+
+    Arena *arena = aligned_alloc(CACHE_LINE, sizeof(Arena));
+    if (arena == NULL)
+        fatal("aligned_alloc failed");
+    memset(arena, 0, sizeof(Arena));
+    for (int i = 0; i < ARENA_SHARDS; ++i) {
+        if (pthread_mutex_init(&arena->shards[i].lock, 0) != 0)
+            syserr("mutex init failed");
+    }
+    if (pthread_mutex_init(&arena->lock, 0) != 0)
+        syserr("mutex init failed");
+    return arena;
+
+}
+
+typedef struct Release {
+    pthread_t thread;
+    void **blocks;
+    size_t count;
+} Release;
+
+static void *release_blocks(void *arg) {
+
+    Release *release = arg;
+    for (size_t i = 0; i < release->count; ++i)
+        free(release->blocks[i]);
+    return NULL;
+
+}
+
+void arena_free(Arena *arena) {
+
+    arena_free_parallel(arena, 1);
+
+}
+
+void arena_free_parallel(Arena *arena, int threads) {
+
+    // The lists are walked first, so the blocks can be split between threads.
+    size_t count = 0;
+    for (Chunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+        count++;
+    for (Large *large = arena->large; large; large = large->next)
+        count++;
+    void **blocks = malloc(count * sizeof(void *) + 1);
+    if (blocks == NULL)
+        fatal("malloc failed");
+    size_t n = 0;
+    for (Chunk *chunk = arena->chunks; chunk; chunk = chunk->next)
+        blocks[n++] = chunk;
+    for (Large *large = arena->large; large; large = large->next)
+        blocks[n++] = large;
+
+    if (threads < 1)
+        threads = 1;
+    if ((size_t) threads > count / MIN_BLOCKS_PER_THREAD + 1)
+        threads = count / MIN_BLOCKS_PER_THREAD + 1;
+    Release releases[threads];
+    for (int i = 0; i < threads; ++i) {
+        releases[i].blocks = blocks + count * i / threads;
+        releases[i].count = count * (i + 1) / threads - count * i / threads;
+    }
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_create(&releases[i].thread, NULL, release_blocks, &releases[i]) != 0)
+            syserr("pthread_create failed");
+    }
+    release_blocks(&releases[0]);
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_join(releases[i].thread, NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    free(blocks);
+
+    for (int i = 0; i < ARENA_SHARDS; ++i) {
+        free(arena->shards[i].limbo);
+        if (pthread_mutex_destroy(&arena->shards[i].lock) != 0)
+            syserr("mutex destroy failed");
+    }
+    if (pthread_mutex_destroy(&arena->lock) != 0)
+        syserr("mutex destroy failed");
+    free(arena);
+
+}
+
+static void *alloc_large(Arena *arena, size_t size) {
+
+    Large *large = malloc(sizeof(Large) + size);
+    if (large == NULL)
+        fatal("malloc failed");
+    large->prev = NULL;
+    lock(&arena->lock);
+    large->next = arena->large;
+    if (arena->large)
+        arena->large->prev = large;
+    arena->large = large;
+    unlock(&arena->lock);
+    return large->memory;
+
+}
+
+static void release_large(Arena *arena, void *ptr) {
+
+    Large *large = (Large *) ((char *) ptr - offsetof(Large, memory));
+    lock(&arena->lock);
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        arena->large = large->next;
+    if (large->next)
+        large->next->prev = large->prev;
+    unlock(&arena->lock);
+    free(large);
+
+}
+
+// Must be called with the shard locked.
+static void *alloc_small(Arena *arena, Shard *shard, size_t class) {
+
+    FreeObject *object = shard->free[class];
+    if (object) {
+        shard->free[class] = object->next;
+        return object;
+    }
+
+    size_t size = (class + 1) * GRANULE;
+    if (shard->bump_left < size) {
+        Chunk *chunk = malloc(CHUNK_SIZE);
+        if (chunk == NULL)
+            fatal("malloc failed");
+        lock(&arena->lock);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        unlock(&arena->lock);
+        shard->bump = chunk->memory;
+        shard->bump_left = CHUNK_SIZE - offsetof(Chunk, memory);
+    }
+    void *memory = shard->bump;
+    shard->bump += size;
+    shard->bump_left -= size;
+    return memory;
+
+}
+
+// Must be called with the shard locked if the object is small.
+static void release(Arena *arena, Shard *shard, void *ptr, size_t size) {
+
+    if (size > MAX_SMALL) {
+        release_large(arena, ptr);
+        return;
+    }
+    FreeObject *object = ptr;
+    size_t class = size_class(size);
+    object->next = shard->free[class];
+    shard->free[class] = object;
+
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+
+    Shard *shard = my_shard(arena);
+    void *memory = size > MAX_SMALL ? alloc_large(arena, size) : NULL;
+    lock(&shard->lock);
+    if (memory == NULL)
+        memory = alloc_small(arena, shard, size_class(size));
+    shard->in_use += size;
+    unlock(&shard->lock);
+    return memory;
+
+}
+
+void arena_release(Arena *arena, void *ptr, size_t size) {
+
+    Shard *shard = my_shard(arena);
+    lock(&shard->lock);
+    release(arena, shard, ptr, size);
+    shard->in_use -= size;
+    unlock(&shard->lock);
+
+}
+
+// Reuses the retired objects of the shard that nobody can be reading anymore.
+// Must be called with the shard locked.
+static void reclaim(Arena *arena, Shard *shard) {
+
+    size_t n = 0;
+    while (n < shard->limbo_size && epoch_expired(shard->limbo[n].stamp)) {
+        release(arena, shard, shard->limbo[n].ptr, shard->limbo[n].size);
+        n++;
+    }
+    shard->limbo_size -= n;
+    memmove(shard->limbo, shard->limbo + n, shard->limbo_size * sizeof(Deferred));
+
+}
+
+void arena_retire(Arena *arena, void *ptr, size_t size) {
+
+    uint64_t stamp = epoch_stamp();
+    Shard *shard = my_shard(arena);
+    lock(&shard->lock);
+    if (shard->limbo_size == shard->limbo_capacity) {
+        shard->limbo_capacity = shard->limbo_capacity ? 2 * shard->limbo_capacity
+                                                      : LIMBO_BATCH;
+        shard->limbo = realloc(shard->limbo, shard->limbo_capacity * sizeof(Deferred));
+        if (shard->limbo == NULL)
+            fatal("realloc failed");
+    }
+    shard->limbo[shard->limbo_size].ptr = ptr;
+    shard->limbo[shard->limbo_size].size = size;
+    shard->limbo[shard->limbo_size].stamp = stamp;
+    shard->limbo_size++;
+    shard->in_use -= size;
+    if (++shard->retired_since_reclaim >= LIMBO_BATCH) {
+        shard->retired_since_reclaim = 0;
+        reclaim(arena, shard);
+    }
+    unlock(&shard->lock);
+
+}
+
+size_t arena_in_use(Arena *arena) {
+
+    ptrdiff_t in_use = 0;
+    for (int i = 0; i < ARENA_SHARDS; ++i) {
+        lock(&arena->shards[i].lock);
+        in_use += arena->shards[i].in_use;
+        unlock(&arena->shards[i].lock);
+    }
+    return in_use;
+
+}
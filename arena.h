@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+// Allocator for the many small objects of one tree (folders, hash map
+// entries and keys), all released at once by arena_free.
+//
+// Small objects are carved from large chunks and recycled through free lists
+// sorted by size class. Each thread works on its own shard of the arena (as
+// long as there are at most 16 threads), so concurrent allocations do not
+// contend on a shared lock. Objects above the largest size class are
+// allocated with malloc but still released by arena_free.
+
+typedef struct Arena Arena;
+
+Arena *arena_new(void);
+
+// Releases the arena and everything allocated from it.
+void arena_free(Arena *arena);
+
+// Like arena_free, but the memory is returned to the system by `threads`
+// threads, fewer if there is little of it.
+void arena_free_parallel(Arena *arena, int threads);
+
+// Never returns NULL.
+void *arena_alloc(Arena *arena, size_t size);
+
+// Returns memory from arena_alloc with the same `size` to the arena.
+void arena_release(Arena *arena, void *ptr, size_t size);
+
+// Like arena_release, but the memory is reused only once no thread between
+// epoch_enter and epoch_exit (see epoch.h) can still be reading it.
+void arena_retire(Arena *arena, void *ptr, size_t size);
+
+// Returns the number of bytes allocated and neither released nor retired.
+size_t arena_in_use(Arena *arena);
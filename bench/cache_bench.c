@@ -0,0 +1,119 @@
+// Benchmark of operations on deep paths against the size of the path cache.
+//
+// Usage: cache_bench [depth] [operations] [threads]
+// Builds 64 chains of `depth` folders below the root and then runs tree_list
+// and tree_create/tree_remove of leaves at random chain ends, with no cache
+// and with caches of growing size. Prints one CSV line per cache size.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_DEPTH 32
+#define DEFAULT_OPERATIONS 2000000
+#define CHAINS 64
+
+static const size_t cache_sizes[] = {0, 16, 256, 4096, 65536};
+
+typedef struct Worker {
+    pthread_t thread;
+    Tree *tree;
+    int id;
+    size_t operations;
+} Worker;
+
+static int depth;
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Writes the path of the end of chain `chain`.
+static size_t chain_path(char *path, int chain) {
+
+    size_t length = 0;
+    path[length++] = '/';
+    path[length++] = 'a' + chain / 26;
+    path[length++] = 'a' + chain % 26;
+    path[length++] = '/';
+    for (int i = 1; i < depth; ++i) {
+        memcpy(path + length, "dir/", 4);
+        length += 4;
+    }
+    path[length] = '\0';
+    return length;
+
+}
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    char path[MAX_PATH_LENGTH_UTILS + 1];
+    unsigned int seed = worker->id + 1;
+    for (size_t i = 0; i < worker->operations; ++i) {
+        size_t length = chain_path(path, rand_r(&seed) % CHAINS);
+        if (rand_r(&seed) % 4 != 0) {
+            free(tree_list(worker->tree, path));
+        } else {
+            snprintf(path + length, sizeof(path) - length, "leaf%c/", 'a' + worker->id);
+            if (tree_create(worker->tree, path) != 0)
+                tree_remove(worker->tree, path);
+        }
+    }
+    return NULL;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    depth = argc > 1 ? atoi(argv[1]) : DEFAULT_DEPTH;
+    size_t operations = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_OPERATIONS;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    if (depth < 1 || depth * 4 + 16 > MAX_PATH_LENGTH_UTILS || threads < 1 || threads > 26) {
+        fprintf(stderr, "bad depth or number of threads\n");
+        return 1;
+    }
+
+    printf("depth,threads,cache_entries,ops_per_sec,hits,misses,invalidations\n");
+    for (size_t c = 0; c < sizeof(cache_sizes) / sizeof(cache_sizes[0]); ++c) {
+        Tree *tree = cache_sizes[c] ? tree_new_cached(cache_sizes[c]) : tree_new();
+        char path[MAX_PATH_LENGTH_UTILS + 1];
+        size_t created;
+        for (int chain = 0; chain < CHAINS; ++chain) {
+            chain_path(path, chain);
+            tree_create_recursive(tree, path, &created);
+        }
+
+        Worker workers[threads];
+        double start = now_seconds();
+        for (int i = 0; i < threads; ++i) {
+            workers[i].tree = tree;
+            workers[i].id = i;
+            workers[i].operations = operations / threads;
+            if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                return 1;
+            }
+        }
+        for (int i = 0; i < threads; ++i)
+            pthread_join(workers[i].thread, NULL);
+        double time = now_seconds() - start;
+
+        uint64_t hits, misses, invalidations;
+        tree_cache_stats(tree, &hits, &misses, &invalidations);
+        printf("%d,%d,%zu,%.0f,%lu,%lu,%lu\n", depth, threads, cache_sizes[c],
+               operations / time, (unsigned long) hits, (unsigned long) misses,
+               (unsigned long) invalidations);
+        tree_free(tree);
+    }
+    return 0;
+
+}
@@ -0,0 +1,127 @@
+// Benchmark of tree_create throughput and memory use on a large tree.
+//
+// Usage: create_bench [folders] [threads]
+// Each thread fills its own top-level folder, every level up to 100 children.
+// Prints one CSV line with creates per second, the resident set size after
+// creating and the time taken by tree_free.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_FOLDERS 10000000
+#define FANOUT 100
+
+typedef struct Worker {
+    pthread_t thread;
+    Tree *tree;
+    char path[16];
+    size_t count;
+    size_t created;
+} Worker;
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+static long rss_kib(void) {
+
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return -1;
+    if (fscanf(statm, "%*s %ld", &pages) != 1)
+        pages = -1;
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+}
+
+// Creates `count` folders below `path` (which ends with '/'), filling each
+// level up to FANOUT children before going deeper. Returns the number of
+// folders created.
+static size_t fill(Tree *tree, const char *path, size_t count) {
+
+    char child[MAX_PATH_LENGTH_UTILS + 1];
+    size_t created = 0;
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        if (tree_create(tree, child) != 0)
+            return created;
+        created++;
+    }
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        size_t share = (count - created + FANOUT - 1 - i) / (FANOUT - i);
+        created += fill(tree, child, share);
+    }
+    return created;
+
+}
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    worker->created = fill(worker->tree, worker->path, worker->count);
+    return NULL;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t folders = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FOLDERS;
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    if (threads < 1 || threads > 26) {
+        fprintf(stderr, "threads must be between 1 and 26\n");
+        return 1;
+    }
+
+    Tree *tree = tree_new();
+    Worker *workers = calloc(threads, sizeof(Worker));
+    if (workers == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        return 1;
+    }
+    for (int i = 0; i < threads; ++i) {
+        workers[i].tree = tree;
+        snprintf(workers[i].path, sizeof(workers[i].path), "/%c/", 'a' + i);
+        tree_create(tree, workers[i].path);
+        workers[i].count = folders / threads;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    size_t created = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        created += workers[i].created;
+    }
+    double create_time = now_seconds() - start;
+    long rss = rss_kib();
+
+    start = now_seconds();
+    tree_free(tree);
+    double free_time = now_seconds() - start;
+
+    printf("folders,threads,creates_per_sec,rss_mib,bytes_per_folder,tree_free_ms\n");
+    printf("%zu,%d,%.0f,%.1f,%.1f,%.1f\n", created, threads, created / create_time,
+           rss / 1024.0, rss * 1024.0 / created, free_time * 1e3);
+    free(workers);
+    return 0;
+
+}
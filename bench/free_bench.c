@@ -0,0 +1,133 @@
+// Benchmark of tree_free time against the number of threads releasing memory.
+//
+// Usage: free_bench [folders] [max threads] [creating threads]
+// For 1, 2, 4, ... up to max threads, builds a tree of `folders` folders (every
+// level up to 100 children, each creating thread filling its own top-level
+// folder) and frees it with tree_free_threads. Also tears down a path of
+// maximal depth with tree_remove_recursive. Prints one CSV line per run.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_FOLDERS 10000000
+#define DEFAULT_MAX_THREADS 8
+#define FANOUT 100
+
+typedef struct Worker {
+    pthread_t thread;
+    Tree *tree;
+    char path[16];
+    size_t count;
+} Worker;
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Creates `count` folders below `path` (which ends with '/'), filling each
+// level up to FANOUT children before going deeper. Returns the number of
+// folders created.
+static size_t fill(Tree *tree, const char *path, size_t count) {
+
+    char child[MAX_PATH_LENGTH_UTILS + 1];
+    size_t created = 0;
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        if (tree_create(tree, child) != 0)
+            return created;
+        created++;
+    }
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        size_t share = (count - created + FANOUT - 1 - i) / (FANOUT - i);
+        created += fill(tree, child, share);
+    }
+    return created;
+
+}
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    fill(worker->tree, worker->path, worker->count);
+    return NULL;
+
+}
+
+static Tree *build(size_t folders, int creators) {
+
+    Tree *tree = tree_new();
+    Worker workers[creators];
+    for (int i = 0; i < creators; ++i) {
+        workers[i].tree = tree;
+        snprintf(workers[i].path, sizeof(workers[i].path), "/%c/", 'a' + i);
+        tree_create(tree, workers[i].path);
+        workers[i].count = folders / creators;
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < creators; ++i)
+        pthread_join(workers[i].thread, NULL);
+    return tree;
+
+}
+
+// Creates the deepest path allowed and removes it from the top.
+static void deep_teardown(void) {
+
+    char path[MAX_PATH_LENGTH_UTILS + 1];
+    size_t length = 0;
+    while (length + 2 <= MAX_PATH_LENGTH_UTILS - 1) {
+        path[length++] = '/';
+        path[length++] = 'a';
+    }
+    path[length++] = '/';
+    path[length] = '\0';
+
+    Tree *tree = tree_new();
+    size_t created;
+    tree_create_recursive(tree, path, &created);
+    double start = now_seconds();
+    tree_remove_recursive(tree, "/a/");
+    tree_free(tree); // Waits for the teardown.
+    printf("%zu,deep,%.1f\n", created, (now_seconds() - start) * 1e3);
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t folders = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FOLDERS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+    int creators = argc > 3 ? atoi(argv[3]) : 1;
+    if (creators < 1 || creators > 26) {
+        fprintf(stderr, "creating threads must be between 1 and 26\n");
+        return 1;
+    }
+
+    // The first tree released by the process takes longer, so it is not timed.
+    tree_free(build(folders, creators));
+
+    printf("folders,threads,tree_free_ms\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        Tree *tree = build(folders, creators);
+        double start = now_seconds();
+        tree_free_threads(tree, threads);
+        printf("%zu,%d,%.1f\n", folders, threads, (now_seconds() - start) * 1e3);
+    }
+    deep_teardown();
+    return 0;
+
+}
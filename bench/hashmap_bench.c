@@ -0,0 +1,92 @@
+// Benchmark of HashMap lookups per second against the number of entries
+// (folder fanout), from 10 to 1M entries.
+//
+// Usage: hashmap_bench [lookups per fanout]
+// Prints one CSV line per fanout, with the time make_map_contents_array takes
+// to list the map in order (what tree_list does for a folder).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../HashMap.h"
+#include "../path_utils.h"
+
+#define DEFAULT_LOOKUPS 5000000
+#define MAX_FANOUT 1000000
+#define NAME_LENGTH 9
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Writes a folder name for index `i`, sharing a long prefix with its siblings
+// like generated names usually do ("shardaaaa", "shardaaab", ...).
+static void make_name(size_t i, char *name) {
+
+    memcpy(name, "shard", 5);
+    for (int pos = NAME_LENGTH - 1; pos >= 5; --pos) {
+        name[pos] = 'a' + i % 26;
+        i /= 26;
+    }
+    name[NAME_LENGTH] = '\0';
+
+}
+
+int main(int argc, char *argv[]) {
+
+    long lookups = argc > 1 ? atol(argv[1]) : DEFAULT_LOOKUPS;
+    char (*names)[NAME_LENGTH + 1] = malloc(MAX_FANOUT * sizeof(*names));
+    if (names == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < MAX_FANOUT; ++i)
+        make_name(i, names[i]);
+
+    printf("fanout,inserts_per_sec,max_insert_us,lookups_per_sec,sorted_list_us\n");
+    int value;
+    for (size_t fanout = 10; fanout <= MAX_FANOUT; fanout *= 10) {
+        HashMap *map = hmap_new();
+
+        double max_insert = 0;
+        double start = now_seconds();
+        for (size_t i = 0; i < fanout; ++i) {
+            double before = now_seconds();
+            hmap_insert(map, names[i], &value);
+            double took = now_seconds() - before;
+            if (took > max_insert)
+                max_insert = took;
+        }
+        double insert_time = now_seconds() - start;
+
+        unsigned int seed = 1;
+        size_t found = 0;
+        start = now_seconds();
+        for (long i = 0; i < lookups; ++i) {
+            seed = seed * 1103515245 + 12345;
+            if (hmap_get(map, names[seed % fanout]))
+                found++;
+        }
+        double lookup_time = now_seconds() - start;
+        if (found != (size_t) lookups)
+            fprintf(stderr, "lookup missed %zu keys\n", lookups - found);
+
+        start = now_seconds();
+        free(make_map_contents_array(map));
+        double list_time = now_seconds() - start;
+
+        printf("%zu,%.0f,%.2f,%.0f,%.1f\n", fanout, fanout / insert_time,
+               max_insert * 1e6, lookups / lookup_time, list_time * 1e6);
+        hmap_free(map);
+    }
+
+    free(names);
+    return 0;
+
+}
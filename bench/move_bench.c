@@ -0,0 +1,85 @@
+// Benchmark of tree_move latency against the size of the moved subtree,
+// from 1 to 1M folders.
+//
+// Usage: move_bench [max subtree size]
+// Prints one CSV line per subtree size.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_MAX_SIZE 1000000
+#define FANOUT 100
+#define MOVES 1000
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Creates `count` folders below `path` (which ends with '/'), filling each
+// level up to FANOUT children before going deeper. Returns the number of
+// folders created.
+static size_t fill(Tree *tree, const char *path, size_t count) {
+
+    char child[MAX_PATH_LENGTH_UTILS + 1];
+    size_t created = 0;
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        if (tree_create(tree, child) != 0)
+            return created;
+        created++;
+    }
+    for (size_t i = 0; i < FANOUT && created < count; ++i) {
+        snprintf(child, sizeof(child), "%sf%c%c/", path, 'a' + (int) (i / 26),
+                 'a' + (int) (i % 26));
+        size_t share = (count - created + FANOUT - 1 - i) / (FANOUT - i);
+        created += fill(tree, child, share);
+    }
+    return created;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t max_size = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MAX_SIZE;
+
+    printf("subtree_size,mean_move_us,max_move_us\n");
+    for (size_t size = 1; size <= max_size; size *= 10) {
+        Tree *tree = tree_new();
+        tree_create(tree, "/src/");
+        tree_create(tree, "/dst/");
+        tree_create(tree, "/src/moved/");
+        size_t created = 1 + fill(tree, "/src/moved/", size - 1);
+        if (created != size)
+            fprintf(stderr, "created %zu folders instead of %zu\n", created, size);
+
+        double max_move = 0;
+        double start = now_seconds();
+        for (int i = 0; i < MOVES; ++i) {
+            double before = now_seconds();
+            int code = i % 2 == 0 ? tree_move(tree, "/src/moved/", "/dst/moved/")
+                                  : tree_move(tree, "/dst/moved/", "/src/moved/");
+            double took = now_seconds() - before;
+            if (code != 0) {
+                fprintf(stderr, "tree_move failed: %d\n", code);
+                return 1;
+            }
+            if (took > max_move)
+                max_move = took;
+        }
+        double move_time = now_seconds() - start;
+
+        printf("%zu,%.2f,%.2f\n", size, move_time / MOVES * 1e6, max_move * 1e6);
+        tree_free(tree);
+    }
+
+    return 0;
+
+}
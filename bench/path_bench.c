@@ -0,0 +1,64 @@
+// Benchmark of the is_path_valid implementations (tests/path_test.c checks
+// that they agree).
+//
+// Usage: path_bench [validations]
+// Prints one CSV line per implementation with its speed on long valid paths.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../path_utils.h"
+
+#define DEFAULT_VALIDATIONS 2000000
+
+static const int widths[] = {0, 16, 32};
+#define N_WIDTHS (int) (sizeof(widths) / sizeof(widths[0]))
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Writes a path of `names` names of `name_length` letters each.
+static void make_path(char *path, size_t names, size_t name_length) {
+
+    *path++ = '/';
+    for (size_t i = 0; i < names; ++i) {
+        for (size_t j = 0; j < name_length; ++j)
+            *path++ = 'a' + (i + j) % 26;
+        *path++ = '/';
+    }
+    *path = '\0';
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t validations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_VALIDATIONS;
+
+    // Generated paths: 30 names of 12 letters.
+    static char path[MAX_PATH_LENGTH_UTILS + 1];
+    make_path(path, 30, 12);
+    size_t length = strlen(path);
+    printf("width,path_length,validations_per_sec,gib_per_sec\n");
+    for (int w = 0; w < N_WIDTHS; ++w) {
+        size_t valid = 0;
+        double start = now_seconds();
+        for (size_t i = 0; i < validations; ++i) {
+            path[length - 2] = 'a' + i % 26; // Keeps the call in the loop.
+            valid += is_path_valid_simd(path, widths[w]);
+        }
+        double time = now_seconds() - start;
+        if (valid != validations)
+            return 1;
+        printf("%d,%zu,%.0f,%.2f\n", widths[w], length, validations / time,
+               validations * length / time / (1 << 30));
+    }
+    return 0;
+
+}
@@ -0,0 +1,135 @@
+// Benchmark of saving a tree with tree_save and loading it with tree_load,
+// against building it with tree_create.
+//
+// Usage: save_bench [folders] [fanout] [threads] [file]
+// Builds a tree of `folders` folders, each with `fanout` subfolders until
+// there are enough, saves it to `file` (a temporary file by default), loads
+// it back with tree_load_threads and checks that the loaded tree has as many
+// folders. Prints one CSV line with the times.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_FOLDERS 10000000
+#define DEFAULT_FANOUT 16
+
+static atomic_size_t visited;
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Writes the name of the i-th subfolder to name.
+static size_t child_name(char *name, int i) {
+
+    size_t length = 0;
+    do {
+        name[length++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    return length;
+
+}
+
+// Creates folders breadth first below the root until there are `folders`.
+static void build(Tree *tree, size_t folders, int fanout) {
+
+    char **queue = malloc((folders + 1) * sizeof(char *));
+    if (queue == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(1);
+    }
+    size_t head = 0, tail = 0, created = 0;
+    queue[tail++] = strdup("/");
+    while (created < folders) {
+        char *parent = queue[head++];
+        size_t length = strlen(parent);
+        for (int i = 0; i < fanout && created < folders; ++i) {
+            char path[MAX_PATH_LENGTH_UTILS + 1];
+            memcpy(path, parent, length);
+            size_t name_length = child_name(path + length, i);
+            path[length + name_length] = '/';
+            path[length + name_length + 1] = '\0';
+            tree_create(tree, path);
+            queue[tail++] = strdup(path);
+            created++;
+        }
+    }
+    for (size_t i = 0; i < tail; ++i)
+        free(queue[i]);
+    free(queue);
+
+}
+
+static int count_folder(const char *path, void *context) {
+
+    (void) path;
+    (void) context;
+    atomic_fetch_add_explicit(&visited, 1, memory_order_relaxed);
+    return 0;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t folders = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FOLDERS;
+    int fanout = argc > 2 ? atoi(argv[2]) : DEFAULT_FANOUT;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    char file[] = "/tmp/save_bench.XXXXXX";
+    int fd = argc > 4 ? open(argv[4], O_RDWR | O_CREAT | O_TRUNC, 0644) : mkstemp(file);
+    if (fanout < 1 || threads < 1 || fd < 0) {
+        fprintf(stderr, "bad fanout, number of threads or file\n");
+        return 1;
+    }
+    if (argc <= 4)
+        unlink(file);
+
+    double start = now_seconds();
+    Tree *tree = tree_new();
+    build(tree, folders, fanout);
+    double build_time = now_seconds() - start;
+
+    start = now_seconds();
+    int code = tree_save(tree, fd);
+    double save_time = now_seconds() - start;
+    if (code != 0) {
+        fprintf(stderr, "tree_save: %s\n", strerror(code));
+        return 1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    tree_free(tree);
+
+    start = now_seconds();
+    Tree *loaded = tree_load_threads(fd, threads);
+    double load_time = now_seconds() - start;
+    if (loaded == NULL) {
+        fprintf(stderr, "tree_load: %s\n", strerror(errno));
+        return 1;
+    }
+    tree_walk(loaded, "/", count_folder, NULL, 1);
+    if (atomic_load(&visited) != folders + 1) {
+        fprintf(stderr, "loaded %zu folders instead of %zu\n", atomic_load(&visited) - 1,
+                folders);
+        return 1;
+    }
+    tree_free(loaded);
+    close(fd);
+
+    printf("folders,fanout,threads,file_bytes,build_seconds,save_seconds,load_seconds\n");
+    printf("%zu,%d,%d,%lld,%.3f,%.3f,%.3f\n", folders, fanout, threads, (long long) size,
+           build_time, save_time, load_time);
+    return 0;
+
+}
@@ -0,0 +1,139 @@
+// Benchmark of visiting every folder of a tree: recursive tree_list calls from
+// the root against tree_walk with a growing number of threads.
+//
+// Usage: walk_bench [folders] [fanout] [threads]
+// Builds a tree of `folders` folders, each with `fanout` subfolders until
+// there are enough, then visits all of them, first with tree_list and then
+// with tree_walk on 1, 2, 4, ... up to `threads` threads. Prints one CSV line
+// per run.
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../Tree.h"
+
+#define DEFAULT_FOLDERS 1000000
+#define DEFAULT_FANOUT 8
+#define DEFAULT_THREADS 8
+
+static atomic_size_t visited;
+
+static double now_seconds(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+
+}
+
+// Writes the name of the i-th subfolder to name.
+static size_t child_name(char *name, int i) {
+
+    size_t length = 0;
+    do {
+        name[length++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    return length;
+
+}
+
+// Creates folders breadth first below the root until there are `folders`.
+static void build(Tree *tree, size_t folders, int fanout) {
+
+    size_t capacity = folders + 1, head = 0, tail = 0;
+    char **queue = malloc(capacity * sizeof(char *));
+    if (queue == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(1);
+    }
+    queue[tail++] = strdup("/");
+    size_t created = 0;
+    while (created < folders) {
+        char *parent = queue[head++];
+        size_t length = strlen(parent);
+        for (int i = 0; i < fanout && created < folders; ++i) {
+            char path[MAX_PATH_LENGTH_UTILS + 1];
+            memcpy(path, parent, length);
+            size_t name_length = child_name(path + length, i);
+            path[length + name_length] = '/';
+            path[length + name_length + 1] = '\0';
+            tree_create(tree, path);
+            queue[tail++] = strdup(path);
+            created++;
+        }
+    }
+    for (size_t i = 0; i < tail; ++i)
+        free(queue[i]);
+    free(queue);
+
+}
+
+// Visits the folder at `path` and everything below it with tree_list.
+static void list_recursively(Tree *tree, char *path, size_t length) {
+
+    atomic_fetch_add_explicit(&visited, 1, memory_order_relaxed);
+    char *list = tree_list(tree, path);
+    if (list == NULL)
+        return;
+    for (char *name = list; *name;) {
+        char *end = strchr(name, ',');
+        size_t name_length = end ? (size_t) (end - name) : strlen(name);
+        memcpy(path + length, name, name_length);
+        path[length + name_length] = '/';
+        path[length + name_length + 1] = '\0';
+        list_recursively(tree, path, length + name_length + 1);
+        name = end ? end + 1 : name + name_length;
+    }
+    path[length] = '\0';
+    free(list);
+
+}
+
+static int count_folder(const char *path, void *context) {
+
+    (void) path;
+    (void) context;
+    atomic_fetch_add_explicit(&visited, 1, memory_order_relaxed);
+    return 0;
+
+}
+
+int main(int argc, char *argv[]) {
+
+    size_t folders = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_FOLDERS;
+    int fanout = argc > 2 ? atoi(argv[2]) : DEFAULT_FANOUT;
+    int max_threads = argc > 3 ? atoi(argv[3]) : DEFAULT_THREADS;
+    if (fanout < 1 || max_threads < 1) {
+        fprintf(stderr, "bad fanout or number of threads\n");
+        return 1;
+    }
+
+    Tree *tree = tree_new();
+    build(tree, folders, fanout);
+
+    printf("method,threads,folders,fanout,seconds,folders_per_sec\n");
+    char path[MAX_PATH_LENGTH_UTILS + 1] = "/";
+    atomic_store(&visited, 0);
+    double start = now_seconds();
+    list_recursively(tree, path, 1);
+    double time = now_seconds() - start;
+    printf("tree_list,1,%zu,%d,%.3f,%.0f\n", atomic_load(&visited), fanout, time,
+           atomic_load(&visited) / time);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        atomic_store(&visited, 0);
+        start = now_seconds();
+        tree_walk(tree, "/", count_folder, NULL, threads);
+        time = now_seconds() - start;
+        printf("tree_walk,%d,%zu,%d,%.3f,%.0f\n", threads, atomic_load(&visited), fanout,
+               time, atomic_load(&visited) / time);
+    }
+
+    tree_free(tree);
+    return 0;
+
+}
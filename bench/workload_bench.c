@@ -0,0 +1,513 @@
+// Workload benchmark: drives tree_list, tree_create, tree_remove and
+// tree_move from several threads with a chosen mix of operations and reports
+// throughput and latency percentiles per operation type.
+//
+// Usage: workload_bench [mix] [threads] [operations] [depth] [fanout] [cache]
+//                       [trace] [journal]
+// mix is one of:
+//   read   90% tree_list, 10% tree_create/tree_remove of leaves,
+//   churn  40% tree_create, 40% tree_remove, 20% tree_list,
+//   move   80% tree_move of a folder between top-level subtrees, 20% tree_list,
+//   disjoint  80% tree_move of a folder between two top-level subtrees only
+//          the thread uses (given a fanout of at least twice the threads),
+//          20% tree_list of one of them: moves whose only common ancestor is
+//          the root,
+//   hot    tree_create/tree_remove/tree_list all in one shared folder,
+//   top    95% tree_list of the root or a top-level folder, 5%
+//          tree_create/tree_remove in a top-level folder,
+//   all    every mix in turn (the default).
+// Each mix starts from a complete tree of `depth` levels of `fanout` folders
+// and every thread performs `operations` operations. cache is the number of
+// path cache entries (see tree_new_cached), 0 for none. In builds with
+// TREE_TRACE, the latest events are written to the file `trace` at the end
+// (see tree_trace_dump); "-" skips it. journal is off (the default), or the
+// durability policy of a journal of the changes (see tree_journal_start):
+// none, batched or each. The journal is a temporary file in the current
+// directory, so that it is synced to the disk the benchmark runs on.
+// Prints CSV: per mix, one line per operation type and one "all" line.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#ifndef HASHMAP_BACKEND_NAME
+#define HASHMAP_BACKEND_NAME "unknown"
+#endif
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPERATIONS 200000
+#define DEFAULT_DEPTH 4
+#define DEFAULT_FANOUT 8
+#define MAX_FOLDERS 10000000
+// Folders a thread created and has not removed yet.
+#define MAX_OWN 256
+
+typedef enum Op { LIST, CREATE, REMOVE, MOVE, N_OPS } Op;
+
+static const char *op_names[N_OPS] = {"list", "create", "remove", "move"};
+
+typedef enum Mix { READ, CHURN, CROSS_MOVE, DISJOINT_MOVE, HOT, TOP, N_MIXES } Mix;
+
+static const char *mix_names[N_MIXES] = {"read", "churn", "move", "disjoint", "hot",
+                                            "top"};
+
+// Journal policies, off first; the others in the order of TreeJournalSync.
+static const char *journal_names[] = {"off", "none", "batched", "each"};
+
+typedef struct Samples {
+    uint64_t *latencies; // In nanoseconds.
+    size_t count;
+    size_t capacity;
+    size_t errors;
+} Samples;
+
+typedef struct Worker {
+    pthread_t thread;
+    Tree *tree;
+    Mix mix;
+    int id;
+    unsigned int seed;
+    size_t operations;
+    Samples samples[N_OPS];
+    size_t created; // Names used so far.
+    char own[MAX_OWN][MAX_PATH_LENGTH_UTILS + 1];
+    size_t own_count;
+    char moving[MAX_PATH_LENGTH_UTILS + 1]; // Current path of the moved folder.
+    int subtree; // Index of the top-level folder it is in, -1 for the root.
+} Worker;
+
+static int depth, fanout;
+static int journal; // Index into journal_names.
+static pthread_barrier_t barrier;
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+// Makes room for `more` latencies.
+static void reserve(Samples *samples, size_t more) {
+
+    if (samples->count + more <= samples->capacity)
+        return;
+    if (samples->capacity == 0)
+        samples->capacity = 1024;
+    while (samples->capacity < samples->count + more)
+        samples->capacity *= 2;
+    samples->latencies = realloc(samples->latencies, samples->capacity * sizeof(uint64_t));
+    if (samples->latencies == NULL) {
+        fprintf(stderr, "realloc failed\n");
+        exit(1);
+    }
+
+}
+
+static void record(Samples *samples, uint64_t start, int failed) {
+
+    uint64_t latency = now_ns() - start;
+    reserve(samples, 1);
+    samples->latencies[samples->count++] = latency;
+    samples->errors += failed != 0;
+
+}
+
+// Appends the name of the i-th child of a folder of the initial tree.
+static size_t append_child(char *path, size_t length, int i) {
+
+    path[length++] = 'a' + i / 26;
+    path[length++] = 'a' + i % 26;
+    path[length++] = '/';
+    path[length] = '\0';
+    return length;
+
+}
+
+// Writes the path of a random folder of the initial tree, `levels` deep, with
+// a first name other than the one of index `avoid` (if it is in range).
+static size_t random_folder(Worker *worker, char *path, int levels, int avoid) {
+
+    size_t length = 1;
+    path[0] = '/';
+    path[1] = '\0';
+    for (int i = 0; i < levels; ++i) {
+        int child = rand_r(&worker->seed) % fanout;
+        if (i == 0 && child == avoid)
+            child = (child + 1) % fanout;
+        length = append_child(path, length, child);
+    }
+    return length;
+
+}
+
+// Appends a name no other thread uses and this one did not use yet.
+static void append_own_name(Worker *worker, char *path, size_t length) {
+
+    path[length++] = 'w';
+    path[length++] = 'a' + worker->id / 26;
+    path[length++] = 'a' + worker->id % 26;
+    size_t n = worker->created++;
+    do {
+        path[length++] = 'a' + n % 26;
+        n /= 26;
+    } while (n > 0);
+    path[length++] = '/';
+    path[length] = '\0';
+
+}
+
+static void list(Worker *worker, const char *path) {
+
+    uint64_t start = now_ns();
+    char *result = tree_list(worker->tree, path);
+    record(&worker->samples[LIST], start, result == NULL);
+    free(result);
+
+}
+
+// Creates a folder below `parent` and remembers it for remove_own.
+static void create_own(Worker *worker, const char *parent) {
+
+    char *path = worker->own[worker->own_count];
+    size_t length = strlen(parent);
+    memcpy(path, parent, length);
+    append_own_name(worker, path, length);
+    uint64_t start = now_ns();
+    int code = tree_create(worker->tree, path);
+    record(&worker->samples[CREATE], start, code);
+    if (code == 0)
+        worker->own_count++;
+
+}
+
+// Removes a random folder made by create_own.
+static void remove_own(Worker *worker) {
+
+    size_t i = rand_r(&worker->seed) % worker->own_count;
+    uint64_t start = now_ns();
+    int code = tree_remove(worker->tree, worker->own[i]);
+    record(&worker->samples[REMOVE], start, code);
+    worker->own_count--;
+    memcpy(worker->own[i], worker->own[worker->own_count], MAX_PATH_LENGTH_UTILS + 1);
+
+}
+
+// Creates or removes with equal odds, creating below `parent`.
+static void create_or_remove(Worker *worker, const char *parent) {
+
+    bool create = worker->own_count == 0 ||
+                  (worker->own_count < MAX_OWN && rand_r(&worker->seed) % 2 == 0);
+    if (create)
+        create_own(worker, parent);
+    else
+        remove_own(worker);
+
+}
+
+// Moves the worker's folder into a random folder of another top-level subtree.
+static void cross_move(Worker *worker) {
+
+    char target[MAX_PATH_LENGTH_UTILS + 1];
+    int levels = rand_r(&worker->seed) % depth + 1;
+    size_t length = random_folder(worker, target, levels, worker->subtree);
+    append_own_name(worker, target, length);
+    uint64_t start = now_ns();
+    int code = tree_move(worker->tree, worker->moving, target);
+    record(&worker->samples[MOVE], start, code);
+    if (code == 0) {
+        strcpy(worker->moving, target);
+        worker->subtree = (target[1] - 'a') * 26 + target[2] - 'a';
+    }
+
+}
+
+// Index of the i-th of the two top-level folders the worker moves between in
+// the disjoint mix.
+static int own_subtree(Worker *worker, int i) {
+
+    return (2 * worker->id + i) % fanout;
+
+}
+
+// Moves the worker's folder into a random folder of its other own top-level
+// subtree.
+static void disjoint_move(Worker *worker) {
+
+    char target[MAX_PATH_LENGTH_UTILS + 1] = "/";
+    int subtree = worker->subtree == own_subtree(worker, 0) ? own_subtree(worker, 1)
+                                                            : own_subtree(worker, 0);
+    size_t length = append_child(target, 1, subtree);
+    int levels = rand_r(&worker->seed) % depth;
+    for (int i = 0; i < levels; ++i)
+        length = append_child(target, length, rand_r(&worker->seed) % fanout);
+    append_own_name(worker, target, length);
+    uint64_t start = now_ns();
+    int code = tree_move(worker->tree, worker->moving, target);
+    record(&worker->samples[MOVE], start, code);
+    if (code == 0) {
+        strcpy(worker->moving, target);
+        worker->subtree = subtree;
+    }
+
+}
+
+static void step(Worker *worker) {
+
+    char path[MAX_PATH_LENGTH_UTILS + 1];
+    int choice = rand_r(&worker->seed) % 100;
+    switch (worker->mix) {
+        case READ:
+            random_folder(worker, path, rand_r(&worker->seed) % (depth + 1), -1);
+            if (choice < 90)
+                list(worker, path);
+            else
+                create_or_remove(worker, path);
+            break;
+        case CHURN:
+            random_folder(worker, path, rand_r(&worker->seed) % (depth + 1), -1);
+            if (choice < 80)
+                create_or_remove(worker, path);
+            else
+                list(worker, path);
+            break;
+        case CROSS_MOVE:
+            if (choice < 80) {
+                cross_move(worker);
+            } else {
+                random_folder(worker, path, rand_r(&worker->seed) % (depth + 1), -1);
+                list(worker, path);
+            }
+            break;
+        case DISJOINT_MOVE:
+            if (choice < 80) {
+                disjoint_move(worker);
+            } else {
+                strcpy(path, "/");
+                append_child(path, 1, own_subtree(worker, choice % 2));
+                list(worker, path);
+            }
+            break;
+        case HOT:
+            if (choice < 80)
+                create_or_remove(worker, "/hot/");
+            else
+                list(worker, "/hot/");
+            break;
+        case TOP:
+            random_folder(worker, path, 1, -1);
+            if (choice < 95)
+                list(worker, choice < 45 ? "/" : path);
+            else
+                create_or_remove(worker, path);
+            break;
+        default:
+            break;
+    }
+
+}
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    if (worker->mix == CROSS_MOVE) {
+        strcpy(worker->moving, "/");
+        append_own_name(worker, worker->moving, 1);
+        worker->subtree = -1;
+        tree_create(worker->tree, worker->moving);
+    } else if (worker->mix == DISJOINT_MOVE) {
+        strcpy(worker->moving, "/");
+        worker->subtree = own_subtree(worker, 0);
+        size_t length = append_child(worker->moving, 1, worker->subtree);
+        append_own_name(worker, worker->moving, length);
+        tree_create(worker->tree, worker->moving);
+    }
+    pthread_barrier_wait(&barrier);
+    for (size_t i = 0; i < worker->operations; ++i)
+        step(worker);
+    return NULL;
+
+}
+
+// Creates `levels` levels of `fanout` folders below `path`.
+static void fill(Tree *tree, char *path, size_t length, int levels) {
+
+    if (levels == 0)
+        return;
+    for (int i = 0; i < fanout; ++i) {
+        size_t child_length = append_child(path, length, i);
+        tree_create(tree, path);
+        fill(tree, path, child_length, levels - 1);
+    }
+    path[length] = '\0';
+
+}
+
+static int compare_latencies(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+
+}
+
+static uint64_t percentile(const Samples *samples, double p) {
+
+    if (samples->count == 0)
+        return 0;
+    size_t i = (size_t) (samples->count * p);
+    return samples->latencies[i < samples->count ? i : samples->count - 1];
+
+}
+
+static void print_line(Mix mix, int threads, size_t cache, const char *op,
+                       Samples *samples, double seconds) {
+
+    qsort(samples->latencies, samples->count, sizeof(uint64_t), compare_latencies);
+    printf("%s,%s,%d,%d,%d,%zu,%s,%s,%zu,%zu,%.0f,%llu,%llu,%llu\n", HASHMAP_BACKEND_NAME,
+           mix_names[mix], threads, depth, fanout, cache, journal_names[journal], op,
+           samples->count, samples->errors, samples->count / seconds,
+           (unsigned long long) percentile(samples, 0.5),
+           (unsigned long long) percentile(samples, 0.99),
+           (unsigned long long) percentile(samples, 0.999));
+
+}
+
+// Appends the samples of `from` to `to`.
+static void merge(Samples *to, const Samples *from) {
+
+    reserve(to, from->count);
+    memcpy(to->latencies + to->count, from->latencies, from->count * sizeof(uint64_t));
+    to->count += from->count;
+    to->errors += from->errors;
+
+}
+
+static void run(Mix mix, int threads, size_t operations, size_t cache) {
+
+    Tree *tree = cache > 0 ? tree_new_cached(cache) : tree_new();
+    char path[MAX_PATH_LENGTH_UTILS + 1] = "/";
+    fill(tree, path, 1, depth);
+    tree_create(tree, "/hot/");
+    int fd = -1;
+    if (journal > 0) {
+        char name[] = "workload_bench.journal.XXXXXX";
+        fd = mkstemp(name);
+        if (fd < 0 || unlink(name) != 0) {
+            perror("mkstemp");
+            exit(1);
+        }
+        int code = tree_journal_start(tree, fd, (TreeJournalSync) (journal - 1));
+        if (code != 0) {
+            fprintf(stderr, "tree_journal_start: %s\n", strerror(code));
+            exit(1);
+        }
+    }
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    if (workers == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+    if (pthread_barrier_init(&barrier, NULL, threads + 1) != 0) {
+        fprintf(stderr, "pthread_barrier_init failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; ++i) {
+        workers[i].tree = tree;
+        workers[i].mix = mix;
+        workers[i].id = i;
+        workers[i].seed = i + 1;
+        workers[i].operations = operations;
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; ++i)
+        pthread_join(workers[i].thread, NULL);
+    double seconds = (now_ns() - start) * 1e-9;
+    pthread_barrier_destroy(&barrier);
+
+    Samples all = {0};
+    for (int op = 0; op < N_OPS; ++op) {
+        Samples samples = {0};
+        for (int i = 0; i < threads; ++i)
+            merge(&samples, &workers[i].samples[op]);
+        if (samples.count > 0) {
+            merge(&all, &samples);
+            print_line(mix, threads, cache, op_names[op], &samples, seconds);
+        }
+        free(samples.latencies);
+        for (int i = 0; i < threads; ++i)
+            free(workers[i].samples[op].latencies);
+    }
+    print_line(mix, threads, cache, "all", &all, seconds);
+    fflush(stdout);
+    free(all.latencies);
+    free(workers);
+    tree_free(tree);
+    if (fd >= 0)
+        close(fd);
+
+}
+
+int main(int argc, char *argv[]) {
+
+    const char *mix = argc > 1 ? argv[1] : "all";
+    int threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    size_t operations = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_OPERATIONS;
+    depth = argc > 4 ? atoi(argv[4]) : DEFAULT_DEPTH;
+    fanout = argc > 5 ? atoi(argv[5]) : DEFAULT_FANOUT;
+    size_t cache = argc > 6 ? strtoul(argv[6], NULL, 10) : 0;
+    const char *trace = argc > 7 && strcmp(argv[7], "-") != 0 ? argv[7] : NULL;
+    journal = -1;
+    for (int i = 0; i < 4; ++i) {
+        if (strcmp(argc > 8 ? argv[8] : "off", journal_names[i]) == 0)
+            journal = i;
+    }
+
+    double folders = 1;
+    for (int i = 0; i < depth; ++i)
+        folders = folders * fanout + 1;
+    if (threads < 1 || threads > 676 || depth < 1 || depth > 32 || fanout < 1 ||
+        fanout > 676 || folders > MAX_FOLDERS || journal < 0) {
+        fprintf(stderr, "usage: %s [read|churn|move|disjoint|hot|top|all] "
+                        "[threads (1-676)] [operations] [depth (1-32)] [fanout (1-676)] "
+                        "[cache] [trace|-] [off|none|batched|each]\n"
+                        "with at most %d folders in the tree\n", argv[0], MAX_FOLDERS);
+        return 1;
+    }
+
+    printf("backend,mix,threads,depth,fanout,cache,journal,op,count,errors,ops_per_sec,"
+           "p50_ns,p99_ns,p999_ns\n");
+    bool found = false;
+    for (Mix i = 0; i < N_MIXES; ++i) {
+        if (strcmp(mix, "all") == 0 || strcmp(mix, mix_names[i]) == 0) {
+            found = true;
+            run(i, threads, operations, cache);
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown mix: %s\n", mix);
+        return 1;
+    }
+    if (trace) {
+        int code = tree_trace_dump(trace);
+        if (code != 0) {
+            fprintf(stderr, "tree_trace_dump: %s\n", strerror(code));
+            return 1;
+        }
+    }
+    return 0;
+
+}
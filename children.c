@@ -0,0 +1,327 @@
+#include "children.h"
+#include "hash.h"
+
+#include <string.h>
+
+// Layout of the shape word.
+#define COUNT_MASK 0xFFu
+#define LENGTH_SHIFT(i) (8 * ((i) + 1))
+
+// A map is given up once this many subfolders are left, and not right after
+// it is made, so that a folder going back and forth between CHILDREN_INLINE
+// and CHILDREN_INLINE + 1 subfolders does not move them every time.
+#define DEMOTE_AT (CHILDREN_INLINE - 1)
+
+static size_t count_of(unsigned int shape) {
+
+    return shape & COUNT_MASK;
+
+}
+
+static size_t length_of(unsigned int shape, size_t i) {
+
+    return (shape >> LENGTH_SHIFT(i)) & 0xFF;
+
+}
+
+// Names may be changed meanwhile by a writer, if the caller is an optimistic
+// lookup, so they are read word by word.
+static void load_names(Children *children, char *names) {
+
+    for (size_t i = 0; i < CHILDREN_NAME_WORDS; ++i) {
+        uint32_t word = atomic_load_explicit(&children->names[i], memory_order_relaxed);
+        memcpy(names + i * sizeof(word), &word, sizeof(word));
+    }
+
+}
+
+static void store_names(Children *children, const char *names) {
+
+    for (size_t i = 0; i < CHILDREN_NAME_WORDS; ++i) {
+        uint32_t word;
+        memcpy(&word, names + i * sizeof(word), sizeof(word));
+        atomic_store_explicit(&children->names[i], word, memory_order_relaxed);
+    }
+
+}
+
+// Returns the index of the inline subfolder named `name`, CHILDREN_INLINE if
+// there is none, or -1 if `shape` and `names` cannot be of one moment.
+static int find_inline(unsigned int shape, const char *names, const char *name,
+                       size_t length) {
+
+    size_t count = count_of(shape), offset = 0;
+    if (count > CHILDREN_INLINE)
+        return -1;
+    for (size_t i = 0; i < count; ++i) {
+        size_t name_length = length_of(shape, i);
+        if (offset + name_length > CHILDREN_NAME_BYTES)
+            return -1;
+        if (name_length == length && memcmp(names + offset, name, length) == 0)
+            return i;
+        offset += name_length;
+    }
+    return CHILDREN_INLINE;
+
+}
+
+// Sets the inline subfolders; values beyond `count` are cleared. The shape is
+// stored last, so that an optimistic lookup that reads it sees the rest.
+static void store_inline(Children *children, size_t count, const size_t *lengths,
+                         const char *names, void *const *values) {
+
+    store_names(children, names);
+    unsigned int shape = count;
+    for (size_t i = 0; i < CHILDREN_INLINE; ++i) {
+        atomic_store_explicit(&children->values[i], i < count ? values[i] : NULL,
+                              memory_order_release);
+        if (i < count)
+            shape |= lengths[i] << LENGTH_SHIFT(i);
+    }
+    atomic_store_explicit(&children->shape, shape, memory_order_release);
+
+}
+
+// Compares names like strcmp compares null-terminated ones.
+static int compare_names(const char *a, size_t a_length, const char *b, size_t b_length) {
+
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (result == 0 && a_length != b_length)
+        result = a_length < b_length ? -1 : 1;
+    return result;
+
+}
+
+// Adds a subfolder to `count` sorted ones described like in store_inline,
+// whose names take `used` bytes, keeping them sorted. They must fit.
+static void add_sorted(size_t count, size_t used, size_t *lengths, char *names,
+                       void **values, const char *name, size_t length, void *value) {
+
+    size_t i = count, offset = used;
+    while (i > 0 && compare_names(names + offset - lengths[i - 1], lengths[i - 1],
+                                  name, length) > 0) {
+        offset -= lengths[--i];
+        lengths[i + 1] = lengths[i];
+        values[i + 1] = values[i];
+    }
+    memmove(names + offset + length, names + offset, used - offset);
+    memcpy(names + offset, name, length);
+    lengths[i] = length;
+    values[i] = value;
+
+}
+
+void children_init(Children *children) {
+
+    atomic_init(&children->map, NULL);
+    for (size_t i = 0; i < CHILDREN_INLINE; ++i)
+        atomic_init(&children->values[i], NULL);
+    atomic_init(&children->shape, 0);
+    for (size_t i = 0; i < CHILDREN_NAME_WORDS; ++i)
+        atomic_init(&children->names[i], 0);
+
+}
+
+void children_free(Children *children) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        hmap_free(map);
+
+}
+
+void children_retire(Children *children) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        hmap_retire(map);
+
+}
+
+void *children_get(Children *children, const char *name, size_t length, uint64_t hash) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        return hmap_get_hashed(map, name, length, hash);
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_relaxed);
+    char names[CHILDREN_NAME_BYTES];
+    load_names(children, names);
+    int i = find_inline(shape, names, name, length);
+    return i >= 0 && i < CHILDREN_INLINE
+           ? atomic_load_explicit(&children->values[i], memory_order_relaxed) : NULL;
+
+}
+
+bool children_get_optimistic(Children *children, const char *name, size_t length,
+                             uint64_t hash, void **value) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_acquire);
+    if (map)
+        return hmap_get_optimistic_hashed(map, name, length, hash, value);
+    // Inline values are cleared before the folders they held can be freed, so
+    // whatever is read is a folder that existed during the epoch section.
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_acquire);
+    char names[CHILDREN_NAME_BYTES];
+    load_names(children, names);
+    int i = find_inline(shape, names, name, length);
+    if (i < 0)
+        return false;
+    *value = i < CHILDREN_INLINE
+             ? atomic_load_explicit(&children->values[i], memory_order_acquire) : NULL;
+    return true;
+
+}
+
+// Moves the inline subfolders to a new map.
+static HashMap *promote(Children *children, Arena *arena) {
+
+    HashMap *map = hmap_new_in(arena);
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_relaxed);
+    char names[CHILDREN_NAME_BYTES];
+    load_names(children, names);
+    size_t offset = 0;
+    for (size_t i = 0; i < count_of(shape); ++i) {
+        size_t length = length_of(shape, i);
+        void *value = atomic_load_explicit(&children->values[i], memory_order_relaxed);
+        hmap_insert_hashed(map, names + offset, length, hash_bytes(names + offset, length),
+                           value);
+        offset += length;
+    }
+    atomic_store_explicit(&children->map, map, memory_order_release);
+    store_inline(children, 0, NULL, names, NULL);
+    return map;
+
+}
+
+// Moves the subfolders of the map back inline if they fit, and retires it.
+static void demote(Children *children, HashMap *map) {
+
+    size_t count = 0, offset = 0;
+    size_t lengths[CHILDREN_INLINE];
+    void *values[CHILDREN_INLINE];
+    char names[CHILDREN_NAME_BYTES] = {0};
+    const char *key;
+    void *value;
+    HashMapIterator it = hmap_iterator(map);
+    while (hmap_next(map, &it, &key, &value)) {
+        size_t length = strlen(key);
+        if (count == CHILDREN_INLINE || offset + length > CHILDREN_NAME_BYTES)
+            return;
+        add_sorted(count++, offset, lengths, names, values, key, length, value);
+        offset += length;
+    }
+    store_inline(children, count, lengths, names, values);
+    atomic_store_explicit(&children->map, NULL, memory_order_release);
+    hmap_retire(map);
+
+}
+
+bool children_insert(Children *children, Arena *arena, const char *name, size_t length,
+                     uint64_t hash, void *value) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        return hmap_insert_hashed(map, name, length, hash, value);
+    if (!value || children_get(children, name, length, hash))
+        return false;
+
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_relaxed);
+    size_t count = count_of(shape), used = 0;
+    size_t lengths[CHILDREN_INLINE];
+    void *values[CHILDREN_INLINE];
+    for (size_t i = 0; i < count; ++i) {
+        lengths[i] = length_of(shape, i);
+        values[i] = atomic_load_explicit(&children->values[i], memory_order_relaxed);
+        used += lengths[i];
+    }
+    if (count == CHILDREN_INLINE || used + length > CHILDREN_NAME_BYTES)
+        return hmap_insert_hashed(promote(children, arena), name, length, hash, value);
+
+    char names[CHILDREN_NAME_BYTES];
+    load_names(children, names);
+    add_sorted(count, used, lengths, names, values, name, length, value);
+    store_inline(children, count + 1, lengths, names, values);
+    return true;
+
+}
+
+bool children_remove(Children *children, const char *name, size_t length, uint64_t hash) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map) {
+        if (!hmap_remove_hashed(map, name, length, hash))
+            return false;
+        if (hmap_size(map) <= DEMOTE_AT)
+            demote(children, map);
+        return true;
+    }
+
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_relaxed);
+    char names[CHILDREN_NAME_BYTES], kept[CHILDREN_NAME_BYTES] = {0};
+    load_names(children, names);
+    int removed = find_inline(shape, names, name, length);
+    if (removed < 0 || removed == CHILDREN_INLINE)
+        return false;
+    size_t count = 0, offset = 0, kept_length = 0;
+    size_t lengths[CHILDREN_INLINE];
+    void *values[CHILDREN_INLINE];
+    for (size_t i = 0; i < count_of(shape); ++i) {
+        size_t name_length = length_of(shape, i);
+        if ((int) i != removed) {
+            memcpy(kept + kept_length, names + offset, name_length);
+            kept_length += name_length;
+            lengths[count] = name_length;
+            values[count++] = atomic_load_explicit(&children->values[i],
+                                                   memory_order_relaxed);
+        }
+        offset += name_length;
+    }
+    store_inline(children, count, lengths, kept, values);
+    return true;
+
+}
+
+size_t children_size(Children *children) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        return hmap_size(map);
+    return count_of(atomic_load_explicit(&children->shape, memory_order_relaxed));
+
+}
+
+ChildrenIterator children_iterator(Children *children) {
+
+    ChildrenIterator it;
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map)
+        it.map = hmap_iterator(map);
+    else
+        load_names(children, it.names);
+    it.index = 0;
+    it.offset = 0;
+    return it;
+
+}
+
+bool children_next(Children *children, ChildrenIterator *it, const char **name,
+                   size_t *length, void **value) {
+
+    HashMap *map = atomic_load_explicit(&children->map, memory_order_relaxed);
+    if (map) {
+        if (!hmap_next(map, &it->map, name, value))
+            return false;
+        *length = strlen(*name);
+        return true;
+    }
+    unsigned int shape = atomic_load_explicit(&children->shape, memory_order_relaxed);
+    if (it->index >= count_of(shape))
+        return false;
+    *name = it->names + it->offset;
+    *length = length_of(shape, it->index);
+    *value = atomic_load_explicit(&children->values[it->index], memory_order_relaxed);
+    it->offset += *length;
+    it->index++;
+    return true;
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HashMap.h"
+#include "arena.h"
+
+// Subfolders of a folder by name, embedded in the folder.
+//
+// Up to CHILDREN_INLINE subfolders whose names take at most
+// CHILDREN_NAME_BYTES bytes together are kept in the structure itself, so
+// looking one up reads no memory other than the folder. A folder that gets
+// more is given a HashMap, which it keeps until it is down to
+// CHILDREN_INLINE - 1 subfolders that fit again.
+//
+// Inline subfolders are kept in strcmp order of their names, so iteration is
+// sorted whenever the map iterates in order (HASHMAP_SORTED, see HashMap.h).
+//
+// As with HashMap, lookups and iteration may run concurrently with each other
+// but not with changes; only children_get_optimistic may run concurrently
+// with changes.
+
+#define CHILDREN_INLINE 3
+#define CHILDREN_NAME_WORDS 5
+#define CHILDREN_NAME_BYTES (CHILDREN_NAME_WORDS * sizeof(uint32_t))
+
+typedef struct Children {
+    // Map of all subfolders, or NULL while they are inline.
+    _Atomic(HashMap *) map;
+    _Atomic(void *) values[CHILDREN_INLINE]; // NULL beyond the count.
+    // The number of inline subfolders in the lowest byte and the lengths of
+    // their names in the next ones, read at once by optimistic lookups.
+    atomic_uint shape;
+    // Names of the inline subfolders one after another, in the order of
+    // values, without separators.
+    atomic_uint names[CHILDREN_NAME_WORDS];
+} Children;
+
+void children_init(Children *children);
+
+// Frees the map, if there is one; folders are not freed.
+void children_free(Children *children);
+
+// Like children_free, but the map is released with hmap_retire.
+void children_retire(Children *children);
+
+// Returns the subfolder named by the first `length` bytes of `name`, whose
+// hash_bytes is `hash`, or NULL.
+void *children_get(Children *children, const char *name, size_t length, uint64_t hash);
+
+// Like children_get, with the guarantees and duties of hmap_get_optimistic.
+bool children_get_optimistic(Children *children, const char *name, size_t length,
+                             uint64_t hash, void **value);
+
+// Like hmap_insert_hashed. A map is allocated from `arena` if needed.
+bool children_insert(Children *children, Arena *arena, const char *name, size_t length,
+                     uint64_t hash, void *value);
+
+// Like hmap_remove_hashed.
+bool children_remove(Children *children, const char *name, size_t length, uint64_t hash);
+
+size_t children_size(Children *children);
+
+typedef struct ChildrenIterator {
+    HashMapIterator map;
+    size_t index;
+    size_t offset;
+    char names[CHILDREN_NAME_BYTES]; // Copy of the inline names.
+} ChildrenIterator;
+
+ChildrenIterator children_iterator(Children *children);
+
+// Like hmap_next, but the name is not null-terminated: its length is set in
+// `*length`. It stays valid until the subfolders change or `it` goes away.
+bool children_next(Children *children, ChildrenIterator *it, const char **name,
+                   size_t *length, void **value);
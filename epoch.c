@@ -0,0 +1,224 @@
+#include "epoch.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Objects retired while the global epoch is e are kept in a bag of the
+// retiring thread and freed once the global epoch reaches e + 2. The epoch only
+// advances when every thread inside a section entered it in the current epoch,
+// so by then all sections that could have seen the objects have ended.
+#define N_BAGS 3
+
+// A thread tries to advance the epoch after retiring this many objects.
+#define ADVANCE_INTERVAL 64
+
+#define CACHE_LINE 64
+
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+} Retired;
+
+typedef struct Bag {
+    uint64_t epoch; // Global epoch at which the objects were retired.
+    size_t size;
+    size_t capacity;
+    Retired *items;
+} Bag;
+
+typedef struct Record Record;
+
+// Per-thread state. Records are never freed; a record of an exited thread is
+// reused, bags included, by the next thread that needs one.
+struct Record {
+    // Epoch seen when entering the outermost section, shifted left by one,
+    // with the lowest bit set; zero outside sections.
+    _Atomic uint64_t state;
+    atomic_bool in_use;
+    Record *next;
+    int depth; // Nesting level of sections.
+    unsigned int retired_since_advance;
+    Bag bags[N_BAGS];
+};
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(Record *) records;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local Record *self;
+
+static void free_bag(Bag *bag) {
+
+    for (size_t i = 0; i < bag->size; ++i)
+        bag->items[i].free_fn(bag->items[i].ptr);
+    bag->size = 0;
+
+}
+
+// Frees the bags of `record` that are old enough.
+static void collect(Record *record) {
+
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+    for (int i = 0; i < N_BAGS; ++i) {
+        if (record->bags[i].size > 0 && record->bags[i].epoch + 2 <= epoch)
+            free_bag(&record->bags[i]);
+    }
+
+}
+
+static void release_record(void *arg) {
+
+    Record *record = arg;
+    collect(record);
+    atomic_store_explicit(&record->in_use, false, memory_order_release);
+
+}
+
+static void make_record_key(void) {
+
+    if (pthread_key_create(&record_key, release_record) != 0)
+        fatal("pthread_key_create failed");
+
+}
+
+static Record *get_record(void) {
+
+    if (self)
+        return self;
+
+    pthread_once(&record_key_once, make_record_key);
+    for (Record *record = atomic_load_explicit(&records, memory_order_acquire);
+         record; record = record->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&record->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&record->in_use, &expected, true)) {
+            self = record;
+            break;
+        }
+    }
+
+    if (!self) {
+        size_t size = (sizeof(Record) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        Record *record = aligned_alloc(CACHE_LINE, size);
+        if (record == NULL)
+            fatal("aligned_alloc failed");
+        memset(record, 0, size);
+        atomic_init(&record->state, 0);
+        atomic_init(&record->in_use, true);
+        record->next = atomic_load_explicit(&records, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&records, &record->next, record,
+                                                      memory_order_release,
+                                                      memory_order_relaxed));
+        self = record;
+    }
+
+    if (pthread_setspecific(record_key, self) != 0)
+        fatal("pthread_setspecific failed");
+    return self;
+
+}
+
+void epoch_enter(void) {
+
+    Record *record = get_record();
+    if (record->depth++ > 0)
+        return;
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_store_explicit(&record->state, (epoch << 1) | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+}
+
+void epoch_exit(void) {
+
+    Record *record = self;
+    if (--record->depth > 0)
+        return;
+    atomic_store_explicit(&record->state, 0, memory_order_release);
+
+}
+
+// Advances the global epoch if all threads inside sections have seen it.
+static void try_advance(void) {
+
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (Record *record = atomic_load_explicit(&records, memory_order_acquire);
+         record; record = record->next) {
+        // Acquire, so that reads done in a section that has ended happen
+        // before anything freed after the advance.
+        uint64_t state = atomic_load_explicit(&record->state, memory_order_acquire);
+        if ((state & 1) && (state >> 1) != epoch)
+            return;
+    }
+    atomic_compare_exchange_strong_explicit(&global_epoch, &epoch, epoch + 1,
+                                            memory_order_release,
+                                            memory_order_relaxed);
+
+}
+
+uint64_t epoch_stamp(void) {
+
+    // The memory must be unlinked before the epoch is read.
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&global_epoch, memory_order_relaxed);
+
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+
+    Record *record = get_record();
+    uint64_t epoch = epoch_stamp();
+
+    Bag *bag = &record->bags[epoch % N_BAGS];
+    if (bag->epoch != epoch) {
+        // The bag holds objects retired at least N_BAGS epochs ago.
+        free_bag(bag);
+        bag->epoch = epoch;
+    }
+    if (bag->size == bag->capacity) {
+        bag->capacity = bag->capacity ? 2 * bag->capacity : ADVANCE_INTERVAL;
+        bag->items = realloc(bag->items, bag->capacity * sizeof(Retired));
+        if (bag->items == NULL)
+            fatal("realloc failed");
+    }
+    bag->items[bag->size].ptr = ptr;
+    bag->items[bag->size].free_fn = free_fn;
+    bag->size++;
+
+    if (++record->retired_since_advance >= ADVANCE_INTERVAL && record->depth == 0) {
+        record->retired_since_advance = 0;
+        try_advance();
+        collect(record);
+    }
+
+}
+
+bool epoch_expired(uint64_t stamp) {
+
+    if (atomic_load_explicit(&global_epoch, memory_order_acquire) >= stamp + 2)
+        return true;
+    try_advance();
+    return atomic_load_explicit(&global_epoch, memory_order_acquire) >= stamp + 2;
+
+}
+
+void epoch_synchronize(void) {
+
+    uint64_t target = atomic_load_explicit(&global_epoch, memory_order_acquire) + 2;
+    for (;;) {
+        try_advance();
+        if (atomic_load_explicit(&global_epoch, memory_order_acquire) >= target)
+            break;
+        sched_yield();
+    }
+    if (self)
+        collect(self);
+
+}
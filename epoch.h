@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Epoch-based memory reclamation.
+//
+// Threads that read shared memory without holding locks do so between
+// epoch_enter and epoch_exit. Memory unlinked by a writer is passed to
+// epoch_retire instead of being freed directly; it is freed once every thread
+// that was between epoch_enter and epoch_exit at the time has left, so such
+// readers never touch freed memory.
+//
+// Sections may be nested. They should be short: a thread staying inside one
+// delays freeing of everything retired in the meantime.
+
+void epoch_enter(void);
+
+void epoch_exit(void);
+
+// Calls `free_fn(ptr)` once no thread can be reading `ptr` anymore.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+// For memory that is recycled by its owner rather than passed to
+// epoch_retire: epoch_stamp is called after the memory is unlinked and
+// epoch_expired(stamp) becomes true once no section can be reading it.
+// epoch_expired may advance the epoch.
+uint64_t epoch_stamp(void);
+
+bool epoch_expired(uint64_t stamp);
+
+// Waits until every section that was active at the time of the call has
+// ended. Must not be called from inside a section.
+void epoch_synchronize(void);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Fast, well-distributed 64-bit hash of a byte string, in the style of wyhash:
+// input words are folded with a 64x64->128 bit multiply, so every input bit
+// affects both halves of the result. Folder names are at most 255 bytes, so
+// there is no need for the multi-lane loop used for long inputs.
+
+#define HASH_SEED 0xa0761d6478bd642fULL
+#define HASH_P0 0xe7037ed1a0b428dbULL
+#define HASH_P1 0x8ebc6af09c88c6e3ULL
+#define HASH_P2 0x589965cc75374cc3ULL
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_bytes(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t seed = HASH_SEED;
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t shift = (len >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + shift);
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - shift);
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2)) ^ HASH_P0;
+}
+
+static inline uint64_t hash_string(const char *key) {
+    return hash_bytes(key, strlen(key));
+}
@@ -0,0 +1,447 @@
+#include "journal.h"
+#include "err.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The file is a JournalHeader followed by records, each a RecordHeader and
+// then the bytes of the path and of the target, in native byte order.
+#define JOURNAL_MAGIC "TREEJNL1"
+
+// Without syncing, the buffer is written out once it holds this much.
+#define JOURNAL_BUFFER (64 * 1024)
+
+typedef struct JournalHeader {
+    char magic[8];
+    uint32_t record_size; // sizeof(RecordHeader).
+    uint32_t reserved;
+} JournalHeader;
+
+typedef struct RecordHeader {
+    uint32_t checksum; // Of the rest of the record, see checksum.
+    uint16_t path_length;
+    uint16_t target_length;
+    uint8_t type;
+    uint8_t reserved[3];
+} RecordHeader;
+
+// Changes logged while a move or recursive remove was the latest one logged,
+// and that move or remove. Operations that started in an era and log their
+// change in a later one follow the paths through the changes in between.
+typedef struct Era {
+    size_t active; // Operations that started in the era and did not end.
+    // Move or recursive remove that ended the era; path is NULL until then.
+    JournalType type;
+    char *path;
+    char *target; // NULL unless type is JOURNAL_MOVE.
+} Era;
+
+struct Journal {
+    pthread_mutex_t lock;
+    pthread_cond_t written; // Broadcast when a batch is written.
+    char *buffer; // Records appended and not written yet.
+    size_t length, capacity;
+    char *batch; // Buffer of the batch being written.
+    size_t batch_capacity;
+    uint64_t appended; // Position after the last record appended.
+    uint64_t done; // Position after the last record written (and synced).
+    bool writing;
+    int error; // Of the first failed write or sync, then kept.
+    int fd;
+    TreeJournalSync sync;
+    // Eras still needed, the current one last; eras[i] is era first_era + i.
+    Era *eras;
+    size_t eras_count, eras_capacity;
+    uint64_t first_era;
+};
+
+// Checksum of a record, without its first field.
+static uint32_t checksum(const RecordHeader *header, const char *path, const char *target) {
+
+    const char *rest = (const char *) header + sizeof(header->checksum);
+    uint64_t hash = hash_bytes(rest, sizeof(RecordHeader) - sizeof(header->checksum));
+    hash ^= hash_bytes(path, header->path_length) * HASH_P1;
+    hash ^= hash_bytes(target, header->target_length) * HASH_P2;
+    return (uint32_t) (hash ^ (hash >> 32));
+
+}
+
+static void lock(Journal *journal) {
+
+    if (pthread_mutex_lock(&journal->lock) != 0)
+        syserr("lock failed");
+
+}
+
+static void unlock(Journal *journal) {
+
+    if (pthread_mutex_unlock(&journal->lock) != 0)
+        syserr("unlock failed");
+
+}
+
+// Returns 0 or the errno value of a failed write.
+static int write_all(int fd, const char *data, size_t size) {
+
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return errno;
+        data += written;
+        size -= written;
+    }
+    return 0;
+
+}
+
+Journal *journal_new(int fd, TreeJournalSync sync) {
+
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+        return NULL;
+    JournalHeader header = {JOURNAL_MAGIC, sizeof(RecordHeader), 0};
+    if (status.st_size == 0) {
+        int code = write_all(fd, (const char *) &header, sizeof(header));
+        if (code != 0) {
+            errno = code;
+            return NULL;
+        }
+    } else {
+        JournalHeader found;
+        if (pread(fd, &found, sizeof(found), 0) != sizeof(found) ||
+            memcmp(&found, &header, sizeof(header)) != 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+        if (lseek(fd, 0, SEEK_END) < 0)
+            return NULL;
+    }
+
+    Journal *journal = malloc(sizeof(Journal));
+    if (journal == NULL)
+        fatal("malloc failed");
+    if (pthread_mutex_init(&journal->lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&journal->written, 0) != 0)
+        syserr("cond init failed");
+    journal->buffer = NULL;
+    journal->length = journal->capacity = 0;
+    journal->batch = NULL;
+    journal->batch_capacity = 0;
+    journal->appended = journal->done = 0;
+    journal->writing = false;
+    journal->error = 0;
+    journal->fd = fd;
+    journal->sync = sync;
+    journal->eras = malloc(sizeof(Era));
+    if (journal->eras == NULL)
+        fatal("malloc failed");
+    journal->eras[0] = (Era) {0, JOURNAL_CREATE, NULL, NULL};
+    journal->eras_count = journal->eras_capacity = 1;
+    journal->first_era = 0;
+    return journal;
+
+}
+
+// Writes out the buffered records as one batch. Called with the lock held,
+// no batch being written and no error; appending goes on meanwhile.
+static void write_batch(Journal *journal, bool sync) {
+
+    journal->writing = true;
+    char *batch = journal->buffer;
+    size_t length = journal->length, capacity = journal->capacity;
+    uint64_t end = journal->appended;
+    journal->buffer = journal->batch;
+    journal->capacity = journal->batch_capacity;
+    journal->length = 0;
+    unlock(journal);
+
+    int code = write_all(journal->fd, batch, length);
+    if (code == 0 && sync && fdatasync(journal->fd) != 0)
+        code = errno;
+
+    lock(journal);
+    journal->batch = batch;
+    journal->batch_capacity = capacity;
+    if (code == 0)
+        journal->done = end;
+    else
+        journal->error = code;
+    journal->writing = false;
+    if (pthread_cond_broadcast(&journal->written) != 0)
+        syserr("cond broadcast failed");
+
+}
+
+static void wait_for_batch(Journal *journal) {
+
+    if (pthread_cond_wait(&journal->written, &journal->lock) != 0)
+        syserr("cond wait failed");
+
+}
+
+void journal_free(Journal *journal) {
+
+    lock(journal);
+    while (journal->writing)
+        wait_for_batch(journal);
+    if (journal->length > 0 && journal->error == 0)
+        write_batch(journal, journal->sync != TREE_SYNC_NONE);
+    unlock(journal);
+    if (pthread_cond_destroy(&journal->written) != 0)
+        syserr("cond destroy failed");
+    if (pthread_mutex_destroy(&journal->lock) != 0)
+        syserr("mutex destroy failed");
+    for (size_t i = 0; i < journal->eras_count; ++i) {
+        free(journal->eras[i].path);
+        free(journal->eras[i].target);
+    }
+    free(journal->eras);
+    free(journal->buffer);
+    free(journal->batch);
+    free(journal);
+
+}
+
+int journal_begin(Journal *journal, uint64_t *era) {
+
+    lock(journal);
+    int code = journal->error;
+    *era = journal->first_era + journal->eras_count - 1;
+    journal->eras[journal->eras_count - 1].active++;
+    unlock(journal);
+    return code;
+
+}
+
+bool journal_moved(Journal *journal, uint64_t *era) {
+
+    lock(journal);
+    uint64_t current = journal->first_era + journal->eras_count - 1;
+    unlock(journal);
+    bool moved = *era != current;
+    *era = current;
+    return moved;
+
+}
+
+void journal_end(Journal *journal, uint64_t era) {
+
+    lock(journal);
+    journal->eras[era - journal->first_era].active--;
+    // Only operations of an era need the change that ended it.
+    size_t unused = 0;
+    while (unused + 1 < journal->eras_count && journal->eras[unused].active == 0) {
+        free(journal->eras[unused].path);
+        free(journal->eras[unused].target);
+        unused++;
+    }
+    if (unused > 0) {
+        journal->eras_count -= unused;
+        journal->first_era += unused;
+        memmove(journal->eras, journal->eras + unused, journal->eras_count * sizeof(Era));
+    }
+    unlock(journal);
+
+}
+
+// Rewrites `path` (a buffer of MAX_PATH_LENGTH_UTILS + 1 bytes) to where its
+// folder is after `era` was ended. Returns false if the folder was removed
+// with the subtree, and sets *too_long if it moved deeper than a path reaches.
+static bool follow(const Era *era, char *path, bool *too_long) {
+
+    size_t length = strlen(era->path);
+    if (strncmp(path, era->path, length) != 0)
+        return true;
+    if (era->type == JOURNAL_REMOVE_RECURSIVE)
+        return false;
+    size_t target_length = strlen(era->target), rest = strlen(path + length);
+    if (target_length + rest > MAX_PATH_LENGTH_UTILS) {
+        *too_long = true;
+        return true;
+    }
+    memmove(path + target_length, path + length, rest + 1);
+    memcpy(path, era->target, target_length);
+    return true;
+
+}
+
+static char *copy_path(const char *path) {
+
+    char *copy = strdup(path);
+    if (copy == NULL)
+        fatal("strdup failed");
+    return copy;
+
+}
+
+int journal_append(Journal *journal, uint64_t era, JournalType type, const char *path,
+                   const char *target, uint64_t *position) {
+
+    *position = 0;
+    lock(journal);
+    uint64_t current = journal->first_era + journal->eras_count - 1;
+    char *moved = NULL;
+    if (era < current) {
+        // Folders the operation went through were moved or removed since.
+        moved = malloc(2 * (MAX_PATH_LENGTH_UTILS + 1));
+        if (moved == NULL)
+            fatal("malloc failed");
+        char *moved_target = moved + MAX_PATH_LENGTH_UTILS + 1;
+        strcpy(moved, path);
+        strcpy(moved_target, target ? target : "");
+        bool kept = true, too_long = false;
+        for (uint64_t i = era; i < current && kept; ++i) {
+            const Era *ended = &journal->eras[i - journal->first_era];
+            kept = follow(ended, moved, &too_long) &&
+                   (!target || follow(ended, moved_target, &too_long));
+        }
+        if (!kept || too_long) {
+            // The folders can be logged no more, so neither can later changes.
+            if (too_long && journal->error == 0)
+                journal->error = ENAMETOOLONG;
+            unlock(journal);
+            free(moved);
+            return too_long ? ENAMETOOLONG : 0;
+        }
+        path = moved;
+        target = target ? moved_target : NULL;
+    }
+
+    RecordHeader header = {0, strlen(path), target ? strlen(target) : 0, type, {0}};
+    header.checksum = checksum(&header, path, target ? target : "");
+    size_t size = sizeof(header) + header.path_length + header.target_length;
+    if (journal->length + size > journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity : JOURNAL_BUFFER;
+        while (capacity < journal->length + size)
+            capacity *= 2;
+        journal->buffer = realloc(journal->buffer, capacity);
+        if (journal->buffer == NULL)
+            fatal("realloc failed");
+        journal->capacity = capacity;
+    }
+    char *record = journal->buffer + journal->length;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), path, header.path_length);
+    if (target)
+        memcpy(record + sizeof(header) + header.path_length, target, header.target_length);
+    journal->length += size;
+    *position = journal->appended += size;
+
+    if (type == JOURNAL_MOVE || type == JOURNAL_REMOVE_RECURSIVE) {
+        Era *ended = &journal->eras[journal->eras_count - 1];
+        ended->type = type;
+        ended->path = copy_path(path);
+        ended->target = target ? copy_path(target) : NULL;
+        if (journal->eras_count == journal->eras_capacity) {
+            journal->eras_capacity *= 2;
+            journal->eras = realloc(journal->eras, journal->eras_capacity * sizeof(Era));
+            if (journal->eras == NULL)
+                fatal("realloc failed");
+        }
+        journal->eras[journal->eras_count++] = (Era) {0, JOURNAL_CREATE, NULL, NULL};
+    }
+    unlock(journal);
+    free(moved);
+    return 0;
+
+}
+
+int journal_commit(Journal *journal, uint64_t position) {
+
+    lock(journal);
+    switch (journal->sync) {
+        case TREE_SYNC_NONE:
+            if (!journal->writing && journal->error == 0 &&
+                journal->length >= JOURNAL_BUFFER)
+                write_batch(journal, false);
+            break;
+        case TREE_SYNC_BATCHED:
+            // The first thread to find no batch being written writes one for
+            // all records appended by then.
+            while (journal->done < position && journal->error == 0) {
+                if (journal->writing)
+                    wait_for_batch(journal);
+                else
+                    write_batch(journal, true);
+            }
+            break;
+        case TREE_SYNC_EACH:
+            while (journal->writing)
+                wait_for_batch(journal);
+            if (journal->error == 0)
+                write_batch(journal, true);
+            break;
+    }
+    // Without syncing, records are lost from the first failed write on.
+    int code = journal->done >= position && journal->sync != TREE_SYNC_NONE
+               ? 0 : journal->error;
+    unlock(journal);
+    return code;
+
+}
+
+int journal_replay(int fd, bool (*apply)(const JournalEntry *entry, void *context),
+                   void *context, size_t *applied) {
+
+    *applied = 0;
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+        return errno;
+    size_t size = status.st_size;
+    JournalHeader expected = {JOURNAL_MAGIC, sizeof(RecordHeader), 0};
+    if (size < sizeof(expected))
+        return EINVAL;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return errno;
+    if (memcmp(data, &expected, sizeof(expected)) != 0) {
+        munmap(data, size);
+        return EINVAL;
+    }
+
+    JournalEntry *entry = malloc(sizeof(JournalEntry));
+    if (entry == NULL)
+        fatal("malloc failed");
+    int code = 0;
+    size_t offset = sizeof(expected);
+    while (code == 0 && size - offset >= sizeof(RecordHeader)) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        const char *path = data + offset + sizeof(header);
+        size_t left = size - offset - sizeof(header);
+        if (header.path_length > MAX_PATH_LENGTH_UTILS ||
+            header.target_length > MAX_PATH_LENGTH_UTILS ||
+            header.path_length + header.target_length > left ||
+            header.checksum != checksum(&header, path, path + header.path_length))
+            break; // Cut short by a crash.
+        entry->type = header.type;
+        memcpy(entry->path, path, header.path_length);
+        entry->path[header.path_length] = '\0';
+        memcpy(entry->target, path + header.path_length, header.target_length);
+        entry->target[header.target_length] = '\0';
+        if (!apply(entry, context)) {
+            code = EINVAL;
+            break;
+        }
+        (*applied)++;
+        offset += sizeof(header) + header.path_length + header.target_length;
+    }
+    free(entry);
+    if (munmap(data, size) != 0)
+        syserr("munmap failed");
+
+    // Appending can go on after the last complete record.
+    if (code == 0 && offset < size && ftruncate(fd, offset) != 0)
+        code = errno;
+    return code;
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Tree.h"
+
+// Write-ahead log of changes to a tree, appended to a file.
+//
+// Records are appended to a buffer in memory, in the order the changes took
+// effect. A thread that needs its record on disk writes out everything
+// buffered so far as one batch, with one fdatasync, while the threads whose
+// records it carries wait for it (group commit). Each record carries a
+// checksum, so a record cut short by a crash is recognised and dropped.
+
+typedef enum JournalType {
+    JOURNAL_CREATE,
+    JOURNAL_CREATE_RECURSIVE,
+    JOURNAL_REMOVE,
+    JOURNAL_REMOVE_RECURSIVE,
+    JOURNAL_MOVE,
+} JournalType;
+
+typedef struct JournalEntry {
+    JournalType type;
+    char path[MAX_PATH_LENGTH_UTILS + 1];
+    char target[MAX_PATH_LENGTH_UTILS + 1]; // Empty unless type is JOURNAL_MOVE.
+} JournalEntry;
+
+typedef struct Journal Journal;
+
+// Starts appending to the journal in the file `fd`, after the records already
+// there; an empty file gets a header first. Returns NULL with errno set
+// (EINVAL if the file is not a journal).
+Journal *journal_new(int fd, TreeJournalSync sync);
+
+// Writes out the records still buffered, then frees the journal.
+void journal_free(Journal *journal);
+
+// Eras are numbered from 0 and each move or recursive remove appended ends
+// one. Changes that were looked up in one era and logged in a later one are
+// logged with the paths the moves and removes in between left them at.
+
+// Called when a change starts; the records of the eras from the one it
+// starts in on are kept until journal_end. Sets *era to the current era and
+// returns 0, or the errno value of the first failed write or sync, after
+// which no change should be made.
+int journal_begin(Journal *journal, uint64_t *era);
+
+// Returns whether an era later than *era started, and sets *era to the
+// current one.
+bool journal_moved(Journal *journal, uint64_t *era);
+
+// Called when a change that started in `era` ends.
+void journal_end(Journal *journal, uint64_t era);
+
+// Appends the record of a change that found its folders in `era`, not before
+// the one its journal_begin returned, and sets *position to the position just
+// after it. `target` is NULL unless type is JOURNAL_MOVE. A change inside a
+// subtree removed since is not appended, and *position is set to 0. Returns 0
+// or ENAMETOOLONG if a move since took the folders deeper than a path reaches.
+int journal_append(Journal *journal, uint64_t era, JournalType type, const char *path,
+                   const char *target, uint64_t *position);
+
+// Returns 0 once the records up to `position` are as durable as the policy of
+// the journal requires, or the errno value of the first failed write or sync.
+int journal_commit(Journal *journal, uint64_t position);
+
+// Calls `apply` for each record of the journal in the file `fd`, in order,
+// until it returns false. A record cut short at the end of the file is cut
+// off it. Sets *applied to the number of records applied and returns 0, an
+// errno value, or EINVAL if the file is not a journal or `apply` failed.
+int journal_replay(int fd, bool (*apply)(const JournalEntry *entry, void *context),
+                   void *context, size_t *applied);
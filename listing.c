@@ -0,0 +1,142 @@
+#include "listing.h"
+#include "err.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t listing_bytes(size_t count, size_t length) {
+
+    return sizeof(Listing) + count * sizeof(size_t) + length + 1;
+
+}
+
+typedef struct Name {
+    const char *text;
+    size_t length;
+} Name;
+
+#ifndef HASHMAP_SORTED
+// Orders names like strcmp orders null-terminated ones.
+static int compare_names(const void *a, const void *b) {
+
+    const Name *x = a, *y = b;
+    int result = memcmp(x->text, y->text, x->length < y->length ? x->length : y->length);
+    if (result == 0 && x->length != y->length)
+        result = x->length < y->length ? -1 : 1;
+    return result;
+
+}
+#endif
+
+Listing *listing_new(Arena *arena, Children *children) {
+
+    size_t count = children_size(children);
+    Name *names = malloc((count ? count : 1) * sizeof(Name));
+    if (names == NULL)
+        fatal("malloc failed");
+    size_t length = 0, i = 0;
+    void *value;
+    ChildrenIterator it = children_iterator(children);
+    while (children_next(children, &it, &names[i].text, &names[i].length, &value))
+        length += names[i++].length + 1;
+#ifndef HASHMAP_SORTED
+    qsort(names, count, sizeof(Name), compare_names);
+#endif
+    if (length > 0)
+        length--; // No comma after the last name.
+
+    Listing *listing = arena_alloc(arena, listing_bytes(count, length));
+    atomic_init(&listing->refs, 1);
+    listing->count = count;
+    listing->length = length;
+    listing->text = (char *) (listing->starts + count);
+
+    char *position = listing->text;
+    for (i = 0; i < count; ++i) {
+        listing->starts[i] = position - listing->text;
+        memcpy(position, names[i].text, names[i].length);
+        position += names[i].length;
+        *position++ = ',';
+    }
+    listing->text[length] = '\0';
+
+    free(names);
+    return listing;
+
+}
+
+void listing_acquire(Listing *listing) {
+
+    atomic_fetch_add_explicit(&listing->refs, 1, memory_order_relaxed);
+
+}
+
+void listing_release(Arena *arena, Listing *listing) {
+
+    if (atomic_fetch_sub_explicit(&listing->refs, 1, memory_order_acq_rel) == 1)
+        arena_release(arena, listing, listing_bytes(listing->count, listing->length));
+
+}
+
+char *listing_to_string(const Listing *listing) {
+
+    char *result = malloc(listing->length + 1);
+    if (result == NULL)
+        fatal("malloc failed");
+    memcpy(result, listing->text, listing->length + 1);
+    return result;
+
+}
+
+size_t listing_name_length(const Listing *listing, size_t i) {
+
+    size_t end = i + 1 < listing->count ? listing->starts[i + 1] - 1 : listing->length;
+    return end - listing->starts[i];
+
+}
+
+// Compares `key` with the i-th name like strcmp.
+static int compare_name(const Listing *listing, size_t i, const char *key) {
+
+    size_t length = listing_name_length(listing, i);
+    int result = strncmp(key, listing->text + listing->starts[i], length);
+    if (result == 0 && key[length] != '\0')
+        result = 1; // The name is a proper prefix of key.
+    return result;
+
+}
+
+size_t listing_find_after(const Listing *listing, const char *after) {
+
+    size_t low = 0, high = listing->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (compare_name(listing, middle, after) >= 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+
+}
+
+size_t listing_find(const Listing *listing, const char *name, size_t length) {
+
+    size_t low = 0, high = listing->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        size_t middle_length = listing_name_length(listing, middle);
+        int result = memcmp(name, listing->text + listing->starts[middle],
+                            length < middle_length ? length : middle_length);
+        if (result == 0 && length != middle_length)
+            result = length < middle_length ? -1 : 1;
+        if (result == 0)
+            return middle;
+        if (result < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return listing->count;
+
+}
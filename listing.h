@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "children.h"
+
+// Sorted, comma-separated names of the subfolders of a folder, cached in the
+// folder until its subfolders change. A listing never changes once built and
+// is shared by reference counting, so a reader can copy it after releasing
+// the folder's lock while a writer drops it from the folder.
+typedef struct Listing {
+    atomic_uint refs;
+    size_t count; // Number of names.
+    size_t length; // Length of text, excluding the terminating null character.
+    char *text; // Names in order, comma-separated, like make_map_contents_string.
+    size_t starts[]; // Offset of each name in text.
+} Listing;
+
+// Builds a listing of `children` in `arena`, with one reference.
+Listing *listing_new(Arena *arena, Children *children);
+
+void listing_acquire(Listing *listing);
+
+// Drops a reference, freeing the listing with the last one.
+void listing_release(Arena *arena, Listing *listing);
+
+// Returns a malloc'd copy of text.
+char *listing_to_string(const Listing *listing);
+
+// Returns the length of the i-th name.
+size_t listing_name_length(const Listing *listing, size_t i);
+
+// Returns the index of the first name greater than `after`, or count if none.
+size_t listing_find_after(const Listing *listing, const char *after);
+
+// Returns the index of the name equal to the first `length` bytes of `name`,
+// or count if there is none.
+size_t listing_find(const Listing *listing, const char *name, size_t length);
@@ -0,0 +1,464 @@
+#include "node_lock.h"
+#include "err.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Layout of the state word. Each count has room for more threads than a
+// process can have in practice; if one is full all the same, the thread waits
+// for room instead of failing.
+#define COUNT_BITS 20
+#define COUNT_MASK ((UINT64_C(1) << COUNT_BITS) - 1)
+#define READER UINT64_C(1) // Number of readers inside.
+#define READERS_MASK COUNT_MASK
+#define READERS_WAITING_SHIFT COUNT_BITS
+#define READER_WAITING (UINT64_C(1) << READERS_WAITING_SHIFT) // Number of readers waiting.
+#define READERS_WAITING_MASK (COUNT_MASK << READERS_WAITING_SHIFT)
+#define WRITER_WAITING (UINT64_C(1) << (2 * COUNT_BITS)) // Number of writers waiting.
+#define WRITERS_WAITING_MASK (COUNT_MASK << (2 * COUNT_BITS))
+#define WRITER (UINT64_C(1) << (3 * COUNT_BITS)) // A writer is inside.
+// Flipped whenever waiting readers are let in, so that they can tell
+// they were let in from a spurious wakeup.
+#define PHASE (UINT64_C(1) << (3 * COUNT_BITS + 1))
+#define IDLE_WAITERS (UINT64_C(1) << (3 * COUNT_BITS + 2)) // Someone waits in node_lock_wait_idle.
+
+// Everything except PHASE and IDLE_WAITERS; zero when nobody holds or waits.
+#define BUSY_MASK (READERS_MASK | READERS_WAITING_MASK | WRITERS_WAITING_MASK | WRITER)
+
+// Futex bitsets, so that readers, writers and idle waiters sleeping on the
+// same word can be woken separately.
+#define WAKE_READERS 1u
+#define WAKE_WRITERS 2u
+#define WAKE_IDLE 4u
+
+// Returns the sequence number to pass to wait, read before the state that
+// made the caller decide to wait.
+static unsigned int sequence(NodeLock *lock) {
+
+    return atomic_load_explicit(&lock->sequence, memory_order_acquire);
+
+}
+
+// Sleeps unless wake was called since `sequence` was read.
+static void wait(NodeLock *lock, unsigned int sequence, unsigned int bitset) {
+
+    if (syscall(SYS_futex, &lock->sequence, FUTEX_WAIT_BITSET_PRIVATE, sequence, NULL,
+                NULL, bitset) != 0 && errno != EAGAIN && errno != EINTR)
+        syserr("futex wait failed");
+
+}
+
+// Called after a change of the state that waiters in `bitset` wait for.
+static void wake(NodeLock *lock, int count, unsigned int bitset) {
+
+    atomic_fetch_add_explicit(&lock->sequence, 1, memory_order_release);
+    if (syscall(SYS_futex, &lock->sequence, FUTEX_WAKE_BITSET_PRIVATE, count, NULL, NULL,
+                bitset) < 0)
+        syserr("futex wake failed");
+
+}
+
+// Wakes node_lock_wait_idle callers after the lock became idle in `state`.
+static void wake_idle(NodeLock *lock, uint64_t state) {
+
+    if ((state & BUSY_MASK) == 0 && (state & IDLE_WAITERS)) {
+        atomic_fetch_and(&lock->state, ~IDLE_WAITERS);
+        wake(lock, INT_MAX, WAKE_IDLE);
+    }
+
+}
+
+void node_lock_init(NodeLock *lock) {
+
+    atomic_init(&lock->state, 0);
+    atomic_init(&lock->sequence, 0);
+
+}
+
+void node_lock_destroy(NodeLock *lock) {
+
+    (void) lock;
+
+}
+
+void node_lock_read(NodeLock *lock) {
+
+    uint64_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    for (;;) {
+        bool enter = !(state & (WRITER | WRITERS_WAITING_MASK));
+        uint64_t count = enter ? state & READERS_MASK : state & READERS_WAITING_MASK;
+        if (count == (enter ? READERS_MASK : READERS_WAITING_MASK)) {
+            sched_yield();
+            state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+            continue;
+        }
+        if (enter) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &lock->state, &state, state + READER,
+                    memory_order_acquire, memory_order_relaxed))
+                return;
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->state, &state, state + READER_WAITING,
+                memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+
+    // The writer letting us in moves us from waiting readers to readers
+    // inside and flips PHASE.
+    uint64_t phase = state & PHASE;
+    for (;;) {
+        unsigned int seen = sequence(lock);
+        state = atomic_load_explicit(&lock->state, memory_order_acquire);
+        if ((state & PHASE) != phase)
+            return;
+        wait(lock, seen, WAKE_READERS);
+    }
+
+}
+
+void node_unlock_read(NodeLock *lock) {
+
+    uint64_t state = atomic_fetch_sub_explicit(
+            &lock->state, READER, memory_order_release) - READER;
+    if (state & READERS_MASK)
+        return;
+    if (state & WRITERS_WAITING_MASK)
+        wake(lock, 1, WAKE_WRITERS);
+    else
+        wake_idle(lock, state);
+
+}
+
+void node_lock_write(NodeLock *lock) {
+
+    uint64_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    bool waiting = false;
+    for (;;) {
+        if (!(state & (READERS_MASK | WRITER))) {
+            uint64_t new_state = state | WRITER;
+            if (waiting)
+                new_state -= WRITER_WAITING;
+            if (atomic_compare_exchange_weak_explicit(
+                    &lock->state, &state, new_state,
+                    memory_order_acquire, memory_order_relaxed))
+                return;
+        } else if (!waiting) {
+            if ((state & WRITERS_WAITING_MASK) == WRITERS_WAITING_MASK) {
+                sched_yield();
+                state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+                continue;
+            }
+            if (atomic_compare_exchange_weak_explicit(
+                    &lock->state, &state, state + WRITER_WAITING,
+                    memory_order_relaxed, memory_order_relaxed))
+                waiting = true;
+        } else {
+            // Whoever lets writers in changes the state before the sequence.
+            unsigned int seen = sequence(lock);
+            state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+            if (state & (READERS_MASK | WRITER)) {
+                wait(lock, seen, WAKE_WRITERS);
+                state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+            }
+        }
+    }
+
+}
+
+void node_unlock_write(NodeLock *lock) {
+
+    uint64_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    for (;;) {
+        uint64_t new_state = state & ~WRITER;
+        if (state & READERS_WAITING_MASK) {
+            // Let in all waiting readers at once.
+            uint64_t waiting = (state & READERS_WAITING_MASK) >> READERS_WAITING_SHIFT;
+            new_state = ((new_state & ~READERS_WAITING_MASK) + waiting * READER) ^ PHASE;
+        }
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->state, &state, new_state,
+                memory_order_release, memory_order_relaxed)) {
+            state = new_state;
+            break;
+        }
+    }
+
+    if (state & READERS_MASK)
+        wake(lock, INT_MAX, WAKE_READERS);
+    else if (state & WRITERS_WAITING_MASK)
+        wake(lock, 1, WAKE_WRITERS);
+    else
+        wake_idle(lock, state);
+
+}
+
+bool node_try_lock_read(NodeLock *lock) {
+
+    uint64_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    while (!(state & (WRITER | WRITERS_WAITING_MASK)) &&
+           (state & READERS_MASK) != READERS_MASK) {
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->state, &state, state + READER,
+                memory_order_acquire, memory_order_relaxed))
+            return true;
+    }
+    return false;
+
+}
+
+bool node_try_lock_write(NodeLock *lock) {
+
+    uint64_t state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    while (!(state & (READERS_MASK | WRITER))) {
+        if (atomic_compare_exchange_weak_explicit(
+                &lock->state, &state, state | WRITER,
+                memory_order_acquire, memory_order_relaxed))
+            return true;
+    }
+    return false;
+
+}
+
+void node_lock_wait_idle(NodeLock *lock) {
+
+    for (;;) {
+        unsigned int seen = sequence(lock);
+        uint64_t state = atomic_load_explicit(&lock->state, memory_order_acquire);
+        if (!(state & BUSY_MASK))
+            return;
+        if (!(state & IDLE_WAITERS)) {
+            atomic_compare_exchange_weak_explicit(&lock->state, &state, state | IDLE_WAITERS,
+                                                  memory_order_relaxed, memory_order_relaxed);
+            continue;
+        }
+        wait(lock, seen, WAKE_IDLE);
+    }
+
+}
+
+bool node_lock_idle(NodeLock *lock) {
+
+    return (atomic_load_explicit(&lock->state, memory_order_acquire) & BUSY_MASK) == 0;
+
+}
+
+bool node_lock_shared(NodeLock *lock) {
+
+    return (atomic_load_explicit(&lock->state, memory_order_relaxed) & READERS_MASK) > READER;
+
+}
+
+#else
+
+void node_lock_init(NodeLock *lock) {
+
+    if (pthread_mutex_init(&lock->lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&lock->readers, 0) != 0)
+        syserr("cond init 1 failed");
+    if (pthread_cond_init(&lock->writers, 0) != 0)
+        syserr("cond init 2 failed");
+    if (pthread_cond_init(&lock->wait_for_node, 0) != 0)
+        syserr("cond init 3 failed");
+
+    lock->rcount = 0;
+    lock->wcount = 0;
+    lock->rwait = 0;
+    lock->wwait = 0;
+    lock->change = 0;
+
+}
+
+void node_lock_destroy(NodeLock *lock) {
+
+    if (pthread_cond_destroy(&lock->readers) != 0)
+        syserr("cond destroy 1 failed");
+    if (pthread_cond_destroy(&lock->writers) != 0)
+        syserr("cond destroy 2 failed");
+    if (pthread_cond_destroy(&lock->wait_for_node) != 0)
+        syserr("cond destroy 3 failed");
+    if (pthread_mutex_destroy(&lock->lock) != 0)
+        syserr("mutex destroy failed");
+
+}
+
+void node_lock_read(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    while (lock->change <= 0 && (lock->wcount > 0 || lock->wwait > 0)) {
+        lock->rwait++;
+        if (pthread_cond_wait(&lock->readers, &lock->lock) != 0)
+            syserr("cond wait failed");
+        lock->rwait--;
+    }
+
+    lock->rcount++;
+
+    if (lock->change > 0)
+        lock->change--;
+
+    if (lock->change > 0) {
+        if (pthread_cond_signal(&lock->readers) != 0)
+            syserr("cond signal failed");
+    }
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+
+}
+
+void node_unlock_read(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    lock->rcount--;
+
+    if (lock->rcount == 0 && lock->wwait > 0) {
+        lock->change = -1;
+        if (pthread_cond_signal(&lock->writers) != 0)
+            syserr("cond signal failed");
+    } else if (lock->rcount == 0) {
+        if (pthread_cond_signal(&lock->wait_for_node) != 0)
+            syserr("cond signal failed");
+    }
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+
+}
+
+void node_lock_write(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    while (lock->change != -1 && (lock->wcount > 0 || lock->rcount > 0)) {
+        lock->wwait++;
+        if (pthread_cond_wait(&lock->writers, &lock->lock) != 0)
+            syserr("cond wait failed");
+        lock->wwait--;
+    }
+
+    lock->wcount++;
+    lock->change = 0;
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+
+}
+
+void node_unlock_write(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    lock->wcount--;
+
+    if (lock->rwait > 0) {
+        lock->change = lock->rwait;
+        if (pthread_cond_signal(&lock->readers) != 0)
+            syserr("cond signal failed");
+    } else if (lock->wwait > 0) {
+        lock->change = -1;
+        if (pthread_cond_signal(&lock->writers) != 0)
+            syserr("cond signal failed");
+    } else if (pthread_cond_signal(&lock->wait_for_node) != 0) {
+            syserr("cond signal failed");
+    }
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+
+}
+
+bool node_try_lock_read(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    // Readers being let in by a writer (change > 0) are not overtaken.
+    bool free = lock->change <= 0 && lock->wcount == 0 && lock->wwait == 0;
+    if (free)
+        lock->rcount++;
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+    return free;
+
+}
+
+bool node_try_lock_write(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    // Waiting readers and writers do not stop it (see node_lock.h), but
+    // readers being let in by a writer (change > 0) count as inside.
+    bool free = lock->rcount == 0 && lock->wcount == 0 && lock->change <= 0;
+    if (free) {
+        lock->wcount++;
+        lock->change = 0;
+    }
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+    return free;
+
+}
+
+void node_lock_wait_idle(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr ("lock failed");
+
+    while (lock->rcount > 0 || lock->rwait > 0 || lock->wcount > 0 ||
+           lock->wwait > 0) {
+        if (pthread_cond_wait(&lock->wait_for_node, &lock->lock) != 0)
+            syserr ("cond wait failed");
+    }
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr ("unlock failed");
+
+}
+
+bool node_lock_idle(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    bool idle = lock->rcount == 0 && lock->rwait == 0 && lock->wcount == 0 &&
+                lock->wwait == 0;
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+    return idle;
+
+}
+
+bool node_lock_shared(NodeLock *lock) {
+
+    if (pthread_mutex_lock(&lock->lock) != 0)
+        syserr("lock failed");
+
+    bool shared = lock->rcount > 1;
+
+    if (pthread_mutex_unlock(&lock->lock) != 0)
+        syserr("unlock failed");
+    return shared;
+
+}
+
+#endif
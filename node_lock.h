@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Readers-writers lock guarding a single folder.
+//
+// Readers are let in as long as no writer is inside or waiting. When a writer
+// leaves, all readers that were waiting for it enter together, before any
+// waiting writer; when the last reader leaves, a waiting writer is woken.
+// node_lock_wait_idle additionally lets a thread wait until nobody is inside
+// or waiting for the lock.
+//
+// On Linux the lock is a 64-bit state word, with counts of readers inside,
+// readers waiting and writers waiting, and a 32-bit sequence word that waiting
+// threads sleep on with futexes and that is bumped before they are woken.
+// Taking or releasing the lock without contention is a single atomic
+// operation on the state. Elsewhere it falls back to a mutex and condition
+// variables.
+
+#ifdef __linux__
+
+#include <stdatomic.h>
+
+typedef struct NodeLock {
+    _Atomic uint64_t state;
+    atomic_uint sequence;
+} NodeLock;
+
+#else
+
+#include <pthread.h>
+
+typedef struct NodeLock {
+    pthread_mutex_t lock;
+    pthread_cond_t readers;
+    pthread_cond_t writers;
+    // Condtion on which a node is going to wait until all operations working
+    // or waiting in node are executed.
+    pthread_cond_t wait_for_node;
+    int rcount, wcount, rwait, wwait;
+    // Helps with recognising if a reader/writer should go to critical section,
+    // especially after being awaken.
+    int change;
+} NodeLock;
+
+#endif
+
+void node_lock_init(NodeLock *lock);
+
+void node_lock_destroy(NodeLock *lock);
+
+void node_lock_read(NodeLock *lock);
+
+void node_unlock_read(NodeLock *lock);
+
+void node_lock_write(NodeLock *lock);
+
+void node_unlock_write(NodeLock *lock);
+
+// Like node_lock_read and node_lock_write, but return false instead of
+// waiting if the lock cannot be taken at once. A reader can take it when no
+// writer holds it or waits for it; a writer when nobody holds it, counting the
+// readers a leaving writer let in, whether or not others wait for it.
+bool node_try_lock_read(NodeLock *lock);
+
+bool node_try_lock_write(NodeLock *lock);
+
+// Waits until no thread holds or waits for the lock.
+void node_lock_wait_idle(NodeLock *lock);
+
+// Returns whether no thread holds or waits for the lock right now.
+bool node_lock_idle(NodeLock *lock);
+
+// Returns whether other readers hold the lock too. Called by a reader holding
+// it.
+bool node_lock_shared(NodeLock *lock);
@@ -0,0 +1,153 @@
+#include "path_cache.h"
+#include "err.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Counters are spread over this many cache lines, so that threads counting
+// hits do not contend on one.
+#define COUNTER_SHARDS 16
+
+#define CACHE_LINE 64
+
+// Each entry is a seqlock: `sequence` is odd while the entry is written.
+typedef struct Entry {
+    atomic_uint sequence;
+    _Atomic uint64_t key;
+    _Atomic uint64_t generation;
+    _Atomic(void *) value;
+} Entry;
+
+typedef struct Counters {
+    _Alignas(CACHE_LINE) _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+} Counters;
+
+struct PathCache {
+    _Alignas(CACHE_LINE) _Atomic uint64_t generation;
+    _Atomic uint64_t invalidations;
+    _Alignas(CACHE_LINE) Counters counters[COUNTER_SHARDS];
+    size_t mask;
+    Entry *entries;
+};
+
+static atomic_uint next_shard;
+static _Thread_local int shard_index = -1;
+
+static Counters *my_counters(PathCache *cache) {
+
+    if (shard_index < 0)
+        shard_index = atomic_fetch_add(&next_shard, 1) % COUNTER_SHARDS;
+    return &cache->counters[shard_index];
+
+}
+
+PathCache *path_cache_new(size_t entries) {
+
+    size_t capacity = 1;
+    while (capacity < entries)
+        capacity <<= 1;
+    PathCache *cache = aligned_alloc(CACHE_LINE, sizeof(PathCache));
+    if (cache == NULL)
+        fatal("aligned_alloc failed");
+    memset(cache, 0, sizeof(PathCache));
+    // Generation 0 is never current, so zeroed entries are never found.
+    atomic_init(&cache->generation, 1);
+    cache->mask = capacity - 1;
+    cache->entries = calloc(capacity, sizeof(Entry));
+    if (cache->entries == NULL)
+        fatal("calloc failed");
+    return cache;
+
+}
+
+void path_cache_free(PathCache *cache) {
+
+    free(cache->entries);
+    free(cache);
+
+}
+
+uint64_t path_cache_generation(PathCache *cache) {
+
+    return atomic_load_explicit(&cache->generation, memory_order_acquire);
+
+}
+
+void path_cache_invalidate(PathCache *cache) {
+
+    atomic_fetch_add(&cache->generation, 1);
+    atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+
+}
+
+// Returns the value stored under key with generation, or NULL.
+static void *lookup(PathCache *cache, uint64_t key, uint64_t generation) {
+
+    Entry *entry = &cache->entries[key & cache->mask];
+    unsigned int sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+    if (sequence & 1)
+        return NULL;
+    bool match = atomic_load_explicit(&entry->key, memory_order_relaxed) == key &&
+                 atomic_load_explicit(&entry->generation, memory_order_relaxed) == generation;
+    void *value = atomic_load_explicit(&entry->value, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (!match || atomic_load_explicit(&entry->sequence, memory_order_relaxed) != sequence)
+        return NULL;
+    return value;
+
+}
+
+void *path_cache_find(PathCache *cache, const uint64_t *keys, size_t n,
+                      uint64_t generation, size_t *index) {
+
+    Counters *counters = my_counters(cache);
+    for (size_t i = n; i-- > 0;) {
+        void *value = lookup(cache, keys[i], generation);
+        if (value != NULL) {
+            *index = i;
+            atomic_fetch_add_explicit(&counters->hits, 1, memory_order_relaxed);
+            return value;
+        }
+    }
+    atomic_fetch_add_explicit(&counters->misses, 1, memory_order_relaxed);
+    return NULL;
+
+}
+
+void path_cache_put(PathCache *cache, uint64_t key, void *value, uint64_t generation) {
+
+    Entry *entry = &cache->entries[key & cache->mask];
+    unsigned int sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+    if (sequence & 1)
+        return;
+    // Hot entries are usually up to date already; do not write them again.
+    if (atomic_load_explicit(&entry->key, memory_order_relaxed) == key &&
+        atomic_load_explicit(&entry->generation, memory_order_relaxed) == generation &&
+        atomic_load_explicit(&entry->value, memory_order_relaxed) == value)
+        return;
+    if (!atomic_compare_exchange_strong_explicit(&entry->sequence, &sequence, sequence + 1,
+                                                 memory_order_acquire, memory_order_relaxed))
+        return;
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&entry->key, key, memory_order_relaxed);
+    atomic_store_explicit(&entry->generation, generation, memory_order_relaxed);
+    atomic_store_explicit(&entry->value, value, memory_order_relaxed);
+    atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+
+}
+
+void path_cache_stats(PathCache *cache, PathCacheStats *stats) {
+
+    stats->hits = 0;
+    stats->misses = 0;
+    for (int i = 0; i < COUNTER_SHARDS; ++i) {
+        stats->hits += atomic_load_explicit(&cache->counters[i].hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&cache->counters[i].misses,
+                                              memory_order_relaxed);
+    }
+    stats->invalidations = atomic_load_explicit(&cache->invalidations, memory_order_relaxed);
+
+}
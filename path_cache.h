@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded, direct-mapped cache from path prefixes (by hash) to folders, shared
+// by all threads without locks.
+//
+// Entries are stamped with the generation current when they were added and
+// only found while it has not changed. Everything that can make a cached
+// folder end up at another path, or be freed, must call
+// path_cache_invalidate before doing it, and a thread using a folder found in
+// the cache has to check afterwards that the generation did not change.
+
+typedef struct PathCache PathCache;
+
+typedef struct PathCacheStats {
+    uint64_t hits; // Lookups that found an entry.
+    uint64_t misses;
+    uint64_t invalidations;
+} PathCacheStats;
+
+// `entries` is rounded up to a power of two.
+PathCache *path_cache_new(size_t entries);
+
+void path_cache_free(PathCache *cache);
+
+uint64_t path_cache_generation(PathCache *cache);
+
+// Makes all entries stale. Sequentially consistent, so that a thread either
+// sees the new generation or is seen by the caller's later loads.
+void path_cache_invalidate(PathCache *cache);
+
+// Looks up keys[n - 1], keys[n - 2], ... down to keys[0] and returns the value
+// of the first one found with `generation`, setting *index to its index, or
+// returns NULL. Counts one hit or miss.
+void *path_cache_find(PathCache *cache, const uint64_t *keys, size_t n,
+                      uint64_t generation, size_t *index);
+
+// Adds an entry, replacing whatever has the same slot. Entries being written
+// by other threads are left alone.
+void path_cache_put(PathCache *cache, uint64_t key, void *value, uint64_t generation);
+
+void path_cache_stats(PathCache *cache, PathCacheStats *stats);
@@ -1,13 +1,15 @@
 // File provided by the author of a project.
 
 #include "path_utils.h"
+#include "err.h"
+#include "hash.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-bool is_path_valid(const char *path) {
+bool is_path_valid_scalar(const char *path) {
 
     size_t len = strlen(path);
     if (len == 0 || len > MAX_PATH_LENGTH_UTILS)
@@ -30,6 +32,268 @@ bool is_path_valid(const char *path) {
 
 }
 
+// State of a scan, carried from one block to the next.
+typedef struct PathScan {
+    ptrdiff_t last_slash; // Offset of the last '/' seen.
+    uint16_t *slashes; // Where to record the offsets of '/', or NULL.
+    size_t capacity; // Number of offsets that fit in `slashes`.
+    size_t count; // Number of offsets recorded.
+} PathScan;
+
+// Moves the offsets recorded so far to memory that fits those of any path.
+static void grow_slashes(PathScan *scan) {
+
+    uint16_t *slashes = malloc((MAX_PATH_DEPTH_UTILS + 1) * sizeof(uint16_t));
+    if (slashes == NULL)
+        fatal("malloc failed");
+    memcpy(slashes, scan->slashes, scan->count * sizeof(uint16_t));
+    scan->slashes = slashes;
+    scan->capacity = MAX_PATH_DEPTH_UTILS + 1;
+
+}
+
+// Like scan_path, byte by byte.
+static bool scan_scalar(const char *path, PathScan *scan) {
+
+    if (!is_path_valid_scalar(path))
+        return false;
+    for (size_t i = 0; scan->slashes && path[i]; ++i) {
+        if (path[i] != '/')
+            continue;
+        if (scan->count == scan->capacity)
+            grow_slashes(scan);
+        scan->slashes[scan->count++] = i;
+    }
+    return true;
+
+}
+
+// Width of the implementation set by path_force_width, or -1.
+static int forced_width = -1;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The vectorized validators read the path in aligned blocks, which never cross
+// a page boundary but may read past the terminating null character, so they
+// are hidden from sanitizers.
+#define READS_PAST_END __attribute__((no_sanitize("address", "thread")))
+
+enum { SCAN_INVALID, SCAN_VALID, SCAN_MORE };
+
+// Checks the block starting `base` bytes into the path (base may be negative
+// for the first block, whose bytes before the path are already cleared from
+// the masks). Bit i of a mask describes byte i of the block: `zero` marks null
+// characters, `slash` marks '/' and `other` marks bytes that are neither '/'
+// nor 'a'-'z'.
+static inline int scan_block(PathScan *scan, ptrdiff_t base, uint32_t zero,
+                             uint32_t slash, uint32_t other) {
+
+    ptrdiff_t length = -1;
+    if (zero) {
+        uint32_t end = __builtin_ctz(zero);
+        length = base + end;
+        slash &= (1u << end) - 1;
+        other &= (1u << end) - 1;
+    }
+    if (other)
+        return SCAN_INVALID;
+    if (slash) {
+        // Two '/' in a row make an empty name.
+        uint32_t previous = slash << 1 | (scan->last_slash == base - 1);
+        if (slash & previous)
+            return SCAN_INVALID;
+        ptrdiff_t first = base + __builtin_ctz(slash);
+        if (first - scan->last_slash - 1 > MAX_FOLDER_NAME_LENGTH_UTILS)
+            return SCAN_INVALID;
+        scan->last_slash = base + 31 - __builtin_clz(slash);
+        for (; scan->slashes && slash; slash &= slash - 1) {
+            if (scan->count == scan->capacity) {
+                if (scan->capacity > MAX_PATH_DEPTH_UTILS)
+                    return SCAN_INVALID;
+                grow_slashes(scan);
+            }
+            scan->slashes[scan->count++] = base + __builtin_ctz(slash);
+        }
+    }
+    if (length >= 0)
+        return length <= MAX_PATH_LENGTH_UTILS && scan->last_slash == length - 1
+               ? SCAN_VALID : SCAN_INVALID;
+    // Too long names are found at the next '/', too long paths here.
+    return base >= MAX_PATH_LENGTH_UTILS ? SCAN_INVALID : SCAN_MORE;
+
+}
+
+READS_PAST_END __attribute__((target("sse2")))
+static bool scan_sse2(const char *path, PathScan *scan) {
+
+    if (path[0] != '/')
+        return false;
+    const char *block = (const char *) ((uintptr_t) path & ~(uintptr_t) 15);
+    uint32_t skip = ~0u << (path - block); // Bytes before the path are not checked.
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i slash = _mm_set1_epi8('/');
+    // Shifts 'a'-'z' to the lowest signed values, so one comparison finds them.
+    const __m128i shift = _mm_set1_epi8((char) (0x80 - 'a'));
+    const __m128i letters_end = _mm_set1_epi8((char) (-128 + 26));
+    for (;; block += 16, skip = ~0u) {
+        __m128i bytes = _mm_load_si128((const __m128i *) block);
+        uint32_t zero_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, nul)) & skip;
+        uint32_t slash_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, slash)) & skip;
+        uint32_t letter_mask = _mm_movemask_epi8(
+                _mm_cmplt_epi8(_mm_add_epi8(bytes, shift), letters_end));
+        uint32_t other_mask = ~(letter_mask | slash_mask | zero_mask) & skip & 0xFFFF;
+        int result = scan_block(scan, block - path, zero_mask, slash_mask, other_mask);
+        if (result != SCAN_MORE)
+            return result == SCAN_VALID;
+    }
+
+}
+
+READS_PAST_END __attribute__((target("avx2")))
+static bool scan_avx2(const char *path, PathScan *scan) {
+
+    if (path[0] != '/')
+        return false;
+    const char *block = (const char *) ((uintptr_t) path & ~(uintptr_t) 31);
+    uint32_t skip = ~0u << (path - block);
+    const __m256i nul = _mm256_setzero_si256();
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i shift = _mm256_set1_epi8((char) (0x80 - 'a'));
+    const __m256i letters_end = _mm256_set1_epi8((char) (-128 + 26));
+    for (;; block += 32, skip = ~0u) {
+        __m256i bytes = _mm256_load_si256((const __m256i *) block);
+        uint32_t zero_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, nul)) & skip;
+        uint32_t slash_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, slash)) & skip;
+        uint32_t letter_mask = _mm256_movemask_epi8(
+                _mm256_cmpgt_epi8(letters_end, _mm256_add_epi8(bytes, shift)));
+        uint32_t other_mask = ~(letter_mask | slash_mask | zero_mask) & skip;
+        int result = scan_block(scan, block - path, zero_mask, slash_mask, other_mask);
+        if (result != SCAN_MORE)
+            return result == SCAN_VALID;
+    }
+
+}
+
+bool is_path_valid_simd(const char *path, int width) {
+
+    PathScan scan = {0};
+    if (width == 32 && __builtin_cpu_supports("avx2"))
+        return scan_avx2(path, &scan);
+    if (width >= 16)
+        return scan_sse2(path, &scan);
+    return is_path_valid_scalar(path);
+
+}
+
+// Validates path and, if scan->slashes is not NULL, records the offsets of all
+// '/' characters in it, growing it with grow_slashes if they do not fit.
+static bool scan_path(const char *path, PathScan *scan) {
+
+    if (forced_width == 0)
+        return scan_scalar(path, scan);
+    if (forced_width != 16 && __builtin_cpu_supports("avx2"))
+        return scan_avx2(path, scan);
+    return scan_sse2(path, scan);
+
+}
+
+bool path_force_width(int width) {
+
+    if (width != -1 && width != 0 && width != 16 && width != 32)
+        return false;
+    if (width == 32 && !__builtin_cpu_supports("avx2"))
+        return false;
+    forced_width = width;
+    return true;
+
+}
+
+#else
+
+bool is_path_valid_simd(const char *path, int width) {
+
+    (void) width;
+    return is_path_valid_scalar(path);
+
+}
+
+static bool scan_path(const char *path, PathScan *scan) {
+
+    return scan_scalar(path, scan);
+
+}
+
+bool path_force_width(int width) {
+
+    if (width != -1 && width != 0)
+        return false;
+    forced_width = width;
+    return true;
+
+}
+
+#endif
+
+bool is_path_valid(const char *path) {
+
+    PathScan scan = {0};
+    return scan_path(path, &scan);
+
+}
+
+bool parse_path(const char *path, ParsedPath *parsed) {
+
+    PathScan scan = {.slashes = parsed->inline_slashes,
+                     .capacity = PARSED_PATH_INLINE_DEPTH + 1};
+    bool valid = scan_path(path, &scan);
+    parsed->slashes = scan.slashes;
+    parsed->hashes = parsed->inline_hashes;
+    if (!valid)
+        return false;
+    parsed->path = path;
+    parsed->depth = scan.count - 1;
+    if (parsed->depth > PARSED_PATH_INLINE_DEPTH) {
+        parsed->hashes = malloc(parsed->depth * sizeof(uint64_t));
+        if (parsed->hashes == NULL)
+            fatal("malloc failed");
+    }
+    for (size_t i = 0; i < parsed->depth; ++i)
+        parsed->hashes[i] = hash_bytes(path_name(parsed, i), path_name_length(parsed, i));
+    return true;
+
+}
+
+void parsed_path_free(ParsedPath *parsed) {
+
+    if (parsed->slashes != parsed->inline_slashes)
+        free(parsed->slashes);
+    if (parsed->hashes != parsed->inline_hashes)
+        free(parsed->hashes);
+
+}
+
+bool path_name_equal(const ParsedPath *a, size_t i, const ParsedPath *b, size_t j) {
+
+    size_t length = path_name_length(a, i);
+    return a->hashes[i] == b->hashes[j] && length == path_name_length(b, j) &&
+           memcmp(path_name(a, i), path_name(b, j), length) == 0;
+
+}
+
+size_t path_common_depth(const ParsedPath *a, const ParsedPath *b, size_t max) {
+
+    size_t depth = 0;
+    while (depth < max && depth < a->depth && depth < b->depth &&
+           path_name_equal(a, depth, b, depth))
+        depth++;
+    return depth;
+
+}
+
 const char *split_path(const char *path, char *component) {
 
     const char *subpath = strchr(path + 1, '/'); // Pointer to second '/' character.
@@ -73,6 +337,7 @@ char *make_path_to_parent(const char *path, char *component) {
 
 }
 
+#ifndef HASHMAP_SORTED
 // A wrapper for using strcmp in qsort.
 // The arguments here are actually pointers to (const char*).
 static int compare_string_pointers(const void *p1, const void *p2) {
@@ -80,6 +345,7 @@ static int compare_string_pointers(const void *p1, const void *p2) {
     return strcmp(*(const char **) p1, *(const char **) p2);
 
 }
+#endif
 
 const char **make_map_contents_array(HashMap *map) {
 
@@ -92,7 +358,9 @@ const char **make_map_contents_array(HashMap *map) {
         key++;
     }
     *key = NULL; // Set last array element to NULL.
+#ifndef HASHMAP_SORTED
     qsort(result, n_keys, sizeof(char *), compare_string_pointers);
+#endif
     return result;
 
 }
@@ -1,6 +1,10 @@
 // File provided by the author of a project.
 
+#pragma once
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "HashMap.h"
 
@@ -16,6 +20,66 @@
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
+// Implementations behind is_path_valid, which picks the widest one the CPU
+// supports. is_path_valid_simd checks `width` bytes at a time: 0 is the
+// byte-by-byte is_path_valid_scalar, 16 uses SSE2 and 32 uses AVX2 (or SSE2 if
+// the CPU lacks it). Without SSE2 all of them are scalar.
+bool is_path_valid_scalar(const char* path);
+bool is_path_valid_simd(const char* path, int width);
+
+// Makes is_path_valid and parse_path use the implementation of width 0, 16
+// or 32 (see is_path_valid_simd), or the widest one again for -1. Returns
+// false, changing nothing, if this build or the CPU lacks it. For tests; must
+// not be called while other threads validate paths.
+bool path_force_width(int width);
+
+// Max number of folder names in a valid path.
+#define MAX_PATH_DEPTH_UTILS ((MAX_PATH_LENGTH_UTILS - 1) / 2)
+
+// Paths of up to this many names are parsed without allocating memory.
+#define PARSED_PATH_INLINE_DEPTH 15
+
+// A valid path split into folder names, made by parse_path, so that walking
+// to the parent or to an ancestor of a path is index arithmetic. Name i is the
+// text between the '/' at slashes[i] and the one at slashes[i + 1], and
+// hashes[i] is its hash_bytes (see hash.h). It must not be copied, as the
+// arrays may be the ones inside it; declare it with PARSED_PATH.
+typedef struct ParsedPath {
+    const char* path; // Not copied; must outlive the structure.
+    size_t depth; // Number of folder names.
+    uint16_t* slashes; // inline_slashes, or allocated for deeper paths.
+    uint64_t* hashes; // inline_hashes, or allocated for deeper paths.
+    uint16_t inline_slashes[PARSED_PATH_INLINE_DEPTH + 1];
+    uint64_t inline_hashes[PARSED_PATH_INLINE_DEPTH];
+} ParsedPath;
+
+// Return whether a path is valid (see is_path_valid) and, if it is, fill
+// `parsed` in the same pass over the path. In either case `parsed` must be
+// released with parsed_path_free afterwards.
+bool parse_path(const char* path, ParsedPath* parsed);
+
+// Release the memory parse_path allocated for `parsed`, if any. It may also be
+// called on a zeroed ParsedPath that was never parsed.
+void parsed_path_free(ParsedPath* parsed);
+
+// Declare a ParsedPath released with parsed_path_free when it goes out of scope.
+#define PARSED_PATH(name) \
+    __attribute__((cleanup(parsed_path_free))) ParsedPath name = {0}
+
+static inline const char* path_name(const ParsedPath* parsed, size_t i) {
+    return parsed->path + parsed->slashes[i] + 1;
+}
+
+static inline size_t path_name_length(const ParsedPath* parsed, size_t i) {
+    return parsed->slashes[i + 1] - parsed->slashes[i] - 1;
+}
+
+// Return whether name i of `a` and name j of `b` are the same.
+bool path_name_equal(const ParsedPath* a, size_t i, const ParsedPath* b, size_t j);
+
+// Return the number of leading names `a` and `b` have in common, at most `max`.
+size_t path_common_depth(const ParsedPath* a, const ParsedPath* b, size_t max);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).
@@ -43,7 +107,7 @@ char* make_path_to_parent(const char* path, char* component);
 
 // Return an array containing all keys, lexicographically sorted.
 // The result is null-terminated.
-// Keys are not copied, they are only valid as long as the map.
+// Keys are not copied, they are only valid until the map is modified.
 // The caller should free the result.
 const char** make_map_contents_array(HashMap* map);
 
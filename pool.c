@@ -0,0 +1,138 @@
+#include "pool.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct Task Task;
+
+struct Task {
+    Task *next;
+    void (*run)(void *);
+    void *arg;
+};
+
+struct Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a task is submitted or the pool stops.
+    pthread_cond_t done; // Signalled when the pool runs out of tasks.
+    Task *tasks; // Tasks not started yet, the latest first.
+    size_t pending; // Tasks submitted but not finished.
+    bool stopping;
+    int n_threads;
+    pthread_t threads[];
+};
+
+static void lock(pthread_mutex_t *mutex) {
+
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+
+}
+
+static void wait_on(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+
+    if (pthread_cond_wait(cond, mutex) != 0)
+        syserr("cond wait failed");
+
+}
+
+static void *worker(void *arg) {
+
+    Pool *pool = arg;
+    lock(&pool->lock);
+    for (;;) {
+        while (pool->tasks == NULL && !pool->stopping)
+            wait_on(&pool->work, &pool->lock);
+        if (pool->tasks == NULL)
+            break;
+        Task *task = pool->tasks;
+        pool->tasks = task->next;
+        unlock(&pool->lock);
+
+        task->run(task->arg);
+        free(task);
+
+        lock(&pool->lock);
+        if (--pool->pending == 0 && pthread_cond_broadcast(&pool->done) != 0)
+            syserr("cond broadcast failed");
+    }
+    unlock(&pool->lock);
+    return NULL;
+
+}
+
+Pool *pool_new(int threads) {
+
+    Pool *pool = malloc(sizeof(Pool) + threads * sizeof(pthread_t));
+    if (pool == NULL)
+        fatal("malloc failed");
+    if (pthread_mutex_init(&pool->lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&pool->work, 0) != 0 || pthread_cond_init(&pool->done, 0) != 0)
+        syserr("cond init failed");
+    pool->tasks = NULL;
+    pool->pending = 0;
+    pool->stopping = false;
+    pool->n_threads = threads;
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+            syserr("pthread_create failed");
+    }
+    return pool;
+
+}
+
+void pool_free(Pool *pool) {
+
+    pool_wait(pool);
+    lock(&pool->lock);
+    pool->stopping = true;
+    if (pthread_cond_broadcast(&pool->work) != 0)
+        syserr("cond broadcast failed");
+    unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; ++i) {
+        if (pthread_join(pool->threads[i], NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    if (pthread_cond_destroy(&pool->work) != 0 || pthread_cond_destroy(&pool->done) != 0)
+        syserr("cond destroy failed");
+    if (pthread_mutex_destroy(&pool->lock) != 0)
+        syserr("mutex destroy failed");
+    free(pool);
+
+}
+
+void pool_submit(Pool *pool, void (*run)(void *), void *arg) {
+
+    Task *task = malloc(sizeof(Task));
+    if (task == NULL)
+        fatal("malloc failed");
+    task->run = run;
+    task->arg = arg;
+    lock(&pool->lock);
+    task->next = pool->tasks;
+    pool->tasks = task;
+    pool->pending++;
+    if (pthread_cond_signal(&pool->work) != 0)
+        syserr("cond signal failed");
+    unlock(&pool->lock);
+
+}
+
+void pool_wait(Pool *pool) {
+
+    lock(&pool->lock);
+    while (pool->pending > 0)
+        wait_on(&pool->done, &pool->lock);
+    unlock(&pool->lock);
+
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Fixed set of worker threads running tasks submitted from any thread,
+// including from the tasks themselves.
+
+typedef struct Pool Pool;
+
+Pool *pool_new(int threads);
+
+// Waits for all submitted tasks, then stops the workers and frees the pool.
+void pool_free(Pool *pool);
+
+// Makes a worker call `run(arg)`.
+void pool_submit(Pool *pool, void (*run)(void *), void *arg);
+
+// Waits until all submitted tasks, including those they submit, are done.
+void pool_wait(Pool *pool);
@@ -0,0 +1,115 @@
+#include "read_indicator.h"
+#include "err.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+// Spins for readers to depart this many times before yielding the CPU.
+#define DRAIN_SPINS 64
+
+typedef struct Row {
+    _Alignas(CACHE_LINE) _Atomic(const void *) slots[READ_INDICATOR_SLOTS];
+} Row;
+
+static Row rows[READ_INDICATOR_ROWS];
+static atomic_bool taken[READ_INDICATOR_ROWS];
+// Rows at or beyond it were never taken, so drains do not look at them.
+static atomic_uint rows_used;
+
+static pthread_key_t row_key;
+static pthread_once_t row_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local Row *self;
+static _Thread_local bool no_row; // All rows were taken when it tried.
+
+static void release_row(void *arg) {
+
+    Row *row = arg;
+    atomic_store_explicit(&taken[row - rows], false, memory_order_release);
+
+}
+
+static void make_row_key(void) {
+
+    if (pthread_key_create(&row_key, release_row) != 0)
+        fatal("pthread_key_create failed");
+
+}
+
+static Row *get_row(void) {
+
+    if (self || no_row)
+        return self;
+
+    pthread_once(&row_key_once, make_row_key);
+    for (unsigned int i = 0; i < READ_INDICATOR_ROWS; ++i) {
+        bool expected = false;
+        if (!atomic_load_explicit(&taken[i], memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&taken[i], &expected, true)) {
+            self = &rows[i];
+            unsigned int used = atomic_load(&rows_used);
+            while (used <= i && !atomic_compare_exchange_weak(&rows_used, &used, i + 1));
+            break;
+        }
+    }
+
+    if (self == NULL) {
+        no_row = true;
+        return NULL;
+    }
+    if (pthread_setspecific(row_key, self) != 0)
+        fatal("pthread_setspecific failed");
+    return self;
+
+}
+
+static unsigned int slot_of(const void *lock) {
+
+    // Folders are allocated next to each other, so the low bits repeat.
+    uint64_t hash = (uintptr_t) lock * 0x9e3779b97f4a7c15ULL;
+    return hash >> 61;
+
+}
+
+bool read_indicator_arrive(const void *lock) {
+
+    Row *row = get_row();
+    if (row == NULL)
+        return false;
+    _Atomic(const void *) *slot = &row->slots[slot_of(lock)];
+    if (atomic_load_explicit(slot, memory_order_relaxed) != NULL)
+        return false;
+    // Sequentially consistent, like the drain, so that a writer either finds
+    // the thread here or the thread finds what the writer did before.
+    atomic_exchange(slot, lock);
+    return true;
+
+}
+
+bool read_indicator_depart(const void *lock) {
+
+    if (self == NULL)
+        return false;
+    _Atomic(const void *) *slot = &self->slots[slot_of(lock)];
+    if (atomic_load_explicit(slot, memory_order_relaxed) != lock)
+        return false;
+    atomic_store_explicit(slot, NULL, memory_order_release);
+    return true;
+
+}
+
+void read_indicator_drain(const void *lock) {
+
+    unsigned int slot = slot_of(lock);
+    unsigned int used = atomic_load(&rows_used);
+    for (unsigned int i = 0; i < used; ++i) {
+        for (int spins = 0; atomic_load(&rows[i].slots[slot]) == lock; ++spins) {
+            if (spins >= DRAIN_SPINS)
+                sched_yield();
+        }
+    }
+
+}
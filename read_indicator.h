@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Distributed reader indicator shared by all folder locks.
+//
+// Every thread gets a row of READ_INDICATOR_SLOTS slots of its own, filling
+// one cache line, and each lock maps to the same slot in every row. A reader
+// announces itself by storing the address of the lock in its slot, so readers
+// of one hot lock write to cache lines of their own instead of to the lock.
+// To exclude them, a writer stops readers from arriving (how is up to the
+// lock, see enter_biased in Tree.c) and then drains the slots of the lock.
+// Threads beyond READ_INDICATOR_ROWS running at once get no row and never
+// arrive.
+
+#define READ_INDICATOR_ROWS 256
+#define READ_INDICATOR_SLOTS 8
+
+// Announces the calling thread as a reader of `lock`. Returns false if it has
+// no row or its slot for `lock` is taken by another lock.
+bool read_indicator_arrive(const void *lock);
+
+// Withdraws the calling thread as a reader of `lock`, if read_indicator_arrive
+// announced it. Returns whether it did.
+bool read_indicator_depart(const void *lock);
+
+// Waits until no thread is announced as a reader of `lock`.
+void read_indicator_drain(const void *lock);
@@ -0,0 +1,180 @@
+// Tests of tree_create_recursive: the number of folders created, paths that
+// exist already or are invalid, paths too deep for the optimistic walk, and
+// threads creating paths that share prefixes at the same time.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Tree.h"
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// Deeper than the optimistic walk goes (OPTIMISTIC_MAX_DEPTH in Tree.c).
+#define DEEP 200
+#define THREADS 2
+#define RACES 2000
+
+// Writes to path the path of `depth` folders, each named `name` followed by
+// a letter for its level.
+static void deep_path(char *path, size_t depth, char name) {
+
+    char *end = path;
+    *end++ = '/';
+    for (size_t i = 0; i < depth; ++i)
+        end += sprintf(end, "%c%c/", name, (char) ('a' + i % 26));
+    *end = '\0';
+
+}
+
+// Writes to name the name of the i-th folder.
+static void folder_name(char *name, int i) {
+
+    do {
+        *name++ = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    *name = '\0';
+
+}
+
+static void check_list(Tree *tree, const char *path, const char *expected) {
+
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL);
+    CHECK(strcmp(list, expected) == 0);
+    free(list);
+
+}
+
+static void test_sequential(void) {
+
+    Tree *tree = tree_new();
+    size_t created = 7;
+    CHECK(tree_create_recursive(tree, "/a/b/c/", &created) == 0);
+    CHECK(created == 3);
+    check_list(tree, "/a/b/", "c");
+    CHECK(tree_create_recursive(tree, "/a/b/c/", &created) == 0);
+    CHECK(created == 0);
+    CHECK(tree_create_recursive(tree, "/", &created) == 0);
+    CHECK(created == 0);
+    CHECK(tree_create_recursive(tree, "/a/d/e/", &created) == 0);
+    CHECK(created == 2);
+    check_list(tree, "/a/", "b,d");
+
+    created = 7;
+    CHECK(tree_create_recursive(tree, "a/b/", &created) == EINVAL);
+    CHECK(created == 0);
+    CHECK(tree_create_recursive(tree, "/a//", &created) == EINVAL);
+    CHECK(tree_create_recursive(tree, "/A/", &created) == EINVAL);
+    CHECK(tree_create_recursive(tree, "/a/b", &created) == EINVAL);
+    check_list(tree, "/", "a");
+    tree_free(tree);
+
+}
+
+static void test_deep(void) {
+
+    Tree *tree = tree_new();
+    char path[DEEP * 3 + 2];
+    size_t created;
+    deep_path(path, DEEP / 2, 'a');
+    CHECK(tree_create_recursive(tree, path, &created) == 0);
+    CHECK(created == DEEP / 2);
+    deep_path(path, DEEP, 'a');
+    CHECK(tree_create_recursive(tree, path, &created) == 0);
+    CHECK(created == DEEP - DEEP / 2);
+    CHECK(tree_create_recursive(tree, path, &created) == 0);
+    CHECK(created == 0);
+    check_list(tree, path, "");
+    // The deepest folder but one lists the deepest.
+    path[strlen(path) - 3] = '\0';
+    check_list(tree, path, "ar");
+    tree_free(tree);
+
+}
+
+typedef struct Racer {
+    Tree *tree;
+    char name; // Of the folders below the shared prefix.
+    size_t created;
+} Racer;
+
+// Creates paths that share their first folders with those of the other
+// threads, deep or shallow, and counts the folders it created.
+static void *race(void *arg) {
+
+    Racer *racer = arg;
+    char path[DEEP * 3 + 16];
+    for (int i = 0; i < RACES; ++i) {
+        deep_path(path, i % 3 == 0 ? DEEP : 1 + i % 5, 's');
+        char name[8];
+        folder_name(name, i);
+        sprintf(path + strlen(path), "%s/%c/", name, racer->name);
+        size_t created;
+        CHECK(tree_create_recursive(racer->tree, path, &created) == 0);
+        racer->created += created;
+    }
+    return NULL;
+
+}
+
+// Returns the number of folders below the folder at `path`.
+static size_t count_below(Tree *tree, const char *path) {
+
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL);
+    size_t count = 0;
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        count += 1 + count_below(tree, child);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+    return count;
+
+}
+
+static void test_race(void) {
+
+    Tree *tree = tree_new();
+    pthread_t threads[THREADS];
+    Racer racers[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        racers[i] = (Racer) {tree, 'x' + i, 0};
+        CHECK(pthread_create(&threads[i], NULL, race, &racers[i]) == 0);
+    }
+    size_t created = 0;
+    for (int i = 0; i < THREADS; ++i) {
+        CHECK(pthread_join(threads[i], NULL) == 0);
+        created += racers[i].created;
+    }
+    // Every folder was created by exactly one of the threads.
+    CHECK(created == count_below(tree, "/"));
+    char path[DEEP * 3 + 16];
+    deep_path(path, DEEP, 's');
+    strcat(path, "a/");
+    check_list(tree, path, "x,y");
+    tree_free(tree);
+
+}
+
+int main(void) {
+
+    test_sequential();
+    test_deep();
+    test_race();
+    printf("ok\n");
+    return 0;
+
+}
@@ -0,0 +1,279 @@
+// Tests of the journal: replaying a journal cut short in the middle of a
+// record and logging after it, changes made from several threads at once
+// (moves among them) replayed into the same tree, and failed writes, each
+// with every sync policy.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#define THREADS 4
+#define CHANGES_PER_THREAD 2000
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const char *const sync_names[] = {"none", "batched", "each"};
+
+static int temporary_file(void) {
+
+    char name[] = "/tmp/journal_testXXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    unlink(name);
+    return fd;
+
+}
+
+static off_t file_size(int fd) {
+
+    off_t size = lseek(fd, 0, SEEK_END);
+    CHECK(size >= 0);
+    return size;
+
+}
+
+// Appends to `out` the path and listing of the folder at `path` and of every
+// folder below it, in preorder.
+static void dump_folder(Tree *tree, const char *path, FILE *out) {
+
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL);
+    fprintf(out, "%s:%s\n", path, list);
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        dump_folder(tree, child, out);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+
+}
+
+// Returns every folder of the tree with its listing, freed by the caller.
+static char *dump(Tree *tree) {
+
+    char *text;
+    size_t length;
+    FILE *out = open_memstream(&text, &length);
+    CHECK(out != NULL);
+    dump_folder(tree, "/", out);
+    fclose(out);
+    return text;
+
+}
+
+static void check_same(Tree *tree, Tree *other) {
+
+    char *text = dump(tree), *other_text = dump(other);
+    CHECK(strcmp(text, other_text) == 0);
+    free(text);
+    free(other_text);
+
+}
+
+// The changes of the replay test, each of which succeeds when made in order.
+static void change(Tree *tree, int i) {
+
+    size_t created;
+    switch (i) {
+        case 0: CHECK(tree_create(tree, "/a/") == 0); break;
+        case 1: CHECK(tree_create_recursive(tree, "/a/b/c/", &created) == 0); break;
+        case 2: CHECK(tree_create(tree, "/d/") == 0); break;
+        case 3: CHECK(tree_move(tree, "/a/b/", "/d/e/") == 0); break;
+        case 4: CHECK(tree_create(tree, "/d/e/f/") == 0); break;
+        case 5: CHECK(tree_remove(tree, "/d/e/c/") == 0); break;
+        case 6: CHECK(tree_create_recursive(tree, "/g/h/i/", &created) == 0); break;
+        case 7: CHECK(tree_remove_recursive(tree, "/g/") == 0); break;
+        case 8: CHECK(tree_move(tree, "/d/", "/a/d/") == 0); break;
+        case 9: CHECK(tree_create(tree, "/a/d/e/j/") == 0); break;
+        default: CHECK(false);
+    }
+
+}
+
+#define REPLAY_CHANGES 10
+
+// Returns the size of a journal of the first `changes` changes.
+static off_t journal_size(int changes, TreeJournalSync sync) {
+
+    int fd = temporary_file();
+    Tree *tree = tree_new();
+    CHECK(tree_journal_start(tree, fd, sync) == 0);
+    for (int i = 0; i < changes; ++i)
+        change(tree, i);
+    tree_free(tree);
+    off_t size = file_size(fd);
+    close(fd);
+    return size;
+
+}
+
+static void test_truncated(TreeJournalSync sync) {
+
+    off_t last = journal_size(REPLAY_CHANGES - 1, sync);
+    off_t all = journal_size(REPLAY_CHANGES, sync);
+    CHECK(last < all);
+
+    int fd = temporary_file();
+    Tree *tree = tree_new();
+    CHECK(tree_journal_start(tree, fd, sync) == 0);
+    for (int i = 0; i < REPLAY_CHANGES; ++i)
+        change(tree, i);
+    tree_journal_stop(tree);
+    CHECK(file_size(fd) == all);
+
+    // A crash in the middle of writing the last record.
+    CHECK(ftruncate(fd, last + (all - last) / 2) == 0);
+    Tree *replayed = tree_new();
+    size_t count;
+    CHECK(tree_replay(replayed, fd, &count) == 0);
+    CHECK(count == REPLAY_CHANGES - 1);
+    CHECK(file_size(fd) == last);
+    Tree *expected = tree_new();
+    for (int i = 0; i < REPLAY_CHANGES - 1; ++i)
+        change(expected, i);
+    check_same(replayed, expected);
+
+    // Logging goes on after the last complete record.
+    CHECK(tree_journal_start(replayed, fd, sync) == 0);
+    change(replayed, REPLAY_CHANGES - 1);
+    CHECK(tree_create(replayed, "/k/") == 0);
+    tree_journal_stop(replayed);
+    Tree *again = tree_new();
+    CHECK(tree_replay(again, fd, &count) == 0);
+    CHECK(count == REPLAY_CHANGES + 1);
+    check_same(again, replayed);
+    CHECK(tree_create(tree, "/k/") == 0);
+    check_same(again, tree);
+
+    tree_free(again);
+    tree_free(expected);
+    tree_free(replayed);
+    tree_free(tree);
+    close(fd);
+
+}
+
+typedef struct Worker {
+    Tree *tree;
+    unsigned seed;
+    int changes;
+} Worker;
+
+// Writes a random path of one to four names out of two to path, so that
+// changes often meet in the same folders.
+static void random_path(unsigned *seed, char *path) {
+
+    int depth = 1 + rand_r(seed) % 4;
+    char *end = path;
+    *end++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *end++ = 'a' + rand_r(seed) % 2;
+        *end++ = '/';
+    }
+    *end = '\0';
+
+}
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    char path[16], target[16];
+    size_t created;
+    for (int i = 0; i < worker->changes; ++i) {
+        random_path(&worker->seed, path);
+        random_path(&worker->seed, target);
+        switch (rand_r(&worker->seed) % 6) {
+            case 0: tree_create(worker->tree, path); break;
+            case 1: tree_create_recursive(worker->tree, path, &created); break;
+            case 2: tree_remove(worker->tree, path); break;
+            case 3: tree_remove_recursive(worker->tree, path); break;
+            default: tree_move(worker->tree, path, target); break;
+        }
+    }
+    return NULL;
+
+}
+
+static void test_concurrent(TreeJournalSync sync) {
+
+    int fd = temporary_file();
+    Tree *tree = tree_new();
+    CHECK(tree_journal_start(tree, fd, sync) == 0);
+    pthread_t threads[THREADS];
+    Worker workers[THREADS];
+    // Syncing each change is slow, so there are fewer of them.
+    int changes = sync == TREE_SYNC_EACH ? CHANGES_PER_THREAD / 10 : CHANGES_PER_THREAD;
+    for (int i = 0; i < THREADS; ++i) {
+        workers[i] = (Worker) {tree, i * 7919 + 1, changes};
+        CHECK(pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; ++i)
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    tree_journal_stop(tree);
+
+    Tree *replayed = tree_new();
+    size_t count;
+    CHECK(tree_replay(replayed, fd, &count) == 0);
+    check_same(replayed, tree);
+    tree_free(replayed);
+    tree_free(tree);
+    close(fd);
+
+}
+
+static void test_failed_write(TreeJournalSync sync) {
+
+    char name[] = "/tmp/journal_testXXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    Tree *tree = tree_new();
+    CHECK(tree_journal_start(tree, fd, sync) == 0);
+    tree_journal_stop(tree);
+    close(fd);
+    // The header is there, but nothing more can be written.
+    fd = open(name, O_RDONLY);
+    CHECK(fd >= 0);
+    unlink(name);
+
+    CHECK(tree_journal_start(tree, fd, sync) == 0);
+    if (sync != TREE_SYNC_NONE) {
+        // The change is made, but it cannot be logged, and no later one is made.
+        CHECK(tree_create(tree, "/a/") == EBADF);
+        CHECK(tree_create(tree, "/b/") == EBADF);
+        CHECK(tree_move(tree, "/a/", "/b/") == EBADF);
+        char *list = tree_list(tree, "/");
+        CHECK(strcmp(list, "a") == 0);
+        free(list);
+    }
+    tree_journal_stop(tree);
+    CHECK(tree_create(tree, "/c/") == 0);
+    tree_free(tree);
+    close(fd);
+
+}
+
+int main(void) {
+
+    for (TreeJournalSync sync = TREE_SYNC_NONE; sync <= TREE_SYNC_EACH; ++sync) {
+        test_truncated(sync);
+        test_concurrent(sync);
+        test_failed_write(sync);
+        printf("sync %s: ok\n", sync_names[sync]);
+    }
+    return 0;
+
+}
@@ -0,0 +1,161 @@
+// Stress test of tree_move: folders moved in opposite directions between two
+// sibling subtrees, and moves that would make a cycle if both went through,
+// all at the same time as lists. Every thread must finish, and in the end
+// each folder must be in exactly one place.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#define MOVES 20000
+#define READERS 2
+// Seconds after which the test counts as deadlocked.
+#define DEADLINE 120
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const char *const initial[] = {
+    "/a/", "/b/", "/a/x/", "/a/x/p/", "/a/x/q/", "/a/x/q/t/", "/b/y/", "/b/y/r/",
+    "/b/y/s/", "/a/m/", "/b/n/",
+};
+#define INITIAL (sizeof(initial) / sizeof(initial[0]))
+
+static Tree *tree;
+static atomic_bool stop;
+
+// Moves the folder at paths[0] to paths[1] and back, MOVES times; only this
+// thread moves that folder, so each move must succeed.
+static void *move_back_and_forth(void *arg) {
+
+    const char *const *paths = arg;
+    for (int i = 0; i < MOVES; ++i) {
+        CHECK(tree_move(tree, paths[0], paths[1]) == 0);
+        CHECK(tree_move(tree, paths[1], paths[0]) == 0);
+    }
+    return NULL;
+
+}
+
+typedef struct Cycler {
+    const char *const *paths; // Where the folder of the thread may be.
+    unsigned seed;
+} Cycler;
+
+// Moves a folder between places in and around the folder of another Cycler,
+// which moves it into this one's the same way.
+static void *move_around(void *arg) {
+
+    Cycler *cycler = arg;
+    for (int i = 0; i < MOVES; ++i) {
+        const char *source = cycler->paths[rand_r(&cycler->seed) % 4];
+        const char *target = cycler->paths[rand_r(&cycler->seed) % 4];
+        int code = tree_move(tree, source, target);
+        CHECK(code == 0 || code == ENOENT || code == EEXIST);
+    }
+    return NULL;
+
+}
+
+// Checks the subfolders of the folder at `path`, unless it is missing and
+// `may_be_missing`.
+static void check_listing(const char *path, const char *expected, bool may_be_missing) {
+
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL || may_be_missing);
+    CHECK(list == NULL || strcmp(list, expected) == 0);
+    free(list);
+
+}
+
+static void *read_lists(void *arg) {
+
+    (void) arg;
+    // The subfolders of x and y never change, wherever they are.
+    while (!atomic_load(&stop)) {
+        check_listing("/a/x/", "p,q", true);
+        check_listing("/b/x/", "p,q", true);
+        check_listing("/a/y/", "r,s", true);
+        check_listing("/b/y/", "r,s", true);
+        free(tree_list(tree, "/"));
+        free(tree_list(tree, "/a/"));
+        free(tree_list(tree, "/b/"));
+    }
+    return NULL;
+
+}
+
+// Adds to *count the folders below the folder at `path`, and to *m and *n the
+// number of times folders named m and n appear among them.
+static void count_below(const char *path, size_t *count, int *m, int *n) {
+
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL);
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name) {
+        *count += 1;
+        *m += strcmp(name, "m") == 0;
+        *n += strcmp(name, "n") == 0;
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        count_below(child, count, m, n);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+
+}
+
+int main(void) {
+
+    // A deadlock fails the test instead of hanging it.
+    alarm(DEADLINE);
+    tree = tree_new();
+    for (size_t i = 0; i < INITIAL; ++i)
+        CHECK(tree_create(tree, initial[i]) == 0);
+
+    static const char *const x_paths[] = {"/a/x/", "/b/x/"};
+    static const char *const y_paths[] = {"/b/y/", "/a/y/"};
+    static const char *const m_paths[] = {"/a/m/", "/b/m/", "/a/n/m/", "/b/n/m/"};
+    static const char *const n_paths[] = {"/b/n/", "/a/n/", "/b/m/n/", "/a/m/n/"};
+    Cycler cyclers[] = {{m_paths, 1}, {n_paths, 2}};
+
+    pthread_t movers[4], readers[READERS];
+    CHECK(pthread_create(&movers[0], NULL, move_back_and_forth, (void *) x_paths) == 0);
+    CHECK(pthread_create(&movers[1], NULL, move_back_and_forth, (void *) y_paths) == 0);
+    CHECK(pthread_create(&movers[2], NULL, move_around, &cyclers[0]) == 0);
+    CHECK(pthread_create(&movers[3], NULL, move_around, &cyclers[1]) == 0);
+    for (int i = 0; i < READERS; ++i)
+        CHECK(pthread_create(&readers[i], NULL, read_lists, NULL) == 0);
+    for (int i = 0; i < 4; ++i)
+        CHECK(pthread_join(movers[i], NULL) == 0);
+    atomic_store(&stop, true);
+    for (int i = 0; i < READERS; ++i)
+        CHECK(pthread_join(readers[i], NULL) == 0);
+
+    // Every folder is still reachable, once: m and n did not end up inside
+    // each other, which would have cut both off.
+    size_t count = 0;
+    int m = 0, n = 0;
+    count_below("/", &count, &m, &n);
+    CHECK(count == INITIAL);
+    CHECK(m == 1 && n == 1);
+    check_listing("/", "a,b", false);
+    check_listing("/a/x/", "p,q", false);
+    check_listing("/a/x/q/", "t", false);
+    check_listing("/b/y/", "r,s", false);
+    tree_free(tree);
+    printf("ok\n");
+    return 0;
+
+}
@@ -0,0 +1,190 @@
+// Tests of NodeLock: more threads than the counts of the lock ever had room
+// for holding or waiting for one lock, and when try-locks succeed. Built
+// twice, with futexes and with the fallback to a mutex and condition
+// variables, which must behave the same.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../node_lock.h"
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// More than 1023 readers and 511 writers, the limits of a 32-bit state word.
+#define READERS 1100
+#define WRITERS 600
+
+static NodeLock lock;
+static atomic_int inside, done;
+
+static void start_threads(pthread_t *threads, int n, void *(*function)(void *)) {
+
+    pthread_attr_t attr;
+    CHECK(pthread_attr_init(&attr) == 0);
+    CHECK(pthread_attr_setstacksize(&attr, 64 * 1024) == 0);
+    for (int i = 0; i < n; ++i)
+        CHECK(pthread_create(&threads[i], &attr, function, NULL) == 0);
+    pthread_attr_destroy(&attr);
+
+}
+
+static void join_threads(pthread_t *threads, int n) {
+
+    for (int i = 0; i < n; ++i)
+        CHECK(pthread_join(threads[i], NULL) == 0);
+
+}
+
+// Stays inside until all readers are.
+static void *read_together(void *arg) {
+
+    (void) arg;
+    node_lock_read(&lock);
+    atomic_fetch_add(&inside, 1);
+    while (atomic_load(&inside) < READERS)
+        sched_yield();
+    node_unlock_read(&lock);
+    return NULL;
+
+}
+
+static void *read_once(void *arg) {
+
+    (void) arg;
+    node_lock_read(&lock);
+    atomic_fetch_add(&done, 1);
+    node_unlock_read(&lock);
+    return NULL;
+
+}
+
+static void *write_once(void *arg) {
+
+    (void) arg;
+    node_lock_write(&lock);
+    CHECK(atomic_fetch_add(&inside, 1) == 0);
+    atomic_fetch_sub(&inside, 1);
+    atomic_fetch_add(&done, 1);
+    node_unlock_write(&lock);
+    return NULL;
+
+}
+
+static void test_many_threads(void) {
+
+    static pthread_t threads[READERS];
+
+    // Readers inside at once.
+    node_lock_init(&lock);
+    start_threads(threads, READERS, read_together);
+    join_threads(threads, READERS);
+    CHECK(node_lock_idle(&lock));
+
+    // Readers waiting for a writer, all let in when it leaves.
+    atomic_store(&done, 0);
+    node_lock_write(&lock);
+    start_threads(threads, READERS, read_once);
+    usleep(100 * 1000);
+    CHECK(atomic_load(&done) == 0);
+    node_unlock_write(&lock);
+    join_threads(threads, READERS);
+    CHECK(atomic_load(&done) == READERS);
+
+    // Writers waiting for a reader, let in one by one.
+    atomic_store(&done, 0);
+    atomic_store(&inside, 0);
+    node_lock_read(&lock);
+    start_threads(threads, WRITERS, write_once);
+    usleep(100 * 1000);
+    CHECK(atomic_load(&done) == 0);
+    node_unlock_read(&lock);
+    join_threads(threads, WRITERS);
+    CHECK(atomic_load(&done) == WRITERS);
+    node_lock_wait_idle(&lock);
+    CHECK(node_lock_idle(&lock));
+    node_lock_destroy(&lock);
+
+}
+
+static void *try_write(void *arg) {
+
+    bool *taken = arg;
+    *taken = node_try_lock_write(&lock);
+    if (*taken)
+        node_unlock_write(&lock);
+    return NULL;
+
+}
+
+static void *try_read(void *arg) {
+
+    bool *taken = arg;
+    *taken = node_try_lock_read(&lock);
+    if (*taken)
+        node_unlock_read(&lock);
+    return NULL;
+
+}
+
+// Runs function in another thread, so that it does not hold the lock already.
+static bool try_in_thread(void *(*function)(void *)) {
+
+    pthread_t thread;
+    bool taken;
+    CHECK(pthread_create(&thread, NULL, function, &taken) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    return taken;
+
+}
+
+static void test_try_lock(void) {
+
+    node_lock_init(&lock);
+    CHECK(try_in_thread(try_write));
+    CHECK(try_in_thread(try_read));
+
+    node_lock_write(&lock);
+    CHECK(!try_in_thread(try_write));
+    CHECK(!try_in_thread(try_read));
+    node_unlock_write(&lock);
+
+    node_lock_read(&lock);
+    CHECK(!try_in_thread(try_write));
+    CHECK(try_in_thread(try_read));
+
+    // A waiting writer keeps new readers out, try-locking or not.
+    pthread_t writer;
+    atomic_store(&done, 0);
+    atomic_store(&inside, 0);
+    CHECK(pthread_create(&writer, NULL, write_once, NULL) == 0);
+    while (try_in_thread(try_read))
+        sched_yield();
+    CHECK(!try_in_thread(try_write));
+    node_unlock_read(&lock);
+    CHECK(pthread_join(writer, NULL) == 0);
+    CHECK(atomic_load(&done) == 1);
+
+    node_lock_wait_idle(&lock);
+    CHECK(try_in_thread(try_write));
+    node_lock_destroy(&lock);
+
+}
+
+int main(void) {
+
+    test_many_threads();
+    test_try_lock();
+    printf("ok\n");
+    return 0;
+
+}
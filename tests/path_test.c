@@ -0,0 +1,222 @@
+// Differential test of path validation: is_path_valid and parse_path, forced
+// to each implementation in turn (byte by byte, SSE2 and AVX2, as far as the
+// CPU has them), against the is_path_valid the project started with, on edge
+// cases and random paths at every alignment.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../path_utils.h"
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define RANDOM_PATHS 20000
+#define ALIGNMENTS 64
+
+static const int widths[] = {0, 16, 32};
+#define N_WIDTHS (int) (sizeof(widths) / sizeof(widths[0]))
+
+// is_path_valid as first provided with the project.
+static bool reference_valid(const char *path) {
+
+    size_t len = strlen(path);
+    if (len == 0 || len > MAX_PATH_LENGTH_UTILS)
+        return false;
+    if (path[0] != '/' || path[len - 1] != '/')
+        return false;
+    const char *name_start = path + 1;
+    while (name_start < path + len) {
+        char *name_end = strchr(name_start, '/');
+        if (!name_end || name_end == name_start ||
+            name_end > name_start + MAX_FOLDER_NAME_LENGTH_UTILS)
+            return false;
+        for (const char *p = name_start; p != name_end; ++p)
+            if (*p < 'a' || *p > 'z')
+                return false;
+        name_start = name_end + 1;
+    }
+    return true;
+
+}
+
+static char buffer[ALIGNMENTS + MAX_PATH_LENGTH_UTILS + 128];
+static int forced[N_WIDTHS]; // Widths path_force_width accepted.
+static int n_forced;
+
+// Checks that parse_path split the valid `path` into its names.
+static void check_parsed(const char *path, const ParsedPath *parsed) {
+
+    size_t depth = 0;
+    for (const char *p = path + 1; *p; ++p)
+        depth += *p == '/';
+    CHECK(parsed->depth == depth);
+    const char *name = path + 1;
+    for (size_t i = 0; i < depth; ++i) {
+        size_t length = strchr(name, '/') - name;
+        CHECK(path_name_length(parsed, i) == length);
+        CHECK(memcmp(path_name(parsed, i), name, length) == 0);
+        name += length + 1;
+    }
+
+}
+
+// Checks `path` at every alignment, with any bytes after its end.
+static void check(const char *path) {
+
+    size_t length = strlen(path);
+    bool expected = reference_valid(path);
+    for (int offset = 0; offset < ALIGNMENTS; ++offset) {
+        char *copy = buffer + offset;
+        memcpy(copy, path, length + 1);
+        memset(copy + length + 1, offset & 1 ? '/' : 'a', 32);
+        for (int w = 0; w < N_WIDTHS; ++w)
+            CHECK(is_path_valid_simd(copy, widths[w]) == expected);
+        for (int w = 0; w < n_forced; ++w) {
+            CHECK(path_force_width(forced[w]));
+            if (is_path_valid(copy) != expected) {
+                fprintf(stderr, "width %d, offset %d, expected %d: %.80s\n", forced[w],
+                        offset, expected, path);
+                exit(1);
+            }
+            PARSED_PATH(parsed);
+            CHECK(parse_path(copy, &parsed) == expected);
+            if (expected)
+                check_parsed(copy, &parsed);
+        }
+    }
+    CHECK(path_force_width(-1));
+
+}
+
+// Writes a path of `names` names of `name_length` letters each.
+static void make_path(char *path, size_t names, size_t name_length) {
+
+    *path++ = '/';
+    for (size_t i = 0; i < names; ++i) {
+        for (size_t j = 0; j < name_length; ++j)
+            *path++ = 'a' + (i + j) % 26;
+        *path++ = '/';
+    }
+    *path = '\0';
+
+}
+
+// Writes a path of exactly `length` bytes with names of up to `name_length`.
+static void make_path_of_length(char *path, size_t length, size_t name_length) {
+
+    make_path(path, length / (name_length + 1) + 1, name_length);
+    path[length - 1] = '/';
+    path[length] = '\0';
+    // The last name must not be empty.
+    if (length >= 2 && path[length - 2] == '/')
+        path[length - 2] = 'q';
+
+}
+
+static void check_edge_cases(void) {
+
+    static const char *fixed[] = {
+        "", "/", "//", "a", "a/", "/a", "/a/", "/a//", "//a/", "/a//b/", "/a/b/", "/A/",
+        "/a-b/", "/`/", "/{/", "/z/", "/a/\n/", "/a/ /",
+    };
+    for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); ++i)
+        check(fixed[i]);
+
+    // Every byte outside ASCII, which the SIMD letter range must not take for
+    // a letter even though it is negative as a signed char.
+    char path[MAX_PATH_LENGTH_UTILS + 300];
+    for (int byte = 0x80; byte <= 0xff; ++byte) {
+        sprintf(path, "/ab%cc/", byte);
+        check(path);
+        sprintf(path, "/%c/", byte);
+        check(path);
+    }
+
+    // Names of 255 and 256 letters, and around them.
+    for (size_t length = MAX_FOLDER_NAME_LENGTH_UTILS - 2;
+         length <= MAX_FOLDER_NAME_LENGTH_UTILS + 2; ++length) {
+        for (size_t names = 1; names <= 3; ++names) {
+            make_path(path, names, length);
+            check(path);
+        }
+    }
+    make_path(path, 1, MAX_FOLDER_NAME_LENGTH_UTILS);
+    CHECK(reference_valid(path));
+    make_path(path, 1, MAX_FOLDER_NAME_LENGTH_UTILS + 1);
+    CHECK(!reference_valid(path));
+
+    // Paths of 4095 and 4096 bytes, and around them, with short and long names.
+    for (size_t length = MAX_PATH_LENGTH_UTILS - 40; length <= MAX_PATH_LENGTH_UTILS + 40;
+         ++length) {
+        make_path_of_length(path, length, 1);
+        check(path);
+        make_path_of_length(path, length, 200);
+        check(path);
+    }
+    make_path_of_length(path, MAX_PATH_LENGTH_UTILS, 1);
+    CHECK(reference_valid(path));
+    make_path_of_length(path, MAX_PATH_LENGTH_UTILS + 1, 1);
+    CHECK(!reference_valid(path));
+
+    // Slashes, single and double, on both sides of the ends of 16- and 32-byte
+    // blocks; check() also moves the blocks around.
+    for (size_t at = 1; at < 70; ++at) {
+        memset(path, 'k', at + 4);
+        path[0] = '/';
+        path[at] = '/';
+        path[at + 4] = '/';
+        path[at + 5] = '\0';
+        check(path);
+        path[at + 1] = '/';
+        check(path);
+    }
+
+}
+
+static void check_random(size_t count) {
+
+    static const char alphabet[] = "abcz//////A`{\x80\xff";
+    static char path[MAX_PATH_LENGTH_UTILS + 64];
+    unsigned int seed = 1;
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = rand_r(&seed) % 100 == 0 ? rand_r(&seed) % (MAX_PATH_LENGTH_UTILS + 40)
+                                                 : rand_r(&seed) % 80;
+        // Mostly valid characters, so that more paths get far.
+        bool clean = rand_r(&seed) % 2;
+        for (size_t j = 0; j < length; ++j) {
+            size_t range = clean ? 10 : sizeof(alphabet) - 1;
+            path[j] = alphabet[rand_r(&seed) % range];
+        }
+        if (length > 0 && rand_r(&seed) % 4) {
+            path[0] = '/';
+            path[length - 1] = '/';
+        }
+        path[length] = '\0';
+        check(path);
+    }
+
+}
+
+int main(void) {
+
+    for (int w = 0; w < N_WIDTHS; ++w) {
+        if (path_force_width(widths[w]))
+            forced[n_forced++] = widths[w];
+        else
+            printf("width %d: not supported here, skipped\n", widths[w]);
+    }
+    CHECK(path_force_width(-1));
+    CHECK(!path_force_width(8));
+    check_edge_cases();
+    check_random(RANDOM_PATHS);
+    printf("ok\n");
+    return 0;
+
+}
@@ -0,0 +1,218 @@
+// Tests of tree_remove_recursive: large subtrees, wide and deep, removed while
+// other threads list and walk them, after which the tree uses as much memory
+// as before they were created, so every folder of them was freed.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Tree.h"
+
+#define FANOUT 6
+#define LEVELS 6 // 6 + 36 + ... + 6^6 folders, over 55000.
+#define WIDE 5000
+#define DEEP 500
+#define ROUNDS 3
+#define LISTERS 2
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static Tree *tree;
+static atomic_bool stop;
+static atomic_size_t listed; // Folders listed by all readers so far.
+
+// Writes the name of the i-th folder to name, and returns its length.
+static size_t folder_name(char *name, int i) {
+
+    size_t length = 0;
+    do {
+        name[length++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    return length;
+
+}
+
+// Appends the i-th name and a slash to the path of `length` bytes, and returns
+// the new length.
+static size_t append(char *path, size_t length, int i) {
+
+    length += folder_name(path + length, i);
+    strcpy(path + length, "/");
+    return length + 1;
+
+}
+
+// Creates `levels` levels of `FANOUT` subfolders below the existing folder.
+static void build_full(char *path, size_t length, int levels) {
+
+    if (levels == 0)
+        return;
+    for (int i = 0; i < FANOUT; ++i) {
+        size_t child = append(path, length, i);
+        CHECK(tree_create(tree, path) == 0);
+        build_full(path, child, levels - 1);
+    }
+    path[length] = '\0';
+
+}
+
+// Creates below /big/ a full tree, a folder with many subfolders, and a long
+// chain of folders.
+static void build(void) {
+
+    char path[MAX_PATH_LENGTH_UTILS + 1] = "/big/full/";
+    CHECK(tree_create(tree, path) == 0);
+    build_full(path, strlen(path), LEVELS);
+
+    CHECK(tree_create(tree, "/big/wide/") == 0);
+    for (int i = 0; i < WIDE; ++i) {
+        strcpy(path, "/big/wide/");
+        append(path, strlen(path), i);
+        CHECK(tree_create(tree, path) == 0);
+    }
+
+    strcpy(path, "/big/");
+    size_t length = strlen(path);
+    for (int i = 0; i < DEEP; ++i) {
+        length = append(path, length, i % 2);
+        CHECK(tree_create(tree, path) == 0);
+    }
+
+}
+
+// Lists the folder at `path` and every folder below it, as far as they are
+// still there.
+static void list_recursively(const char *path) {
+
+    char *list = tree_list(tree, path);
+    if (list == NULL)
+        return;
+    atomic_fetch_add(&listed, 1);
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name && !atomic_load(&stop)) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        list_recursively(child);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+
+}
+
+static void *list_big(void *arg) {
+
+    (void) arg;
+    while (!atomic_load(&stop))
+        list_recursively("/big/");
+    return NULL;
+
+}
+
+static int count_visit(const char *path, void *context) {
+
+    (void) path;
+    (void) context;
+    atomic_fetch_add(&listed, 1);
+    return 0;
+
+}
+
+static void *walk_big(void *arg) {
+
+    (void) arg;
+    while (!atomic_load(&stop)) {
+        int code = tree_walk(tree, "/big/", count_visit, NULL, 2);
+        CHECK(code == 0 || code == ENOENT);
+    }
+    return NULL;
+
+}
+
+static void test_removed_while_read(void) {
+
+    tree = tree_new();
+    CHECK(tree_create(tree, "/big/") == 0);
+    size_t empty = tree_memory(tree);
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        build();
+        CHECK(tree_memory(tree) > empty);
+
+        atomic_store(&stop, false);
+        atomic_store(&listed, 0);
+        pthread_t readers[LISTERS + 1];
+        for (int i = 0; i < LISTERS; ++i)
+            CHECK(pthread_create(&readers[i], NULL, list_big, NULL) == 0);
+        CHECK(pthread_create(&readers[LISTERS], NULL, walk_big, NULL) == 0);
+        // Removed with the readers deep inside.
+        while (atomic_load(&listed) < 10000)
+            sched_yield();
+        CHECK(tree_remove_recursive(tree, "/big/") == 0);
+        atomic_store(&stop, true);
+        for (int i = 0; i <= LISTERS; ++i)
+            CHECK(pthread_join(readers[i], NULL) == 0);
+
+        char *list = tree_list(tree, "/");
+        CHECK(strcmp(list, "") == 0);
+        free(list);
+        CHECK(tree_create(tree, "/big/") == 0);
+        CHECK(tree_memory(tree) == empty);
+    }
+    tree_free(tree);
+
+}
+
+static void test_removed_below(void) {
+
+    tree = tree_new();
+    CHECK(tree_create(tree, "/big/") == 0);
+    CHECK(tree_create(tree, "/other/") == 0);
+    size_t before = tree_memory(tree);
+    build();
+    CHECK(tree_remove_recursive(tree, "/big/full/") == 0);
+    CHECK(tree_remove_recursive(tree, "/big/wide/") == 0);
+    CHECK(tree_remove_recursive(tree, "/big/a/") == 0);
+    CHECK(tree_remove_recursive(tree, "/big/a/") == ENOENT);
+    CHECK(tree_remove_recursive(tree, "/") == EBUSY);
+    CHECK(tree_remove_recursive(tree, "/big") == EINVAL);
+    CHECK(tree_memory(tree) == before);
+
+    // A snapshot keeps the removed folders until it is released.
+    build();
+    TreeSnapshot *snapshot = tree_snapshot(tree, "/big/");
+    CHECK(tree_remove_recursive(tree, "/big/full/") == 0);
+    CHECK(tree_remove_recursive(tree, "/big/wide/") == 0);
+    CHECK(tree_remove_recursive(tree, "/big/a/") == 0);
+    CHECK(tree_memory(tree) > before);
+    tree_snapshot_release(snapshot);
+    CHECK(tree_memory(tree) == before);
+
+    char *list = tree_list(tree, "/");
+    CHECK(strcmp(list, "big,other") == 0);
+    free(list);
+    list = tree_list(tree, "/big/");
+    CHECK(strcmp(list, "") == 0);
+    free(list);
+    tree_free(tree);
+
+}
+
+int main(void) {
+
+    test_removed_while_read();
+    test_removed_below();
+    printf("ok\n");
+    return 0;
+
+}
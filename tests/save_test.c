@@ -0,0 +1,207 @@
+// Tests of tree_save and tree_load: a tree loaded back, on one thread and on
+// several, lists every folder as the saved one, and files that are not saved
+// trees, short or corrupted, are refused with EINVAL.
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../Tree.h"
+
+#define FOLDERS 20000
+#define LOAD_THREADS 4
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static int temporary_file(void) {
+
+    char name[] = "/tmp/save_testXXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    unlink(name);
+    return fd;
+
+}
+
+// Creates `folders` folders at random places, some deep and some wide, with
+// names of different lengths.
+static void build(Tree *tree, size_t folders) {
+
+    char **paths = malloc((folders + 1) * sizeof(char *));
+    CHECK(paths != NULL);
+    paths[0] = strdup("/");
+    size_t count = 1;
+    unsigned seed = 1;
+    while (count <= folders) {
+        const char *parent = paths[rand_r(&seed) % count];
+        char name[16];
+        int length = 1 + rand_r(&seed) % 8;
+        for (int i = 0; i < length; ++i)
+            name[i] = 'a' + rand_r(&seed) % 26;
+        size_t parent_length = strlen(parent);
+        if (parent_length + length + 1 > MAX_PATH_LENGTH_UTILS)
+            continue;
+        char path[MAX_PATH_LENGTH_UTILS + 1];
+        memcpy(path, parent, parent_length);
+        memcpy(path + parent_length, name, length);
+        strcpy(path + parent_length + length, "/");
+        if (tree_create(tree, path) == 0)
+            paths[count++] = strdup(path);
+    }
+    for (size_t i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+
+}
+
+// Checks that the folder at `path` and every folder below it list the same in
+// both trees, and returns their number.
+static size_t check_folder(Tree *saved, Tree *loaded, const char *path) {
+
+    char *list = tree_list(saved, path);
+    char *loaded_list = tree_list(loaded, path);
+    CHECK(list != NULL && loaded_list != NULL);
+    CHECK(strcmp(list, loaded_list) == 0);
+    free(loaded_list);
+
+    size_t folders = 1;
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        folders += check_folder(saved, loaded, child);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+    return folders;
+
+}
+
+static void test_round_trip(void) {
+
+    Tree *tree = tree_new();
+    build(tree, FOLDERS);
+    int fd = temporary_file();
+    CHECK(tree_save(tree, fd) == 0);
+
+    Tree *loaded = tree_load(fd);
+    CHECK(loaded != NULL);
+    CHECK(check_folder(tree, loaded, "/") == FOLDERS + 1);
+    tree_free(loaded);
+
+    loaded = tree_load_threads(fd, LOAD_THREADS);
+    CHECK(loaded != NULL);
+    CHECK(check_folder(tree, loaded, "/") == FOLDERS + 1);
+    // The loaded tree can be changed like any other.
+    CHECK(tree_create(loaded, "/new/") == 0);
+    CHECK(tree_remove(loaded, "/new/") == 0);
+    tree_free(loaded);
+
+    // An empty tree is the root alone.
+    Tree *empty = tree_new();
+    CHECK(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    CHECK(tree_save(empty, fd) == 0);
+    loaded = tree_load(fd);
+    CHECK(loaded != NULL);
+    CHECK(check_folder(empty, loaded, "/") == 1);
+    tree_free(loaded);
+    tree_free(empty);
+
+    tree_free(tree);
+    close(fd);
+
+}
+
+// Checks that both tree_load and tree_load_threads refuse the file `fd`.
+static void check_invalid(int fd) {
+
+    errno = 0;
+    CHECK(tree_load(fd) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(tree_load_threads(fd, LOAD_THREADS) == NULL && errno == EINVAL);
+
+}
+
+// Returns a file with `size` bytes of `data`.
+static int file_with(const char *data, size_t size) {
+
+    int fd = temporary_file();
+    CHECK(write(fd, data, size) == (ssize_t) size);
+    return fd;
+
+}
+
+static void test_invalid(void) {
+
+    Tree *tree = tree_new();
+    build(tree, 100);
+    int fd = temporary_file();
+    CHECK(tree_save(tree, fd) == 0);
+    tree_free(tree);
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *saved = malloc(size);
+    CHECK(saved != NULL && pread(fd, saved, size, 0) == size);
+    close(fd);
+
+    // Empty, shorter than the header, and cut anywhere after it.
+    size_t lengths[] = {0, 7, 31, 32, 40, size / 2, size - 1};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        fd = file_with(saved, lengths[i]);
+        check_invalid(fd);
+        close(fd);
+    }
+
+    // Longer than the folders say.
+    char *longer = malloc(size + 1);
+    CHECK(longer != NULL);
+    memcpy(longer, saved, size);
+    longer[size] = 'x';
+    fd = file_with(longer, size + 1);
+    check_invalid(fd);
+    close(fd);
+    free(longer);
+
+    // Not a saved tree at all.
+    char text[256];
+    memset(text, 'x', sizeof(text));
+    fd = file_with(text, sizeof(text));
+    check_invalid(fd);
+    close(fd);
+
+    // Every single byte of the header and of the first folders flipped; the
+    // file is either refused or loads as some tree, but nothing breaks.
+    for (off_t i = 0; i < size && i < 256; ++i) {
+        saved[i] ^= 0x5a;
+        fd = file_with(saved, size);
+        Tree *loaded = tree_load(fd);
+        if (i < 8)
+            CHECK(loaded == NULL && errno == EINVAL); // The magic.
+        if (loaded)
+            tree_free(loaded);
+        loaded = tree_load_threads(fd, LOAD_THREADS);
+        if (loaded)
+            tree_free(loaded);
+        close(fd);
+        saved[i] ^= 0x5a;
+    }
+    free(saved);
+
+}
+
+int main(void) {
+
+    test_round_trip();
+    test_invalid();
+    printf("ok\n");
+    return 0;
+
+}
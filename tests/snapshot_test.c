@@ -0,0 +1,249 @@
+// Tests of snapshots: a snapshot lists the same while folders are created,
+// removed and moved at the same time, and what the tree kept for snapshots,
+// the subfolders folders had and the folders removed, is freed once no
+// snapshot needs it any more.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Tree.h"
+
+#define THREADS 3
+#define READS 200
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// Lists a folder of the tree or of a snapshot.
+typedef char *(*List)(void *source, const char *path);
+
+static char *list_tree(void *tree, const char *path) {
+
+    return tree_list(tree, path);
+
+}
+
+static char *list_snapshot(void *snapshot, const char *path) {
+
+    return tree_snapshot_list(snapshot, path);
+
+}
+
+// Appends to `out` the path and listing of the folder at `path` and of every
+// folder below it, in preorder, with paths from the folder `skip` bytes in.
+static void dump_folder(List list, void *source, const char *path, size_t skip, FILE *out) {
+
+    char *names = list(source, path);
+    CHECK(names != NULL);
+    fprintf(out, "/%s:%s\n", path + skip, names);
+    char *save, *name = strtok_r(names, ",", &save);
+    while (name) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        dump_folder(list, source, child, skip, out);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(names);
+
+}
+
+// Returns every folder below `path` with its listing and its path from there,
+// freed by the caller.
+static char *dump(List list, void *source, const char *path) {
+
+    char *text;
+    size_t length;
+    FILE *out = open_memstream(&text, &length);
+    CHECK(out != NULL);
+    dump_folder(list, source, path, strlen(path), out);
+    fclose(out);
+    return text;
+
+}
+
+static void check_stats(Tree *tree, bool kept) {
+
+    size_t histories, graves;
+    tree_snapshot_stats(tree, &histories, &graves);
+    if (kept)
+        CHECK(histories > 0 && graves > 0);
+    else
+        CHECK(histories == 0 && graves == 0);
+
+}
+
+// Writes a random path of one to four names out of three to path, so that
+// changes often meet in the same folders.
+static void random_path(unsigned *seed, char *path) {
+
+    int depth = 1 + rand_r(seed) % 4;
+    char *end = path;
+    *end++ = '/';
+    for (int i = 0; i < depth; ++i) {
+        *end++ = 'a' + rand_r(seed) % 3;
+        *end++ = '/';
+    }
+    *end = '\0';
+
+}
+
+// Creates every folder random_path can write.
+static void build(Tree *tree, const char *path, int depth) {
+
+    if (depth == 4)
+        return;
+    char child[16];
+    size_t length = strlen(path);
+    memcpy(child, path, length);
+    strcpy(child + length + 1, "/");
+    for (char name = 'a'; name <= 'c'; ++name) {
+        child[length] = name;
+        CHECK(tree_create(tree, child) == 0);
+        build(tree, child, depth + 1);
+    }
+
+}
+
+typedef struct Worker {
+    Tree *tree;
+    unsigned seed;
+} Worker;
+
+static atomic_bool stop;
+
+static void *work(void *arg) {
+
+    Worker *worker = arg;
+    char path[16], target[16];
+    size_t created;
+    while (!atomic_load(&stop)) {
+        random_path(&worker->seed, path);
+        random_path(&worker->seed, target);
+        switch (rand_r(&worker->seed) % 5) {
+            case 0: tree_create(worker->tree, path); break;
+            case 1: tree_create_recursive(worker->tree, path, &created); break;
+            case 2: tree_remove(worker->tree, path); break;
+            case 3: tree_remove_recursive(worker->tree, path); break;
+            default: tree_move(worker->tree, path, target); break;
+        }
+    }
+    return NULL;
+
+}
+
+static void test_concurrent(void) {
+
+    Tree *tree = tree_new();
+    build(tree, "/", 0);
+    char *expected = dump(list_tree, tree, "/");
+    char *expected_below = dump(list_tree, tree, "/b/a/");
+    TreeSnapshot *snapshot = tree_snapshot(tree, "/");
+    TreeSnapshot *below = tree_snapshot(tree, "/b/a/");
+    CHECK(snapshot != NULL && below != NULL);
+    CHECK(tree_snapshot(tree, "/d/") == NULL);
+    CHECK(tree_snapshot(tree, "/a") == NULL);
+
+    atomic_store(&stop, false);
+    pthread_t threads[THREADS];
+    Worker workers[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        workers[i] = (Worker) {tree, i * 7919 + 1};
+        CHECK(pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+    }
+    for (int i = 0; i < READS; ++i) {
+        // Snapshots of the whole tree and of a folder in it, which is itself
+        // moved and removed meanwhile.
+        char *text = dump(list_snapshot, snapshot, "/");
+        CHECK(strcmp(text, expected) == 0);
+        free(text);
+        text = dump(list_snapshot, below, "/");
+        CHECK(strcmp(text, expected_below) == 0);
+        free(text);
+        // Taken while everything changes, and released at once.
+        tree_snapshot_release(tree_snapshot(tree, "/"));
+    }
+    atomic_store(&stop, true);
+    for (int i = 0; i < THREADS; ++i)
+        CHECK(pthread_join(threads[i], NULL) == 0);
+
+    // Still the same with the tree left alone.
+    char *text = dump(list_snapshot, snapshot, "/");
+    CHECK(strcmp(text, expected) == 0);
+    free(text);
+    check_stats(tree, true);
+    tree_snapshot_release(below);
+    tree_snapshot_release(snapshot);
+    check_stats(tree, false);
+
+    free(expected_below);
+    free(expected);
+    tree_free(tree);
+
+}
+
+static void test_reclaimed(void) {
+
+    Tree *tree = tree_new();
+    build(tree, "/", 2);
+    check_stats(tree, false);
+    // With no snapshot, nothing is kept.
+    CHECK(tree_create(tree, "/d/") == 0);
+    CHECK(tree_remove(tree, "/d/") == 0);
+    check_stats(tree, false);
+
+    char *first_expected = dump(list_tree, tree, "/");
+    TreeSnapshot *first = tree_snapshot(tree, "/");
+    CHECK(tree_create(tree, "/d/") == 0);
+    CHECK(tree_remove_recursive(tree, "/a/") == 0);
+    CHECK(tree_move(tree, "/b/c/", "/d/c/") == 0);
+    check_stats(tree, true);
+
+    char *second_expected = dump(list_tree, tree, "/");
+    TreeSnapshot *second = tree_snapshot(tree, "/");
+    CHECK(tree_remove(tree, "/b/a/") == 0);
+    CHECK(tree_move(tree, "/d/", "/e/") == 0);
+
+    char *text = dump(list_snapshot, first, "/");
+    CHECK(strcmp(text, first_expected) == 0);
+    free(text);
+
+    // What the second snapshot needs is kept after the first is released.
+    size_t histories, graves, both_histories, both_graves;
+    tree_snapshot_stats(tree, &both_histories, &both_graves);
+    tree_snapshot_release(first);
+    tree_snapshot_stats(tree, &histories, &graves);
+    CHECK(histories > 0 && histories < both_histories);
+    CHECK(graves > 0 && graves < both_graves);
+    text = dump(list_snapshot, second, "/");
+    CHECK(strcmp(text, second_expected) == 0);
+    free(text);
+    tree_snapshot_release(second);
+    check_stats(tree, false);
+
+    // Changes made after that keep nothing either.
+    CHECK(tree_create(tree, "/f/") == 0);
+    CHECK(tree_remove(tree, "/f/") == 0);
+    check_stats(tree, false);
+
+    free(second_expected);
+    free(first_expected);
+    tree_free(tree);
+
+}
+
+int main(void) {
+
+    test_concurrent();
+    test_reclaimed();
+    printf("ok\n");
+    return 0;
+
+}
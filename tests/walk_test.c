@@ -0,0 +1,225 @@
+// Tests of tree_walk: on any number of threads, it reports the same folders,
+// each once, as a serial traversal with tree_list, on trees wide, deep and
+// random; it stops when the callback says so and ends with threads that never
+// got any work.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Tree.h"
+
+#define FOLDERS 20000
+#define WIDE 5000
+#define DEEP 500
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const int thread_counts[] = {1, 2, 3, 8, 32};
+
+// Paths reported to a callback, in any order.
+typedef struct Visits {
+    pthread_mutex_t lock;
+    char **paths;
+    size_t count, capacity;
+    size_t stop_after; // Visits after which the callback stops the walk, or 0.
+} Visits;
+
+static int visit(const char *path, void *context) {
+
+    Visits *visits = context;
+    CHECK(pthread_mutex_lock(&visits->lock) == 0);
+    if (visits->count == visits->capacity) {
+        visits->capacity = visits->capacity ? visits->capacity * 2 : 64;
+        visits->paths = realloc(visits->paths, visits->capacity * sizeof(char *));
+        CHECK(visits->paths != NULL);
+    }
+    visits->paths[visits->count++] = strdup(path);
+    bool stop = visits->count == visits->stop_after;
+    CHECK(pthread_mutex_unlock(&visits->lock) == 0);
+    return stop;
+
+}
+
+static void visits_init(Visits *visits, size_t stop_after) {
+
+    CHECK(pthread_mutex_init(&visits->lock, NULL) == 0);
+    visits->paths = NULL;
+    visits->count = visits->capacity = 0;
+    visits->stop_after = stop_after;
+
+}
+
+static void visits_destroy(Visits *visits) {
+
+    for (size_t i = 0; i < visits->count; ++i)
+        free(visits->paths[i]);
+    free(visits->paths);
+    CHECK(pthread_mutex_destroy(&visits->lock) == 0);
+
+}
+
+static int compare_paths(const void *a, const void *b) {
+
+    return strcmp(*(char *const *) a, *(char *const *) b);
+
+}
+
+static void sort_visits(Visits *visits) {
+
+    qsort(visits->paths, visits->count, sizeof(char *), compare_paths);
+
+}
+
+// Visits the folder at `path` and every folder below it with tree_list.
+static void list_recursively(Tree *tree, const char *path, Visits *visits) {
+
+    visit(path, visits);
+    char *list = tree_list(tree, path);
+    CHECK(list != NULL);
+    char *save, *name = strtok_r(list, ",", &save);
+    while (name) {
+        char child[MAX_PATH_LENGTH_UTILS + 1];
+        snprintf(child, sizeof(child), "%s%s/", path, name);
+        list_recursively(tree, child, visits);
+        name = strtok_r(NULL, ",", &save);
+    }
+    free(list);
+
+}
+
+// Checks that tree_walk from `path` on any number of threads reports what the
+// serial traversal does, and returns the number of folders.
+static size_t check_walk(Tree *tree, const char *path) {
+
+    Visits expected;
+    visits_init(&expected, 0);
+    list_recursively(tree, path, &expected);
+    sort_visits(&expected);
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+        Visits visits;
+        visits_init(&visits, 0);
+        CHECK(tree_walk(tree, path, visit, &visits, thread_counts[i]) == 0);
+        sort_visits(&visits);
+        CHECK(visits.count == expected.count);
+        for (size_t j = 0; j < visits.count; ++j)
+            CHECK(strcmp(visits.paths[j], expected.paths[j]) == 0);
+        visits_destroy(&visits);
+    }
+    size_t folders = expected.count;
+    visits_destroy(&expected);
+    return folders;
+
+}
+
+// Writes the name of the i-th folder to name, and returns its length.
+static size_t folder_name(char *name, int i) {
+
+    size_t length = 0;
+    do {
+        name[length++] = 'a' + i % 26;
+        i /= 26;
+    } while (i > 0);
+    return length;
+
+}
+
+// Creates `folders` folders at random places, some deep and some wide.
+static void build_random(Tree *tree, size_t folders) {
+
+    char **paths = malloc((folders + 1) * sizeof(char *));
+    CHECK(paths != NULL);
+    paths[0] = strdup("/");
+    size_t count = 1;
+    unsigned seed = 1;
+    while (count <= folders) {
+        const char *parent = paths[rand_r(&seed) % count];
+        size_t length = strlen(parent);
+        if (length + 8 > MAX_PATH_LENGTH_UTILS)
+            continue;
+        char path[MAX_PATH_LENGTH_UTILS + 1];
+        memcpy(path, parent, length);
+        length += folder_name(path + length, rand_r(&seed) % 1000);
+        strcpy(path + length, "/");
+        if (tree_create(tree, path) == 0)
+            paths[count++] = strdup(path);
+    }
+    for (size_t i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+
+}
+
+static void test_shapes(void) {
+
+    Tree *tree = tree_new();
+    CHECK(check_walk(tree, "/") == 1);
+
+    // Many subfolders of one folder, shared out by halves.
+    char path[MAX_PATH_LENGTH_UTILS + 1] = "/wide/";
+    CHECK(tree_create(tree, path) == 0);
+    for (int i = 0; i < WIDE; ++i) {
+        size_t length = strlen("/wide/");
+        length += folder_name(path + length, i);
+        strcpy(path + length, "/");
+        CHECK(tree_create(tree, path) == 0);
+    }
+    CHECK(check_walk(tree, "/wide/") == WIDE + 1);
+
+    // One folder in each, shared out from the lowest frame.
+    strcpy(path, "/deep/");
+    for (int i = 0; i < DEEP; ++i) {
+        CHECK(tree_create(tree, path) == 0);
+        strcat(path, i % 2 ? "b/" : "a/");
+    }
+    CHECK(check_walk(tree, "/deep/") == DEEP);
+
+    build_random(tree, FOLDERS);
+    CHECK(check_walk(tree, "/") == FOLDERS + WIDE + DEEP + 2);
+    tree_free(tree);
+
+}
+
+static void test_errors_and_stop(void) {
+
+    Tree *tree = tree_new();
+    build_random(tree, 2000);
+    Visits visits;
+    visits_init(&visits, 0);
+    CHECK(tree_walk(tree, "/a", visit, &visits, 2) == EINVAL);
+    CHECK(tree_walk(tree, "/", visit, &visits, 0) == EINVAL);
+    CHECK(tree_walk(tree, "/nothere/", visit, &visits, 2) == ENOENT);
+    CHECK(visits.count == 0);
+    visits_destroy(&visits);
+
+    // Stopped right away, and after some folders, with workers that may be
+    // waiting for work.
+    size_t stops[] = {1, 2, 100, 1999};
+    for (size_t i = 0; i < sizeof(stops) / sizeof(stops[0]); ++i) {
+        for (size_t j = 0; j < sizeof(thread_counts) / sizeof(thread_counts[0]); ++j) {
+            visits_init(&visits, stops[i]);
+            CHECK(tree_walk(tree, "/", visit, &visits, thread_counts[j]) == ECANCELED);
+            CHECK(visits.count >= stops[i] && visits.count <= 2001);
+            visits_destroy(&visits);
+        }
+    }
+    tree_free(tree);
+
+}
+
+int main(void) {
+
+    test_shapes();
+    test_errors_and_stop();
+    printf("ok\n");
+    return 0;
+
+}
@@ -0,0 +1,180 @@
+// Converts a file written by tree_trace_dump to the Chrome trace JSON format,
+// which chrome://tracing and https://ui.perfetto.dev open.
+//
+// Usage: trace_to_json trace.bin > trace.json
+// Each thread becomes a track with a slice per operation (its path in args),
+// nested slices for waits for folder locks, and async slices showing how long
+// each lock was held, with the address of the folder as their id.
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../Tree.h"
+#include "../trace.h"
+
+static const char *operation_names[TREE_OPERATIONS] = {"list", "create", "remove", "move"};
+
+static const char *lock_names[] = {"read", "write", "idle"};
+
+typedef struct Thread {
+    TraceRingHeader header;
+    TraceEvent *events;
+} Thread;
+
+static bool first_event = true;
+
+static double ns_per_tick;
+
+// Prints the start of a JSON event, up to and including "ts".
+static void start_event(const char *name, const char *category, char phase,
+                        uint32_t thread, uint64_t time, uint64_t base) {
+
+    printf("%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%" PRIu32
+           ",\"ts\":%.3f", first_event ? "" : ",", name, category, phase, thread,
+           (time - base) * ns_per_tick / 1e3);
+    first_event = false;
+
+}
+
+static const char *operation_name(uint8_t operation) {
+
+    return operation < TREE_OPERATIONS ? operation_names[operation] : "unknown";
+
+}
+
+static const char *lock_name(uint8_t lock) {
+
+    return lock <= TRACE_IDLE ? lock_names[lock] : "unknown";
+
+}
+
+static void convert(const Thread *thread, uint64_t base) {
+
+    uint32_t tid = thread->header.thread;
+    int depth = 0; // Operations begun and not ended.
+    bool waiting = false;
+    for (uint64_t i = 0; i < thread->header.count; ++i) {
+        const TraceEvent *event = &thread->events[i];
+        char name[32];
+        switch (event->type) {
+            case TRACE_BEGIN: {
+                start_event(operation_name(event->arg), "operation", 'B', tid,
+                            event->time, base);
+                // Paths consist of letters and slashes only, so need no escaping.
+                printf(",\"args\":{\"path\":\"");
+                size_t printed = 0;
+                while (printed < event->length && i + 1 < thread->header.count &&
+                       thread->events[i + 1].type == TRACE_TEXT) {
+                    const TraceEvent *text = &thread->events[++i];
+                    for (size_t j = 0; j < text->length; ++j, ++printed) {
+                        if (text->text[j] == ' ')
+                            printf("\",\"target\":\"");
+                        else
+                            putchar(text->text[j]);
+                    }
+                }
+                printf("\"}}");
+                depth++;
+                break;
+            }
+            case TRACE_END:
+                if (depth == 0)
+                    break; // Began before the oldest event kept.
+                start_event(operation_name(event->arg), "operation", 'E', tid,
+                            event->time, base);
+                printf("}");
+                depth--;
+                break;
+            case TRACE_WAIT:
+                snprintf(name, sizeof(name), "wait %s", lock_name(event->arg));
+                start_event(name, "lock", 'B', tid, event->time, base);
+                printf(",\"args\":{\"node\":\"0x%" PRIx64 "\"}}", event->node);
+                waiting = true;
+                break;
+            case TRACE_ACQUIRE:
+                if (waiting) {
+                    snprintf(name, sizeof(name), "wait %s", lock_name(event->arg));
+                    start_event(name, "lock", 'E', tid, event->time, base);
+                    printf("}");
+                    waiting = false;
+                }
+                if (event->arg == TRACE_IDLE)
+                    break;
+                // Fallthrough.
+            case TRACE_RELEASE:
+                snprintf(name, sizeof(name), "hold %s", lock_name(event->arg));
+                start_event(name, "lock", event->type == TRACE_ACQUIRE ? 'b' : 'e', tid,
+                            event->time, base);
+                printf(",\"id\":\"0x%" PRIx64 ".%" PRIu32 "\"}", event->node, tid);
+                break;
+            default:
+                break;
+        }
+    }
+
+}
+
+int main(int argc, char *argv[]) {
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin > trace.json\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.event_size != sizeof(TraceEvent)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 1;
+    }
+    ns_per_tick = header.ticks[1] > header.ticks[0]
+                  ? (double) (header.ns[1] - header.ns[0]) / (header.ticks[1] - header.ticks[0])
+                  : 1;
+    Thread *threads = calloc(header.rings, sizeof(Thread));
+    if (threads == NULL) {
+        fprintf(stderr, "calloc failed\n");
+        return 1;
+    }
+    uint64_t base = UINT64_MAX;
+    for (uint32_t i = 0; i < header.rings; ++i) {
+        Thread *thread = &threads[i];
+        if (fread(&thread->header, sizeof(TraceRingHeader), 1, file) != 1) {
+            fprintf(stderr, "%s: truncated\n", argv[1]);
+            return 1;
+        }
+        thread->events = malloc(thread->header.count * sizeof(TraceEvent) + 1);
+        if (thread->events == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return 1;
+        }
+        if (fread(thread->events, sizeof(TraceEvent), thread->header.count, file) !=
+            thread->header.count) {
+            fprintf(stderr, "%s: truncated\n", argv[1]);
+            return 1;
+        }
+        for (uint64_t j = 0; j < thread->header.count; ++j) {
+            if (thread->events[j].type != TRACE_TEXT && thread->events[j].time < base)
+                base = thread->events[j].time;
+        }
+    }
+    fclose(file);
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (uint32_t i = 0; i < header.rings; ++i) {
+        convert(&threads[i], base);
+        free(threads[i].events);
+    }
+    printf("\n]}\n");
+    free(threads);
+    return 0;
+
+}
@@ -0,0 +1,235 @@
+#include "trace.h"
+#include "err.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define CACHE_LINE 64
+
+typedef struct Ring Ring;
+
+// Events of one thread. Rings are never freed; a ring of an exited thread is
+// reused, with its events, by the next thread that needs one.
+struct Ring {
+    // Number of events ever recorded; event i is in events[i % TRACE_EVENTS].
+    _Alignas(CACHE_LINE) _Atomic uint64_t head;
+    atomic_bool in_use;
+    Ring *next;
+    uint32_t thread;
+    TraceEvent events[TRACE_EVENTS];
+};
+
+// Clock readings taken together with readings of now(), to convert its ticks
+// to nanoseconds.
+static uint64_t start_ticks, start_ns;
+
+static _Atomic(Ring *) rings;
+static atomic_uint next_thread;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local Ring *self;
+
+static uint64_t monotonic_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+}
+
+// The time stamp counter is read several times faster than the clock.
+static uint64_t now(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+
+}
+
+static void release_ring(void *arg) {
+
+    Ring *ring = arg;
+    atomic_store_explicit(&ring->in_use, false, memory_order_release);
+
+}
+
+static void make_ring_key(void) {
+
+    if (pthread_key_create(&ring_key, release_ring) != 0)
+        fatal("pthread_key_create failed");
+    start_ns = monotonic_ns();
+    start_ticks = now();
+
+}
+
+static Ring *get_ring(void) {
+
+    if (self)
+        return self;
+
+    pthread_once(&ring_key_once, make_ring_key);
+    for (Ring *ring = atomic_load_explicit(&rings, memory_order_acquire); ring;
+         ring = ring->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&ring->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&ring->in_use, &expected, true)) {
+            self = ring;
+            break;
+        }
+    }
+
+    if (!self) {
+        Ring *ring = aligned_alloc(CACHE_LINE, sizeof(Ring));
+        if (ring == NULL)
+            fatal("aligned_alloc failed");
+        memset(ring, 0, sizeof(Ring));
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->in_use, true);
+        ring->thread = atomic_fetch_add(&next_thread, 1);
+        ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                                                      memory_order_release,
+                                                      memory_order_relaxed));
+        self = ring;
+    }
+
+    if (pthread_setspecific(ring_key, self) != 0)
+        fatal("pthread_setspecific failed");
+    return self;
+
+}
+
+// Returns the slot of the next event; it is published by publish.
+static TraceEvent *next_event(Ring *ring) {
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    return &ring->events[head % TRACE_EVENTS];
+
+}
+
+static void publish(Ring *ring) {
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+}
+
+static void record(uint8_t type, uint8_t arg, uint16_t length, const void *node) {
+
+    uint64_t time = now();
+    Ring *ring = get_ring();
+    TraceEvent *event = next_event(ring);
+    event->type = type;
+    event->arg = arg;
+    event->length = length;
+    event->time = time;
+    event->node = (uintptr_t) node;
+    publish(ring);
+
+}
+
+void trace_begin(uint8_t operation, const char *path, const char *target) {
+
+    size_t path_length = path ? strlen(path) : 0;
+    size_t length = target ? path_length + 1 + strlen(target) : path_length;
+    record(TRACE_BEGIN, operation, length, NULL);
+    Ring *ring = self;
+    for (size_t done = 0; done < length; done += TRACE_TEXT_BYTES) {
+        TraceEvent *event = next_event(ring);
+        event->type = TRACE_TEXT;
+        event->length = length - done < TRACE_TEXT_BYTES ? length - done : TRACE_TEXT_BYTES;
+        for (size_t i = 0; i < event->length; ++i) {
+            size_t at = done + i;
+            event->text[i] = at < path_length ? path[at]
+                           : at == path_length ? ' ' : target[at - path_length - 1];
+        }
+        publish(ring);
+    }
+
+}
+
+void trace_end(uint8_t operation) {
+
+    record(TRACE_END, operation, 0, NULL);
+
+}
+
+void trace_lock(TraceType type, TraceLock lock, const void *node) {
+
+    record(type, lock, 0, node);
+
+}
+
+// The owner may be overwriting the events meanwhile; torn ones are dropped
+// by the caller, so the race is hidden from the thread sanitizer.
+__attribute__((no_sanitize("thread")))
+static void copy_events(TraceEvent *to, const TraceEvent *from) {
+
+    memcpy(to, from, sizeof(TraceEvent) * TRACE_EVENTS);
+
+}
+
+// Writes the events of ring to file, using `events` as a buffer.
+static bool dump_ring(FILE *file, Ring *ring, TraceEvent *events) {
+
+    uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    copy_events(events, ring->events);
+    atomic_thread_fence(memory_order_acquire);
+    // Events before `start` may have been overwritten during the copy, the
+    // one at the current head possibly only in part.
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t start = head >= TRACE_EVENTS ? head - TRACE_EVENTS + 1 : 0;
+    if (start > end)
+        start = end;
+    // Text of an operation whose TRACE_BEGIN was lost is dropped too.
+    while (start < end && events[start % TRACE_EVENTS].type == TRACE_TEXT)
+        start++;
+
+    TraceRingHeader header = {ring->thread, 0, end - start};
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        return false;
+    for (uint64_t i = start; i < end; ++i) {
+        if (fwrite(&events[i % TRACE_EVENTS], sizeof(TraceEvent), 1, file) != 1)
+            return false;
+    }
+    return true;
+
+}
+
+int trace_dump(const char *path) {
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return errno;
+    TraceEvent *events = malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+    if (events == NULL)
+        fatal("malloc failed");
+
+    Ring *first = atomic_load_explicit(&rings, memory_order_acquire);
+    TraceFileHeader header = {TRACE_MAGIC, sizeof(TraceEvent), 0,
+                              {start_ticks, now()}, {start_ns, monotonic_ns()}};
+    for (Ring *ring = first; ring; ring = ring->next)
+        header.rings++;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (Ring *ring = first; ring && ok; ring = ring->next)
+        ok = dump_ring(file, ring, events);
+    int code = ok ? 0 : (errno ? errno : EIO);
+    if (fclose(file) != 0 && code == 0)
+        code = errno;
+
+    free(events);
+    return code;
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+
+// Per-thread tracing of operations and folder locks.
+//
+// Every thread records events into its own ring buffer of TRACE_EVENTS
+// fixed-size events, overwriting the oldest ones. Recording an event reads the
+// clock and stores to the thread's ring only, with no locks or shared writes,
+// so it can stay on all the time. trace_dump writes the latest events of all
+// threads to a binary file, which tools/trace_to_json converts to the Chrome
+// trace format read by chrome://tracing and Perfetto.
+
+#define TRACE_EVENTS 16384
+
+typedef enum TraceType {
+    // An operation starts; `arg` is its TreeOperation and `length` the length
+    // of its text (see trace_begin), carried by the TRACE_TEXT events that
+    // follow.
+    TRACE_BEGIN,
+    TRACE_END,
+    TRACE_TEXT, // `length` bytes of text of the TRACE_BEGIN before it.
+    TRACE_WAIT, // Started waiting for a lock of `node`; `arg` is a TraceLock.
+    TRACE_ACQUIRE, // Took a lock of `node` (after waiting, if TRACE_WAIT came first).
+    TRACE_RELEASE,
+} TraceType;
+
+typedef enum TraceLock {
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_IDLE, // Waiting until nobody uses a folder; never released.
+} TraceLock;
+
+#define TRACE_TEXT_BYTES 24
+
+typedef struct TraceEvent {
+    uint8_t type;
+    uint8_t arg;
+    uint16_t length;
+    uint32_t reserved;
+    union {
+        struct {
+            uint64_t time; // Clock ticks, see TraceFileHeader.
+            uint64_t node; // Address of the folder.
+            uint64_t unused;
+        };
+        char text[TRACE_TEXT_BYTES];
+    };
+} TraceEvent;
+
+// The file is a TraceFileHeader followed by `rings` times a TraceRingHeader
+// and `count` TraceEvents of that thread, oldest first, in native byte order.
+#define TRACE_MAGIC "TREETRC1"
+
+typedef struct TraceFileHeader {
+    char magic[8];
+    uint32_t event_size;
+    uint32_t rings;
+    // Two readings of the clock of events, and of CLOCK_MONOTONIC in
+    // nanoseconds at the same moments, to convert one to the other.
+    uint64_t ticks[2];
+    uint64_t ns[2];
+} TraceFileHeader;
+
+typedef struct TraceRingHeader {
+    // Rings are numbered in order of creation; the ring of a thread that
+    // exited is passed on to the next new thread.
+    uint32_t thread;
+    uint32_t reserved;
+    uint64_t count;
+} TraceRingHeader;
+
+// Records TRACE_BEGIN of an operation on `path` (which may be NULL); its text
+// is the path, followed by a space and `target` unless that is NULL.
+void trace_begin(uint8_t operation, const char *path, const char *target);
+
+void trace_end(uint8_t operation);
+
+void trace_lock(TraceType type, TraceLock lock, const void *node);
+
+// Writes the events of all threads to the file at `path`, while they keep
+// recording. Returns 0 or an errno value.
+int trace_dump(const char *path);